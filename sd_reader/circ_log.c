@@ -0,0 +1,550 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#include "byteordering.h"
+#include "circ_log.h"
+#include "circ_log_config.h"
+#include "sd-reader_config.h"
+
+#include <string.h>
+
+#if USE_DYNAMIC_MEMORY
+    #include <stdlib.h>
+#endif
+
+#if FAT_WRITE_SUPPORT && CIRC_LOG_COUNT && !USE_DYNAMIC_MEMORY && 2 * CIRC_LOG_COUNT > FAT_FILE_COUNT
+    #error "each circular log needs two file handles, raise FAT_FILE_COUNT"
+#endif
+
+#if DOXYGEN || (FAT_WRITE_SUPPORT && CIRC_LOG_COUNT)
+
+/**
+ * \addtogroup circ_log Circular log support
+ *
+ * A log file of fixed size which overwrites its oldest records when full.
+ *
+ * The file is preallocated once as a single run of clusters. Appending
+ * records then neither allocates clusters nor updates the directory entry.
+ * As records are written in sequence, the block cache of the device
+ * gathers them and each sector gets written once it is full.
+ *
+ * @{
+ */
+/**
+ * \file
+ * Circular log implementation (license: GPLv2 or LGPLv2.1)
+ */
+
+/**
+ * \addtogroup circ_log_config Configuration of circular log support
+ * Preprocessor defines to configure the circular log support.
+ */
+
+/**
+ * \addtogroup circ_log_file Circular log file layout
+ *
+ * header sector:
+ * ==============
+ * offset  length  description
+ *      0       4  magic "CLOG"
+ *      4       4  number of data sectors
+ *      8       4  sequence number of the first data sector ever written
+ *     12       4  sequence number of the newest data sector, when last synced
+ *
+ * data sector:
+ * ============
+ * offset  length  description
+ *      0       4  sequence number
+ *      4       n  records
+ *
+ * The data sectors follow the header sector and are used in turn. The
+ * data sector with sequence number \c seq is found at sector
+ * 1 + seq % (number of data sectors) of the file. Sequence numbers
+ * start at 1. When the log is formatted, the sequence numbers of all
+ * data sectors are cleared to 0, so no data found in the clusters
+ * before can be taken for a sector of the log. Each record starts
+ * with its length, followed by its data. A length of zero or the end
+ * of the sector ends the records of a sector.
+ *
+ * The newest sector given by the header may be outdated. When the log
+ * is opened, the sequence numbers of all data sectors are checked to
+ * find the newest sector actually written.
+ */
+
+#define CIRC_LOG_MAGIC 0x474f4c43 /* "CLOG" */
+
+struct circ_log_struct
+{
+    struct fat_file_struct* fd;
+    struct fat_file_struct* fd_aux;
+    uint32_t sector_count;
+    uint32_t first;
+    uint32_t head;
+    uint16_t head_offset;
+    uint32_t head_synced;
+    uint32_t read_seq;
+    uint16_t read_offset;
+};
+
+#if !USE_DYNAMIC_MEMORY
+static struct circ_log_struct circ_log_handles[CIRC_LOG_COUNT];
+#endif
+
+static int32_t circ_log_sector_offset(const struct circ_log_struct* log, uint32_t seq);
+static uint8_t circ_log_read_at(struct circ_log_struct* log, int32_t offset, uint8_t* buffer, uint16_t length);
+static uint8_t circ_log_write_at(struct circ_log_struct* log, int32_t offset, const uint8_t* buffer, uint16_t length);
+static uint8_t circ_log_sector_valid(struct circ_log_struct* log, uint32_t seq);
+static uint8_t circ_log_format(struct circ_log_struct* log, uint32_t size);
+static uint8_t circ_log_recover(struct circ_log_struct* log, uint32_t file_size);
+
+/**
+ * Opens a circular log.
+ *
+ * If the file is empty, it is preallocated with the given size and
+ * formatted as a circular log. Otherwise, the file must hold a circular
+ * log already, and \c size is ignored.
+ *
+ * The log keeps two handles of the file open, one for appending records
+ * and one for everything else.
+ *
+ * \param[in] fs The filesystem on which the log file lies.
+ * \param[in] dir_entry The directory entry of the log file.
+ * \param[in] size The size of a new log file in bytes, at least three sectors.
+ * \returns The log handle, or 0 on failure.
+ * \see circ_log_close
+ */
+struct circ_log_struct* circ_log_open(struct fat_fs_struct* fs, const struct fat_dir_entry_struct* dir_entry, uint32_t size)
+{
+    if(!fs || !dir_entry)
+        return 0;
+
+#if USE_DYNAMIC_MEMORY
+    struct circ_log_struct* log = malloc(sizeof(*log));
+    if(!log)
+        return 0;
+#else
+    struct circ_log_struct* log = circ_log_handles;
+    uint8_t i;
+    for(i = 0; i < CIRC_LOG_COUNT; ++i)
+    {
+        if(!log->fd)
+            break;
+
+        ++log;
+    }
+    if(i >= CIRC_LOG_COUNT)
+        return 0;
+#endif
+
+    memset(log, 0, sizeof(*log));
+
+    do
+    {
+        log->fd = fat_open_file(fs, dir_entry);
+        if(!log->fd)
+            break;
+        log->fd_aux = fat_open_file(fs, dir_entry);
+        if(!log->fd_aux)
+            break;
+
+        int32_t file_size = 0;
+        if(!fat_seek_file(log->fd_aux, &file_size, FAT_SEEK_END))
+            break;
+
+        if(file_size == 0)
+        {
+            if(!circ_log_format(log, size))
+                break;
+        }
+        else
+        {
+            if(!circ_log_recover(log, file_size))
+                break;
+        }
+
+        circ_log_rewind(log);
+        return log;
+
+    } while(0);
+
+    if(log->fd_aux)
+        fat_close_file(log->fd_aux);
+    if(log->fd)
+        fat_close_file(log->fd);
+#if USE_DYNAMIC_MEMORY
+    free(log);
+#else
+    log->fd = 0;
+#endif
+    return 0;
+}
+
+/**
+ * Closes a circular log.
+ *
+ * The log is synced and its file handles are closed.
+ *
+ * \param[in] log The log to close.
+ * \see circ_log_open
+ */
+void circ_log_close(struct circ_log_struct* log)
+{
+    if(!log)
+        return;
+
+    circ_log_sync(log);
+    fat_close_file(log->fd_aux);
+    fat_close_file(log->fd);
+
+#if USE_DYNAMIC_MEMORY
+    free(log);
+#else
+    log->fd = 0;
+#endif
+}
+
+/**
+ * Appends a record to a circular log.
+ *
+ * The record is written behind the previous one. If it does not fit
+ * into the current sector, it starts the next one, which replaces the
+ * oldest sector once the log is full.
+ *
+ * \param[in] log The log to which to append.
+ * \param[in] record The data of the record.
+ * \param[in] length The length of the record, 1 to CIRC_LOG_RECORD_MAX bytes.
+ * \returns 0 on failure, 1 on success.
+ * \see circ_log_read
+ */
+uint8_t circ_log_append(struct circ_log_struct* log, const uint8_t* record, uint8_t length)
+{
+    if(!log || !record || !length)
+        return 0;
+
+    /* continue with the next sector if the record does not fit */
+    if(log->head_offset && log->head_offset + 1 + length > CIRC_LOG_SECTOR_SIZE)
+    {
+        ++log->head;
+        log->head_offset = 0;
+    }
+
+    uint8_t prefix[5];
+    uint8_t prefix_len = 0;
+    if(log->head_offset == 0)
+    {
+        /* start the sector with its sequence number */
+        uint32_t seq = htol32(log->head);
+        memcpy(prefix, &seq, sizeof(seq));
+        prefix_len = sizeof(seq);
+    }
+    prefix[prefix_len++] = length;
+
+    /* end the records of the sector behind the new one */
+    uint8_t terminator = 0;
+    uint16_t end = log->head_offset + prefix_len + length;
+
+    struct fat_iovec iov[3];
+    iov[0].buffer = prefix;
+    iov[0].buffer_len = prefix_len;
+    iov[1].buffer = (uint8_t*) record;
+    iov[1].buffer_len = length;
+    iov[2].buffer = &terminator;
+    iov[2].buffer_len = 1;
+    uint8_t iovcnt = end < CIRC_LOG_SECTOR_SIZE ? 3 : 2;
+
+    int32_t offset = circ_log_sector_offset(log, log->head) + log->head_offset;
+    if(!fat_seek_file(log->fd, &offset, FAT_SEEK_SET) ||
+       fat_writev(log->fd, iov, iovcnt) != (intptr_t) (prefix_len + length + iovcnt - 2))
+        return 0;
+
+    /* A single byte left would only hold the terminator. Consider
+     * the sector full, so the next record does not have to seek back
+     * from the following sector to overwrite it.
+     */
+    log->head_offset = end < CIRC_LOG_SECTOR_SIZE - 1 ? end : CIRC_LOG_SECTOR_SIZE;
+
+    return 1;
+}
+
+/**
+ * Writes all records of a circular log to disk.
+ *
+ * After the records, the header of the log is updated.
+ *
+ * \param[in] log The log to sync.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t circ_log_sync(struct circ_log_struct* log)
+{
+    if(!log)
+        return 0;
+
+    if(!fat_sync_file(log->fd))
+        return 0;
+
+    if(log->head != log->head_synced)
+    {
+        uint32_t head = htol32(log->head);
+        if(!circ_log_write_at(log, 12, (const uint8_t*) &head, sizeof(head)) ||
+           !fat_sync_file(log->fd_aux))
+            return 0;
+
+        log->head_synced = log->head;
+    }
+
+    return 1;
+}
+
+/**
+ * Lets the next read of a circular log start at its oldest record.
+ *
+ * \param[in] log The log to rewind.
+ * \see circ_log_read
+ */
+void circ_log_rewind(struct circ_log_struct* log)
+{
+    if(!log)
+        return;
+
+    if(log->head - log->first >= log->sector_count)
+        log->read_seq = log->head - (log->sector_count - 1);
+    else
+        log->read_seq = log->first;
+    log->read_offset = 0;
+}
+
+/**
+ * Reads the next record of a circular log.
+ *
+ * Records are read from the oldest to the newest. Records overwritten
+ * since the last call are skipped. If a record is longer than the
+ * buffer, only its beginning is returned.
+ *
+ * \param[in] log The log from which to read.
+ * \param[out] buffer The buffer which receives the record.
+ * \param[in] buffer_len The size of the buffer.
+ * \returns The number of bytes read, 0 behind the newest record, or -1 on failure.
+ * \see circ_log_rewind, circ_log_append
+ */
+intptr_t circ_log_read(struct circ_log_struct* log, uint8_t* buffer, uintptr_t buffer_len)
+{
+    if(!log || !buffer)
+        return -1;
+
+    while(1)
+    {
+        /* stop behind the newest record */
+        if(log->read_seq == log->head && log->read_offset >= log->head_offset)
+            return 0;
+
+        if(log->read_offset == 0)
+        {
+            /* skip sectors which have been overwritten */
+            if(!circ_log_sector_valid(log, log->read_seq))
+            {
+                ++log->read_seq;
+                continue;
+            }
+
+            log->read_offset = sizeof(uint32_t);
+        }
+
+        int32_t offset = circ_log_sector_offset(log, log->read_seq) + log->read_offset;
+        uint8_t length = 0;
+        if(log->read_offset < CIRC_LOG_SECTOR_SIZE - 1 &&
+           !circ_log_read_at(log, offset, &length, 1))
+            return -1;
+
+        if(!length)
+        {
+            /* continue with the next sector */
+            ++log->read_seq;
+            log->read_offset = 0;
+            continue;
+        }
+
+        if(buffer_len > length)
+            buffer_len = length;
+        if(!circ_log_read_at(log, offset + 1, buffer, buffer_len))
+            return -1;
+
+        log->read_offset += 1 + length;
+        return buffer_len;
+    }
+}
+
+/**
+ * Calculates the file offset of a data sector.
+ *
+ * \param[in] log The log to which the sector belongs.
+ * \param[in] seq The sequence number of the sector.
+ * \returns The file offset of the sector.
+ */
+int32_t circ_log_sector_offset(const struct circ_log_struct* log, uint32_t seq)
+{
+    return (int32_t) (1 + seq % log->sector_count) * CIRC_LOG_SECTOR_SIZE;
+}
+
+/**
+ * Reads from the log file through the auxiliary handle.
+ *
+ * \param[in] log The log from which to read.
+ * \param[in] offset The file offset at which to read.
+ * \param[out] buffer The buffer which receives the data.
+ * \param[in] length The number of bytes to read.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t circ_log_read_at(struct circ_log_struct* log, int32_t offset, uint8_t* buffer, uint16_t length)
+{
+    return fat_seek_file(log->fd_aux, &offset, FAT_SEEK_SET) &&
+           fat_read_file(log->fd_aux, buffer, length) == (intptr_t) length;
+}
+
+/**
+ * Writes to the log file through the auxiliary handle.
+ *
+ * \param[in] log The log to which to write.
+ * \param[in] offset The file offset at which to write.
+ * \param[in] buffer The data to write.
+ * \param[in] length The number of bytes to write.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t circ_log_write_at(struct circ_log_struct* log, int32_t offset, const uint8_t* buffer, uint16_t length)
+{
+    return fat_seek_file(log->fd_aux, &offset, FAT_SEEK_SET) &&
+           fat_write_file(log->fd_aux, buffer, length) == (intptr_t) length;
+}
+
+/**
+ * Checks whether a data sector holds the given sequence number.
+ *
+ * \param[in] log The log to which the sector belongs.
+ * \param[in] seq The sequence number of the sector.
+ * \returns 1 if the sector has been written with this sequence number, 0 otherwise.
+ */
+uint8_t circ_log_sector_valid(struct circ_log_struct* log, uint32_t seq)
+{
+    uint32_t seq_stored;
+    if(!circ_log_read_at(log, circ_log_sector_offset(log, seq), (uint8_t*) &seq_stored, sizeof(seq_stored)))
+        return 0;
+
+    return ltoh32(seq_stored) == seq;
+}
+
+/**
+ * Preallocates and formats an empty log file.
+ *
+ * \param[in] log The log to format.
+ * \param[in] size The size of the log file in bytes.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t circ_log_format(struct circ_log_struct* log, uint32_t size)
+{
+    size -= size % CIRC_LOG_SECTOR_SIZE;
+    if(size < 3 * CIRC_LOG_SECTOR_SIZE || !fat_allocate_file(log->fd_aux, size))
+        return 0;
+
+    log->sector_count = size / CIRC_LOG_SECTOR_SIZE - 1;
+
+    /* The clusters may hold an older log or any other data. Clear the
+     * sequence numbers of all data sectors, so none of them is taken
+     * for a sector of this log.
+     */
+    uint32_t seq_none = 0;
+    for(uint32_t slot = 0; slot < log->sector_count; ++slot)
+    {
+        if(!circ_log_write_at(log, (int32_t) (1 + slot) * CIRC_LOG_SECTOR_SIZE, (const uint8_t*) &seq_none, sizeof(seq_none)))
+            return 0;
+    }
+
+    log->first = 1;
+    log->head = log->first;
+    log->head_synced = log->head;
+
+    uint32_t header[4];
+    header[0] = HTOL32(CIRC_LOG_MAGIC);
+    header[1] = htol32(log->sector_count);
+    header[2] = htol32(log->first);
+    header[3] = htol32(log->head);
+    return circ_log_write_at(log, 0, (const uint8_t*) header, sizeof(header)) &&
+           fat_sync_file(log->fd_aux);
+}
+
+/**
+ * Reads the header of a log file and finds the end of its records.
+ *
+ * \param[in] log The log to recover.
+ * \param[in] file_size The size of the log file in bytes.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t circ_log_recover(struct circ_log_struct* log, uint32_t file_size)
+{
+    uint32_t header[4];
+    if(!circ_log_read_at(log, 0, (uint8_t*) header, sizeof(header)))
+        return 0;
+
+    log->sector_count = ltoh32(header[1]);
+    log->first = ltoh32(header[2]);
+    log->head = ltoh32(header[3]);
+    log->head_synced = log->head;
+    if(header[0] != HTOL32(CIRC_LOG_MAGIC) ||
+       log->sector_count < 2 ||
+       log->sector_count != file_size / CIRC_LOG_SECTOR_SIZE - 1)
+        return 0;
+
+    /* Find the sectors written after the header was last updated. The
+     * log may have wrapped since, so check the sequence numbers of all
+     * data sectors. Those not written yet hold 0, which lies before the
+     * first sequence number.
+     */
+    uint32_t newest = log->head - log->first;
+    for(uint32_t slot = 0; slot < log->sector_count; ++slot)
+    {
+        uint32_t seq;
+        if(!circ_log_read_at(log, (int32_t) (1 + slot) * CIRC_LOG_SECTOR_SIZE, (uint8_t*) &seq, sizeof(seq)))
+            return 0;
+
+        seq = ltoh32(seq);
+        if(seq % log->sector_count == slot &&
+           seq - log->first > newest &&
+           seq - log->first < 0x80000000)
+            newest = seq - log->first;
+    }
+    log->head = log->first + newest;
+
+    /* find the end of the records within the newest sector */
+    log->head_offset = 0;
+    if(circ_log_sector_valid(log, log->head))
+    {
+        int32_t sector_offset = circ_log_sector_offset(log, log->head);
+        uint16_t offset = sizeof(uint32_t);
+        while(offset < CIRC_LOG_SECTOR_SIZE - 1)
+        {
+            uint8_t length;
+            if(!circ_log_read_at(log, sector_offset + offset, &length, 1))
+                return 0;
+            if(!length)
+                break;
+
+            offset += 1 + length;
+        }
+
+        log->head_offset = offset < CIRC_LOG_SECTOR_SIZE - 1 ? offset : CIRC_LOG_SECTOR_SIZE;
+    }
+
+    return 1;
+}
+
+#endif
+
+/**
+ * @}
+ */
+
@@ -0,0 +1,56 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef CIRC_LOG_H
+#define CIRC_LOG_H
+
+#include <stdint.h>
+#include "fat.h"
+#include "circ_log_config.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \addtogroup circ_log
+ *
+ * @{
+ */
+/**
+ * \file
+ * Circular log header (license: GPLv2 or LGPLv2.1)
+ */
+
+/** The size of a log sector. */
+#define CIRC_LOG_SECTOR_SIZE 512
+/** The maximum length of a record. */
+#define CIRC_LOG_RECORD_MAX 255
+
+struct circ_log_struct;
+
+struct circ_log_struct* circ_log_open(struct fat_fs_struct* fs, const struct fat_dir_entry_struct* dir_entry, uint32_t size);
+void circ_log_close(struct circ_log_struct* log);
+uint8_t circ_log_append(struct circ_log_struct* log, const uint8_t* record, uint8_t length);
+uint8_t circ_log_sync(struct circ_log_struct* log);
+void circ_log_rewind(struct circ_log_struct* log);
+intptr_t circ_log_read(struct circ_log_struct* log, uint8_t* buffer, uintptr_t buffer_len);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,48 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef CIRC_LOG_CONFIG_H
+#define CIRC_LOG_CONFIG_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \addtogroup circ_log
+ *
+ * @{
+ */
+/**
+ * \file
+ * Circular log configuration (license: GPLv2 or LGPLv2.1)
+ */
+
+/**
+ * \ingroup circ_log_config
+ * Maximum number of circular log handles.
+ *
+ * Each log keeps two file handles open, which FAT_FILE_COUNT has to
+ * provide in addition to those used otherwise. 0 leaves circular log
+ * support out.
+ */
+#define CIRC_LOG_COUNT 0
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,85 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef __AVR__
+#include <util/crc16.h>
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \addtogroup crc16 CRC-16-CCITT checksum
+ *
+ * The CRC-16-CCITT in its bit-reversed form, as used by the record log
+ * and the framed dump transfer. Usually started with 0xffff.
+ *
+ * On the AVR, the optimized _crc_ccitt_update() of avr-libc does the
+ * work. The host tools get the same algorithm in C by including this
+ * header.
+ *
+ * @{
+ */
+/**
+ * \file
+ * CRC-16-CCITT header (license: GPLv2 or LGPLv2.1)
+ */
+
+/**
+ * Adds a byte to a CRC-16-CCITT checksum.
+ *
+ * \param[in] crc The checksum of the preceding data.
+ * \param[in] data The byte to add.
+ * \returns The updated checksum.
+ */
+static inline uint16_t crc16_update(uint16_t crc, uint8_t data)
+{
+#ifdef __AVR__
+    return _crc_ccitt_update(crc, data);
+#else
+    data ^= (uint8_t) crc;
+    data ^= data << 4;
+    return ((((uint16_t) data << 8) | (crc >> 8)) ^ (uint8_t) (data >> 4)) ^ ((uint16_t) data << 3);
+#endif
+}
+
+/**
+ * Adds a block of bytes to a CRC-16-CCITT checksum.
+ *
+ * \param[in] crc The checksum of the preceding data.
+ * \param[in] data The bytes to add.
+ * \param[in] length The number of bytes to add.
+ * \returns The updated checksum.
+ */
+static inline uint16_t crc16_block(uint16_t crc, const uint8_t* data, size_t length)
+{
+    while(length--)
+        crc = crc16_update(crc, *data++);
+
+    return crc;
+}
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -63,6 +63,11 @@
  * Functions for managing directories.
  */
 
+/**
+ * \addtogroup fat_job FAT jobs
+ * Functions for doing FAT operations in small steps.
+ */
+
 /**
  * @}
  */
@@ -81,10 +86,27 @@
 #define FAT32_CLUSTER_LAST_MIN 0x0ffffff8
 #define FAT32_CLUSTER_LAST_MAX 0x0fffffff
 
+/* bit within the second FAT entry which is set when the volume got unmounted cleanly */
+#define FAT16_CLEAN_SHUTDOWN 0x8000
+#define FAT32_CLEAN_SHUTDOWN 0x08000000
+
+/* states of fat_fs_struct.unclean */
+#define FAT_VOLUME_CLEAN 0   /* the clean shutdown bit is set */
+#define FAT_VOLUME_DIRTY 1   /* cleared by us, fat_close() sets it again */
+#define FAT_VOLUME_RECOVER 2 /* found cleared, fat_recover() has to run first */
+
 #define FAT_DIRENTRY_DELETED 0xe5
 #define FAT_DIRENTRY_LFNLAST (1 << 6)
 #define FAT_DIRENTRY_LFNSEQMASK ((1 << 6) - 1)
 
+/* bit within the reserved byte of a directory entry which marks a deferred file size */
+#define FAT_DIRENTRY_SIZE_DEFERRED (1 << 0)
+
+/* modes passed to fat_set_cache_bypass() */
+#define FAT_CACHE_USE 0
+#define FAT_CACHE_BYPASS_BLOCKS 1
+#define FAT_CACHE_BYPASS_READS 2
+
 /* Each entry within the directory table has a size of 32 bytes
  * and either contains a 8.3 DOS-style file name or a part of a
  * long file name, which may consist of several directory table
@@ -140,6 +162,8 @@ struct fat_header_struct
 
     offset_t fat_offset;
     uint32_t fat_size;
+    uint32_t fat_copy_size;
+    uint8_t fat_copies;
 
     uint16_t sector_size;
     uint16_t cluster_size;
@@ -149,6 +173,7 @@ struct fat_header_struct
     offset_t root_dir_offset;
 #if FAT_FAT32_SUPPORT
     cluster_t root_dir_cluster;
+    offset_t fsinfo_offset;
 #endif
 };
 
@@ -156,16 +181,61 @@ struct fat_fs_struct
 {
     struct partition_struct* partition;
     struct fat_header_struct header;
+    struct fat_file_node* file_nodes;
+#if FAT_WRITE_SUPPORT
+    cluster_t cluster_free;
+    uint32_t fat_dirty_first;
+    uint32_t fat_dirty_end;
+    uint8_t unclean;
+#if FAT_AUTOSYNC_BYTES || FAT_AUTOSYNC_MS
+    uint8_t dirty;
+    uint8_t in_job;
+    uint32_t dirty_bytes;
+    uint32_t dirty_ms;
+#endif
+#endif
+};
+
+struct fat_file_node
+{
+    struct fat_file_node* next;
+    struct fat_dir_entry_struct dir_entry;
+    uint8_t ref_count;
+#if FAT_WRITE_SUPPORT
+    cluster_t cluster_last;
+    uint32_t size_synced;
+#if FAT_DEFER_SIZE_MS
+    uint32_t size_synced_ms;
+#endif
+#endif
+#if FAT_FILE_BUFFERING
+    offset_t buffer_offset;
+    cluster_t buffer_cluster;
+    uint16_t buffer_start;
+    uint16_t buffer_end;
+    uint8_t buffer_dirty;
+    uint8_t buffer[512];
+#endif
 };
 
 struct fat_file_struct
 {
     struct fat_fs_struct* fs;
-    struct fat_dir_entry_struct dir_entry;
+    struct fat_file_node* node;
     offset_t pos;
     cluster_t pos_cluster;
+    uint8_t advice;
+    uint8_t mapped;
+#if FAT_WRITE_SUPPORT
+    uint8_t options;
+#endif
 };
 
+/* kinds of sector mapped by a file handle, see fat_map() */
+#define FAT_MAP_READ 1
+#define FAT_MAP_WRITE 2
+#define FAT_MAP_APPEND 3
+
 struct fat_dir_struct
 {
     struct fat_fs_struct* fs;
@@ -179,6 +249,7 @@ struct fat_read_dir_callback_arg
     struct fat_dir_entry_struct* dir_entry;
     uintptr_t bytes_read;
     uint8_t finished;
+    uint8_t cluster_end;
 };
 
 struct fat_usage_count_callback_arg
@@ -187,10 +258,102 @@ struct fat_usage_count_callback_arg
     uintptr_t buffer_size;
 };
 
+#if FAT_WRITE_SUPPORT
+struct fat_delete_tree_level
+{
+    cluster_t cluster_first;
+    cluster_t cluster;
+    uint16_t cluster_offset;
+    offset_t entry_offset;
+};
+
+struct fat_recover_level
+{
+    cluster_t dir_cluster;
+    cluster_t entry_cluster;
+    uint16_t entry_offset;
+};
+
+struct fat_find_offsets_callback_arg
+{
+    struct fat_dir_entry_struct* dir_entries;
+    uint8_t count;
+    uint8_t placed;
+    uint8_t collision;
+    uint16_t free_entries;
+    offset_t free_offset;
+    struct fat_dir_entry_struct dir_entry;
+};
+
+struct fat_find_free_clusters_callback_arg
+{
+    cluster_t cluster;
+    cluster_t run_first;
+    cluster_t run_count;
+    cluster_t count;
+    uintptr_t buffer_size;
+#if FAT_FAT32_SUPPORT
+    uint8_t is_fat32;
+#endif
+};
+
+struct fat_delete_tree_callback_arg
+{
+    uintptr_t bytes_read;
+    offset_t entry_offset;
+    uint8_t finished;
+    uint8_t cluster_end;
+    uint8_t is_fat32;
+    uint8_t dir_found;
+    cluster_t dir_cluster;
+    offset_t dir_offset;
+    uint8_t file_count;
+    cluster_t file_cluster[16];
+    offset_t file_offset[16];
+};
+#endif
+
+/* kinds of jobs */
+#define FAT_JOB_TYPE_FS_FREE 1
+#define FAT_JOB_TYPE_WRITE 2
+#define FAT_JOB_TYPE_SYNC 3
+#define FAT_JOB_TYPE_CREATE_FILE 4
+
+/* states of a sync job */
+#define FAT_JOB_SYNC_FLUSH 0
+#define FAT_JOB_SYNC_FAT 1
+#define FAT_JOB_SYNC_SIZES 2
+
+/* states of a create job */
+#define FAT_JOB_CREATE_SCAN 0
+#define FAT_JOB_CREATE_PLACE 1
+#define FAT_JOB_CREATE_WRITE 2
+
+struct fat_job_struct
+{
+    struct fat_fs_struct* fs;
+    uint8_t type;
+    uint8_t state;
+    uint8_t index;
+    cluster_t cluster_count;
+    offset_t offset;
+    offset_t offset_to;
+    offset_t* free;
+#if FAT_WRITE_SUPPORT
+    struct fat_file_struct* fd;
+    const uint8_t* buffer;
+    uintptr_t buffer_len;
+    cluster_t cluster_num;
+    struct fat_find_offsets_callback_arg find_arg;
+#endif
+};
+
 #if !USE_DYNAMIC_MEMORY
 static struct fat_fs_struct fat_fs_handles[FAT_FS_COUNT];
 static struct fat_file_struct fat_file_handles[FAT_FILE_COUNT];
+static struct fat_file_node fat_file_nodes[FAT_FILE_COUNT];
 static struct fat_dir_struct fat_dir_handles[FAT_DIR_COUNT];
+static struct fat_job_struct fat_job_handles[FAT_JOB_COUNT];
 #endif
 
 static uint8_t fat_read_header(struct fat_fs_struct* fs);
@@ -198,26 +361,75 @@ static cluster_t fat_get_next_cluster(const struct fat_fs_struct* fs, cluster_t
 static offset_t fat_cluster_offset(const struct fat_fs_struct* fs, cluster_t cluster_num);
 static uint8_t fat_dir_entry_read_callback(uint8_t* buffer, offset_t offset, void* p);
 static uint8_t fat_interpret_dir_entry(struct fat_dir_entry_struct* dir_entry, const uint8_t* raw_entry);
+static cluster_t fat_get_read_cluster(const struct fat_file_struct* fd);
+static uint8_t fat_read_file_data(const struct fat_file_struct* fd, offset_t offset, uint8_t* buffer, uintptr_t length);
+static uint8_t* fat_map_data(struct fat_file_struct* fd, uint32_t offset, uint16_t* length);
+static struct fat_file_node* fat_find_file_node(const struct fat_fs_struct* fs, offset_t entry_offset);
+static intptr_t fat_iov_length(const struct fat_iovec* iov, uint8_t iovcnt);
 
 static uint8_t fat_get_fs_free_16_callback(uint8_t* buffer, offset_t offset, void* p);
 #if FAT_FAT32_SUPPORT
 static uint8_t fat_get_fs_free_32_callback(uint8_t* buffer, offset_t offset, void* p);
 #endif
 
+static struct fat_job_struct* fat_job_alloc(struct fat_fs_struct* fs, uint8_t type);
+static uint8_t fat_job_fs_free_step(struct fat_job_struct* job);
+
 #if FAT_WRITE_SUPPORT
-static cluster_t fat_append_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num, cluster_t count);
-static uint8_t fat_free_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num);
-static uint8_t fat_terminate_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num);
+static cluster_t fat_append_clusters(struct fat_fs_struct* fs, cluster_t cluster_num, cluster_t count);
+static uint8_t fat_free_clusters(struct fat_fs_struct* fs, cluster_t cluster_num);
+static uint8_t fat_terminate_clusters(struct fat_fs_struct* fs, cluster_t cluster_num);
+static void fat_mark_fat_dirty(struct fat_fs_struct* fs, cluster_t cluster_num);
+static uint8_t fat_sync_fat(struct fat_fs_struct* fs, uint16_t sector_count);
+static uint8_t fat_copy_device_data(const struct fat_fs_struct* fs, offset_t offset_src, offset_t offset_dst, uint32_t length);
+static void fat_mark_dirty(struct fat_fs_struct* fs, uint32_t bytes);
 static uint8_t fat_clear_cluster(const struct fat_fs_struct* fs, cluster_t cluster_num);
 static uintptr_t fat_clear_cluster_callback(uint8_t* buffer, offset_t offset, void* p);
-static offset_t fat_find_offset_for_dir_entry(const struct fat_fs_struct* fs, const struct fat_dir_struct* parent, const struct fat_dir_entry_struct* dir_entry);
-static uint8_t fat_write_dir_entry(const struct fat_fs_struct* fs, struct fat_dir_entry_struct* dir_entry);
+static uint8_t fat_clear_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num);
+static cluster_t fat_find_free_clusters(const struct fat_fs_struct* fs, cluster_t count);
+static uint8_t fat_find_free_clusters_callback(uint8_t* buffer, offset_t offset, void* p);
+#if FAT_DISCARD_SUPPORT
+static uint8_t fat_clear_clusters_callback(uint8_t* buffer, offset_t offset, void* p);
+#endif
+static uint8_t fat_find_offsets_for_dir_entries(struct fat_fs_struct* fs, const struct fat_dir_struct* parent, struct fat_dir_entry_struct* dir_entries, uint8_t count);
+static uint8_t fat_find_offsets_callback(uint8_t* buffer, offset_t offset, void* p);
+static uint8_t fat_job_find_free_cluster(struct fat_job_struct* job);
+static uint8_t fat_job_write_step(struct fat_job_struct* job);
+static uint8_t fat_job_sync_step(struct fat_job_struct* job);
+static uint8_t fat_job_create_file_step(struct fat_job_struct* job);
+static uint8_t fat_place_dir_entries(struct fat_fs_struct* fs, struct fat_find_offsets_callback_arg* arg, cluster_t cluster_num, offset_t offset, offset_t offset_to);
+static uint8_t fat_write_dir_entry(struct fat_fs_struct* fs, struct fat_dir_entry_struct* dir_entry);
+static uint8_t fat_write_file_size(struct fat_file_struct* fd, uint8_t force);
+static uint8_t fat_write_node_size(struct fat_fs_struct* fs, struct fat_file_node* node);
+static uint8_t fat_mark_size_deferred(struct fat_file_struct* fd);
+static int8_t fat_get_clean(const struct fat_fs_struct* fs);
+static uint8_t fat_set_clean(struct fat_fs_struct* fs, uint8_t clean);
+static uint8_t fat_write_file_data(const struct fat_file_struct* fd, offset_t offset, const uint8_t* buffer, uintptr_t length);
+static intptr_t fat_write_file_direct(struct fat_file_struct* fd, const struct fat_iovec* iov, uint8_t iovcnt);
+static uint8_t fat_prepare_write_file(struct fat_file_struct* fd);
+static cluster_t fat_get_write_cluster(struct fat_file_struct* fd);
+static cluster_t fat_get_next_write_cluster(struct fat_file_struct* fd, cluster_t cluster_num, uint8_t append);
+#if FAT_FILE_BUFFERING
+static intptr_t fat_write_file_buffered(struct fat_file_struct* fd, const uint8_t* buffer, uintptr_t buffer_len);
+static uint8_t fat_flush_file_buffer(struct fat_file_struct* fd);
+static uint8_t fat_flush_node_buffer(struct fat_fs_struct* fs, struct fat_file_node* node);
+#endif
+static uint8_t fat_delete_dir_entry(const struct fat_fs_struct* fs, offset_t dir_entry_offset);
+static uint8_t fat_delete_tree_callback(uint8_t* buffer, offset_t offset, void* p);
+#if FAT_DISCARD_SUPPORT
+static uint8_t fat_discard_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num);
+#endif
 #if FAT_DATETIME_SUPPORT
 static void fat_set_file_modification_date(struct fat_dir_entry_struct* dir_entry, uint16_t year, uint8_t month, uint8_t day);
 static void fat_set_file_modification_time(struct fat_dir_entry_struct* dir_entry, uint8_t hour, uint8_t min, uint8_t sec);
 #endif
 #endif
 
+#if FAT_FILE_BUFFERING
+static intptr_t fat_read_file_buffered(struct fat_file_struct* fd, uint8_t* buffer, uintptr_t buffer_len);
+static void fat_move_file_buffer_pos(struct fat_file_struct* fd, uint16_t length);
+#endif
+
 /**
  * \ingroup fat_fs
  * Opens a FAT filesystem.
@@ -268,6 +480,12 @@ struct fat_fs_struct* fat_open(struct partition_struct* partition)
 #endif
         return 0;
     }
+
+#if FAT_WRITE_SUPPORT
+    /* a volume not unmounted cleanly stays so until it is recovered */
+    if(fat_get_clean(fs) != 1)
+        fs->unclean = FAT_VOLUME_RECOVER;
+#endif
     
     return fs;
 }
@@ -276,8 +494,11 @@ struct fat_fs_struct* fat_open(struct partition_struct* partition)
  * \ingroup fat_fs
  * Closes a FAT filesystem.
  *
- * When this function returns, the given filesystem descriptor
- * will be invalid.
+ * Pending changes are written to disk. If file sizes have been
+ * deferred, the volume is marked as unmounted cleanly again, unless
+ * it has been found unclean and fat_recover() did not succeed. When
+ * this function returns, the given filesystem descriptor will be
+ * invalid.
  *
  * \param[in] fs The filesystem to close.
  * \see fat_open
@@ -287,6 +508,12 @@ void fat_close(struct fat_fs_struct* fs)
     if(!fs)
         return;
 
+#if FAT_WRITE_SUPPORT
+    /* once all is written, there is nothing left to recover */
+    if(fat_sync(fs) && fs->unclean == FAT_VOLUME_DIRTY && fat_set_clean(fs, 1))
+        fat_sync(fs);
+#endif
+
 #if USE_DYNAMIC_MEMORY
     free(fs);
 #else
@@ -294,6 +521,69 @@ void fat_close(struct fat_fs_struct* fs)
 #endif
 }
 
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Tells whether a volume has been unmounted cleanly.
+ *
+ * \param[in] fs The filesystem to check.
+ * \returns 1 if the clean shutdown bit of the FAT is set, 0 if not, or -1 on failure.
+ */
+int8_t fat_get_clean(const struct fat_fs_struct* fs)
+{
+#if FAT_FAT32_SUPPORT
+    uint8_t entry_size = (fs->partition->type == PARTITION_TYPE_FAT32 ? 4 : 2);
+    uint32_t flag = (entry_size == 4 ? FAT32_CLEAN_SHUTDOWN : FAT16_CLEAN_SHUTDOWN);
+#else
+    uint8_t entry_size = 2;
+    uint32_t flag = FAT16_CLEAN_SHUTDOWN;
+#endif
+
+    uint32_t fat_entry = 0;
+    if(!fs->partition->device_read(fs->header.fat_offset + entry_size, (uint8_t*) &fat_entry, entry_size))
+        return -1;
+
+    return (ltoh32(fat_entry) & flag) ? 1 : 0;
+}
+
+/**
+ * \ingroup fat_fs
+ * Sets or clears the clean shutdown bit of the FAT.
+ *
+ * \param[in] fs The filesystem to mark.
+ * \param[in] clean 1 to mark the volume as unmounted cleanly, 0 otherwise.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_set_clean(struct fat_fs_struct* fs, uint8_t clean)
+{
+#if FAT_FAT32_SUPPORT
+    uint8_t entry_size = (fs->partition->type == PARTITION_TYPE_FAT32 ? 4 : 2);
+    uint32_t flag = (entry_size == 4 ? FAT32_CLEAN_SHUTDOWN : FAT16_CLEAN_SHUTDOWN);
+#else
+    uint8_t entry_size = 2;
+    uint32_t flag = FAT16_CLEAN_SHUTDOWN;
+#endif
+    offset_t offset = fs->header.fat_offset + entry_size;
+
+    uint32_t fat_entry = 0;
+    if(!fs->partition->device_read(offset, (uint8_t*) &fat_entry, entry_size))
+        return 0;
+
+    fat_entry = ltoh32(fat_entry);
+    if(clean)
+        fat_entry |= flag;
+    else
+        fat_entry &= ~flag;
+    fat_entry = htol32(fat_entry);
+
+    if(!fs->partition->device_write(offset, (uint8_t*) &fat_entry, entry_size))
+        return 0;
+
+    fat_mark_fat_dirty(fs, 1);
+    return 1;
+}
+#endif
+
 /**
  * \ingroup fat_fs
  * Reads and parses the header of a FAT filesystem.
@@ -312,7 +602,7 @@ uint8_t fat_read_header(struct fat_fs_struct* fs)
 
     /* read fat parameters */
 #if FAT_FAT32_SUPPORT
-    uint8_t buffer[37];
+    uint8_t buffer[39];
 #else
     uint8_t buffer[25];
 #endif
@@ -331,6 +621,7 @@ uint8_t fat_read_header(struct fat_fs_struct* fs)
 #if FAT_FAT32_SUPPORT
     uint32_t sectors_per_fat32 = ltoh32(*((uint32_t*) &buffer[0x19]));
     uint32_t cluster_root_dir = ltoh32(*((uint32_t*) &buffer[0x21]));
+    uint16_t fsinfo_sector = ltoh16(*((uint16_t*) &buffer[0x25]));
 #endif
 
     if(sector_count == 0)
@@ -384,6 +675,12 @@ uint8_t fat_read_header(struct fat_fs_struct* fs)
                          /* jump to fat */
                          (offset_t) reserved_sectors * bytes_per_sector;
     header->fat_size = (data_cluster_count + 2) * (partition->type == PARTITION_TYPE_FAT16 ? 2 : 4);
+#if FAT_FAT32_SUPPORT
+    header->fat_copy_size = sectors_per_fat32 * bytes_per_sector;
+#else
+    header->fat_copy_size = (uint32_t) sectors_per_fat * bytes_per_sector;
+#endif
+    header->fat_copies = fat_copies;
 
     header->sector_size = bytes_per_sector;
     header->cluster_size = (uint16_t) bytes_per_sector * sectors_per_cluster;
@@ -411,6 +708,9 @@ uint8_t fat_read_header(struct fat_fs_struct* fs)
                                       (offset_t) fat_copies * sectors_per_fat32 * bytes_per_sector;
 
         header->root_dir_cluster = cluster_root_dir;
+
+        if(fsinfo_sector != 0 && fsinfo_sector != 0xffff && fsinfo_sector < reserved_sectors)
+            header->fsinfo_offset = partition_offset + (offset_t) fsinfo_sector * bytes_per_sector;
     }
 #endif
 
@@ -479,12 +779,18 @@ cluster_t fat_get_next_cluster(const struct fat_fs_struct* fs, cluster_t cluster
  *
  * Set cluster_num to zero to create a completely new one.
  *
+ * If the cluster right behind the one to which the new chain gets
+ * appended is free, the chain continues there and stays contiguous.
+ * Otherwise, and for new chains, free clusters are searched for where
+ * the previous search ended. This keeps an append cheap once
+ * fat_job_step() has moved that position to a free cluster.
+ *
  * \param[in] fs The file system on which to operate.
  * \param[in] cluster_num The cluster to which to append the new chain.
  * \param[in] count The number of clusters to allocate.
  * \returns 0 on failure, the number of the first new cluster on success.
  */
-cluster_t fat_append_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num, cluster_t count)
+cluster_t fat_append_clusters(struct fat_fs_struct* fs, cluster_t cluster_num, cluster_t count)
 {
     if(!fs)
         return 0;
@@ -493,7 +799,8 @@ cluster_t fat_append_clusters(const struct fat_fs_struct* fs, cluster_t cluster_
     device_write_t device_write = fs->partition->device_write;
     offset_t fat_offset = fs->header.fat_offset;
     cluster_t count_left = count;
-    cluster_t cluster_next = 0;
+    cluster_t cluster_first = 0;
+    cluster_t cluster_prev = 0;
     cluster_t cluster_max;
     uint16_t fat_entry16;
 #if FAT_FAT32_SUPPORT
@@ -506,59 +813,93 @@ cluster_t fat_append_clusters(const struct fat_fs_struct* fs, cluster_t cluster_
 #endif
         cluster_max = fs->header.fat_size / sizeof(fat_entry16);
 
-    for(cluster_t cluster_new = 2; cluster_new < cluster_max; ++cluster_new)
+    cluster_t cluster_new = fs->cluster_free;
+    if(cluster_num >= 2 && cluster_num + 1 < cluster_max)
     {
+        /* prefer the cluster right behind the chain */
 #if FAT_FAT32_SUPPORT
         if(is_fat32)
         {
-            if(!device_read(fat_offset + cluster_new * sizeof(fat_entry32), (uint8_t*) &fat_entry32, sizeof(fat_entry32)))
+            if(!device_read(fat_offset + (cluster_num + 1) * sizeof(fat_entry32), (uint8_t*) &fat_entry32, sizeof(fat_entry32)))
                 return 0;
+            if(fat_entry32 == HTOL32(FAT32_CLUSTER_FREE))
+                cluster_new = cluster_num + 1;
         }
         else
 #endif
         {
-            if(!device_read(fat_offset + cluster_new * sizeof(fat_entry16), (uint8_t*) &fat_entry16, sizeof(fat_entry16)))
+            if(!device_read(fat_offset + (cluster_num + 1) * sizeof(fat_entry16), (uint8_t*) &fat_entry16, sizeof(fat_entry16)))
                 return 0;
+            if(fat_entry16 == HTOL16(FAT16_CLUSTER_FREE))
+                cluster_new = cluster_num + 1;
         }
+    }
+
+    for(cluster_t cluster_left = cluster_max - 2; cluster_left > 0; --cluster_left, ++cluster_new)
+    {
+        /* wrap around at the end of the fat */
+        if(cluster_new < 2 || cluster_new >= cluster_max)
+            cluster_new = 2;
 
 #if FAT_FAT32_SUPPORT
         if(is_fat32)
         {
+            if(!device_read(fat_offset + cluster_new * sizeof(fat_entry32), (uint8_t*) &fat_entry32, sizeof(fat_entry32)))
+                return 0;
+
             /* check if this is a free cluster */
             if(fat_entry32 != HTOL32(FAT32_CLUSTER_FREE))
                 continue;
 
-            /* allocate cluster */
-            if(cluster_next == 0)
-                fat_entry32 = HTOL32(FAT32_CLUSTER_LAST_MAX);
-            else
-                fat_entry32 = htol32(cluster_next);
+            /* link the cluster allocated before to the new one */
+            fat_entry32 = htol32(cluster_new);
+            if(cluster_prev)
+                fat_mark_fat_dirty(fs, cluster_prev);
+            if(cluster_prev &&
+               !device_write(fat_offset + cluster_prev * sizeof(fat_entry32), (uint8_t*) &fat_entry32, sizeof(fat_entry32)))
+                break;
 
+            /* allocate cluster */
+            fat_entry32 = HTOL32(FAT32_CLUSTER_LAST_MAX);
+            fat_mark_fat_dirty(fs, cluster_new);
             if(!device_write(fat_offset + cluster_new * sizeof(fat_entry32), (uint8_t*) &fat_entry32, sizeof(fat_entry32)))
                 break;
         }
         else
 #endif
         {
+            if(!device_read(fat_offset + cluster_new * sizeof(fat_entry16), (uint8_t*) &fat_entry16, sizeof(fat_entry16)))
+                return 0;
+
             /* check if this is a free cluster */
             if(fat_entry16 != HTOL16(FAT16_CLUSTER_FREE))
                 continue;
 
-            /* allocate cluster */
-            if(cluster_next == 0)
-                fat_entry16 = HTOL16(FAT16_CLUSTER_LAST_MAX);
-            else
-                fat_entry16 = htol16((uint16_t) cluster_next);
+            /* link the cluster allocated before to the new one */
+            fat_entry16 = htol16((uint16_t) cluster_new);
+            if(cluster_prev)
+                fat_mark_fat_dirty(fs, cluster_prev);
+            if(cluster_prev &&
+               !device_write(fat_offset + cluster_prev * sizeof(fat_entry16), (uint8_t*) &fat_entry16, sizeof(fat_entry16)))
+                break;
 
+            /* allocate cluster */
+            fat_entry16 = HTOL16(FAT16_CLUSTER_LAST_MAX);
+            fat_mark_fat_dirty(fs, cluster_new);
             if(!device_write(fat_offset + cluster_new * sizeof(fat_entry16), (uint8_t*) &fat_entry16, sizeof(fat_entry16)))
                 break;
         }
 
-        cluster_next = cluster_new;
+        if(!cluster_first)
+            cluster_first = cluster_new;
+        cluster_prev = cluster_new;
         if(--count_left == 0)
             break;
     }
 
+    /* continue the next search behind the clusters just allocated */
+    fs->cluster_free = cluster_new + 1;
+
     do
     {
         if(count_left > 0)
@@ -572,7 +913,8 @@ cluster_t fat_append_clusters(const struct fat_fs_struct* fs, cluster_t cluster_
 #if FAT_FAT32_SUPPORT
             if(is_fat32)
             {
-                fat_entry32 = htol32(cluster_next);
+                fat_entry32 = htol32(cluster_first);
+                fat_mark_fat_dirty(fs, cluster_num);
 
                 if(!device_write(fat_offset + cluster_num * sizeof(fat_entry32), (uint8_t*) &fat_entry32, sizeof(fat_entry32)))
                     break;
@@ -580,21 +922,22 @@ cluster_t fat_append_clusters(const struct fat_fs_struct* fs, cluster_t cluster_
             else
 #endif
             {
-                fat_entry16 = htol16((uint16_t) cluster_next);
+                fat_entry16 = htol16((uint16_t) cluster_first);
+                fat_mark_fat_dirty(fs, cluster_num);
 
                 if(!device_write(fat_offset + cluster_num * sizeof(fat_entry16), (uint8_t*) &fat_entry16, sizeof(fat_entry16)))
                     break;
             }
         }
 
-        return cluster_next;
+        return cluster_first;
 
     } while(0);
 
     /* No space left on device or writing error.
      * Free up all clusters already allocated.
      */
-    fat_free_clusters(fs, cluster_next);
+    fat_free_clusters(fs, cluster_first);
 
     return 0;
 }
@@ -618,7 +961,7 @@ cluster_t fat_append_clusters(const struct fat_fs_struct* fs, cluster_t cluster_
  * \returns 0 on failure, 1 on success.
  * \see fat_terminate_clusters
  */
-uint8_t fat_free_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num)
+uint8_t fat_free_clusters(struct fat_fs_struct* fs, cluster_t cluster_num)
 {
     if(!fs || cluster_num < 2)
         return 0;
@@ -649,6 +992,7 @@ uint8_t fat_free_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num)
 
             /* free cluster */
             fat_entry = HTOL32(FAT32_CLUSTER_FREE);
+            fat_mark_fat_dirty(fs, cluster_num);
             fs->partition->device_write(fat_offset + cluster_num * sizeof(fat_entry), (uint8_t*) &fat_entry, sizeof(fat_entry));
 
             /* We continue in any case here, even if freeing the cluster failed.
@@ -683,6 +1027,7 @@ uint8_t fat_free_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num)
 
             /* free cluster */
             fat_entry = HTOL16(FAT16_CLUSTER_FREE);
+            fat_mark_fat_dirty(fs, cluster_num);
             fs->partition->device_write(fat_offset + cluster_num * sizeof(fat_entry), (uint8_t*) &fat_entry, sizeof(fat_entry));
 
             /* We continue in any case here, even if freeing the cluster failed.
@@ -710,7 +1055,7 @@ uint8_t fat_free_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num)
  * \returns 0 on failure, 1 on success.
  * \see fat_free_clusters
  */
-uint8_t fat_terminate_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num)
+uint8_t fat_terminate_clusters(struct fat_fs_struct* fs, cluster_t cluster_num)
 {
     if(!fs || cluster_num < 2)
         return 0;
@@ -723,6 +1068,7 @@ uint8_t fat_terminate_clusters(const struct fat_fs_struct* fs, cluster_t cluster
     if(fs->partition->type == PARTITION_TYPE_FAT32)
     {
         uint32_t fat_entry = HTOL32(FAT32_CLUSTER_LAST_MAX);
+        fat_mark_fat_dirty(fs, cluster_num);
         if(!fs->partition->device_write(fs->header.fat_offset + cluster_num * sizeof(fat_entry), (uint8_t*) &fat_entry, sizeof(fat_entry)))
             return 0;
     }
@@ -730,6 +1076,7 @@ uint8_t fat_terminate_clusters(const struct fat_fs_struct* fs, cluster_t cluster
 #endif
     {
         uint16_t fat_entry = HTOL16(FAT16_CLUSTER_LAST_MAX);
+        fat_mark_fat_dirty(fs, cluster_num);
         if(!fs->partition->device_write(fs->header.fat_offset + cluster_num * sizeof(fat_entry), (uint8_t*) &fat_entry, sizeof(fat_entry)))
             return 0;
     }
@@ -742,6 +1089,233 @@ uint8_t fat_terminate_clusters(const struct fat_fs_struct* fs, cluster_t cluster
 }
 #endif
 
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Remembers that the FAT entry of a cluster has been changed.
+ *
+ * The modified part of the first FAT is copied to the other FATs
+ * by fat_sync_fat().
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in] cluster_num The cluster whose FAT entry has been changed.
+ */
+void fat_mark_fat_dirty(struct fat_fs_struct* fs, cluster_t cluster_num)
+{
+#if FAT_FAT32_SUPPORT
+    uint8_t entry_size = (fs->partition->type == PARTITION_TYPE_FAT32 ? 4 : 2);
+#else
+    uint8_t entry_size = 2;
+#endif
+    uint32_t offset = (uint32_t) cluster_num * entry_size;
+
+    fat_mark_dirty(fs, 0);
+    if(fs->fat_dirty_end == 0 || offset < fs->fat_dirty_first)
+        fs->fat_dirty_first = offset;
+    if(offset + entry_size > fs->fat_dirty_end)
+        fs->fat_dirty_end = offset + entry_size;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Copies the changes of the first FAT to the other FATs.
+ *
+ * The changes since the last call are copied sector by sector. Once
+ * all of them have been copied, on FAT32 the FSInfo sector is updated
+ * as well. As its free cluster count is not tracked, the count is marked
+ * as unknown and only the hint where to search for free clusters is kept
+ * up to date.
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in] sector_count The maximum number of sectors to copy, or 0 to copy all changes.
+ * \returns 0 on failure, 1 if all changes have been copied, 2 if some are left.
+ */
+uint8_t fat_sync_fat(struct fat_fs_struct* fs, uint16_t sector_count)
+{
+    if(fs->fat_dirty_end == 0)
+        return 1;
+
+    struct fat_header_struct* header = &fs->header;
+
+    /* copy whole sectors, so they can be copied through the block cache */
+    uint16_t sector_size = header->sector_size;
+    uint32_t offset = fs->fat_dirty_first - fs->fat_dirty_first % sector_size;
+    uint32_t end = (fs->fat_dirty_end + sector_size - 1) / sector_size * sector_size;
+
+    if(sector_count && end - offset > (uint32_t) sector_count * sector_size)
+        end = offset + (uint32_t) sector_count * sector_size;
+
+    for(uint8_t i = 1; i < header->fat_copies; ++i)
+    {
+        if(!fat_copy_device_data(fs, header->fat_offset + offset,
+                                 header->fat_offset + (offset_t) i * header->fat_copy_size + offset,
+                                 end - offset))
+            return 0;
+    }
+    offset = end;
+
+    /* continue behind the sectors copied */
+    if(offset < fs->fat_dirty_end)
+    {
+        fs->fat_dirty_first = offset;
+        return 2;
+    }
+
+#if FAT_FAT32_SUPPORT
+    if(header->fsinfo_offset)
+    {
+        device_read_t device_read = fs->partition->device_read;
+        device_write_t device_write = fs->partition->device_write;
+        uint32_t fsinfo[2];
+        if(!device_read(header->fsinfo_offset + 484, (uint8_t*) fsinfo, sizeof(fsinfo[0])))
+            return 0;
+
+        /* write to the FSInfo sector only if it carries its signature */
+        if(fsinfo[0] == HTOL32(0x61417272))
+        {
+            fsinfo[0] = HTOL32(0xffffffff);
+            fsinfo[1] = fs->cluster_free >= 2 ? htol32(fs->cluster_free) : HTOL32(0xffffffff);
+            if(!device_write(header->fsinfo_offset + 488, (uint8_t*) fsinfo, sizeof(fsinfo)))
+                return 0;
+        }
+    }
+#endif
+
+    fs->fat_dirty_end = 0;
+    return 1;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Copies data from one place on the device to another.
+ *
+ * The data is copied block by block through the device's block cache,
+ * which is mapped with fat_map_device() and written from directly. If
+ * the device cannot map its data, the data is copied in pieces of
+ * FAT_COPY_BUFFER_SIZE bytes through a buffer on the stack instead.
+ *
+ * \note Both offsets have to be sector aligned, and the data copied
+ * has to end on a sector boundary, as a mapped block cannot be merged
+ * with partially written blocks.
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in] offset_src The device offset of the data to copy.
+ * \param[in] offset_dst The device offset where to put the copy.
+ * \param[in] length The number of bytes to copy.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_copy_device_data(const struct fat_fs_struct* fs, offset_t offset_src, offset_t offset_dst, uint32_t length)
+{
+    device_read_t device_read = fs->partition->device_read;
+    device_write_t device_write = fs->partition->device_write;
+
+    while(length > 0)
+    {
+        uint16_t copy_length;
+        const uint8_t* data = fat_map_device(offset_src, &copy_length, 0);
+        if(data)
+        {
+            if(copy_length > length)
+                copy_length = length;
+
+            uint8_t result = device_write(offset_dst, data, copy_length);
+            if(!fat_unmap_device(0) || !result)
+                return 0;
+        }
+        else
+        {
+            uint8_t buffer[FAT_COPY_BUFFER_SIZE];
+            copy_length = sizeof(buffer);
+            if(copy_length > length)
+                copy_length = length;
+
+            if(!device_read(offset_src, buffer, copy_length) ||
+               !device_write(offset_dst, buffer, copy_length))
+                return 0;
+        }
+
+        offset_src += copy_length;
+        offset_dst += copy_length;
+        length -= copy_length;
+    }
+
+    return 1;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Accounts for changes which have not been synced yet.
+ *
+ * Remembers when the filesystem became dirty and how many bytes of
+ * file data have been written since, for the autosync done by fat_tick().
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in] bytes The number of bytes of file data written.
+ */
+void fat_mark_dirty(struct fat_fs_struct* fs, uint32_t bytes)
+{
+#if FAT_AUTOSYNC_BYTES || FAT_AUTOSYNC_MS
+    if(!fs->dirty)
+    {
+        fs->dirty = 1;
+        fs->dirty_ms = fat_get_millis();
+    }
+    fs->dirty_bytes += bytes;
+#endif
+}
+#endif
+
+#if DOXYGEN || (FAT_WRITE_SUPPORT && FAT_DISCARD_SUPPORT)
+/**
+ * \ingroup fat_fs
+ * Discards the data of a cluster chain.
+ *
+ * Walks the cluster chain and tells the device that the data of
+ * the clusters is no longer needed. Physically contiguous runs of
+ * clusters are discarded with a single request.
+ *
+ * \note This function does not free the clusters within the FAT.
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in] cluster_num The starting cluster of the chain which to discard.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_free_clusters
+ */
+uint8_t fat_discard_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num)
+{
+    if(!fs || cluster_num < 2)
+        return 0;
+
+    cluster_t run_first = cluster_num;
+    cluster_t run_length = 0;
+    while(cluster_num)
+    {
+        cluster_t cluster_num_next = fat_get_next_cluster(fs, cluster_num);
+        ++run_length;
+
+        if(cluster_num_next != cluster_num + 1)
+        {
+            /* the run ends here, discard it as a whole */
+            if(!fat_discard(fat_cluster_offset(fs, run_first), (offset_t) run_length * fs->header.cluster_size))
+                return 0;
+
+            run_first = cluster_num_next;
+            run_length = 0;
+        }
+
+        cluster_num = cluster_num_next;
+    }
+
+    return 1;
+}
+#endif
+
 #if DOXYGEN || FAT_WRITE_SUPPORT
 /**
  * \ingroup fat_fs
@@ -782,15 +1356,92 @@ uintptr_t fat_clear_cluster_callback(uint8_t* buffer, offset_t offset, void* p)
 }
 #endif
 
+#if DOXYGEN || FAT_WRITE_SUPPORT
 /**
  * \ingroup fat_fs
- * Calculates the offset of the specified cluster.
+ * Clears a cluster chain.
+ *
+ * All clusters from the given one up to the end of the chain
+ * are filled with zeros. When discarding is supported, each
+ * run of contiguous clusters is discarded first. If the run
+ * reads back as zeros afterwards, writing it can be skipped.
  *
  * \param[in] fs The filesystem on which to operate.
- * \param[in] cluster_num The cluster whose offset to calculate.
- * \returns The cluster offset.
+ * \param[in] cluster_num The first cluster to clear.
+ * \returns 0 on failure, 1 on success.
  */
-offset_t fat_cluster_offset(const struct fat_fs_struct* fs, cluster_t cluster_num)
+uint8_t fat_clear_clusters(const struct fat_fs_struct* fs, cluster_t cluster_num)
+{
+    while(cluster_num)
+    {
+#if FAT_DISCARD_SUPPORT
+        /* collect contiguous clusters, but keep the run readable in one go */
+        uint16_t cluster_size = fs->header.cluster_size;
+        cluster_t cluster_count = 1;
+        cluster_t cluster_next;
+        while((cluster_next = fat_get_next_cluster(fs, cluster_num + cluster_count - 1)) == cluster_num + cluster_count &&
+              cluster_count < 0x8000 / cluster_size)
+            ++cluster_count;
+
+        offset_t offset = fat_cluster_offset(fs, cluster_num);
+        uintptr_t length = (uintptr_t) cluster_count * cluster_size;
+        uint8_t buffer[16];
+        uint8_t dirty = 0;
+        if(!fat_discard(offset, length) ||
+           !fs->partition->device_read_interval(offset, buffer, sizeof(buffer), length, fat_clear_clusters_callback, &dirty) ||
+           dirty
+          )
+        {
+            /* the device does not erase to zeros, so write them */
+            for(cluster_t i = 0; i < cluster_count; ++i)
+            {
+                if(!fat_clear_cluster(fs, cluster_num + i))
+                    return 0;
+            }
+        }
+
+        cluster_num = cluster_next;
+#else
+        if(!fat_clear_cluster(fs, cluster_num))
+            return 0;
+
+        cluster_num = fat_get_next_cluster(fs, cluster_num);
+#endif
+    }
+
+    return 1;
+}
+#endif
+
+#if DOXYGEN || (FAT_WRITE_SUPPORT && FAT_DISCARD_SUPPORT)
+/**
+ * \ingroup fat_fs
+ * Callback function for checking discarded clusters to read as zeros.
+ */
+uint8_t fat_clear_clusters_callback(uint8_t* buffer, offset_t offset, void* p)
+{
+    for(uint8_t i = 0; i < 16; ++i)
+    {
+        if(buffer[i])
+        {
+            *((uint8_t*) p) = 1;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+#endif
+
+/**
+ * \ingroup fat_fs
+ * Calculates the offset of the specified cluster.
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in] cluster_num The cluster whose offset to calculate.
+ * \returns The cluster offset.
+ */
+offset_t fat_cluster_offset(const struct fat_fs_struct* fs, cluster_t cluster_num)
 {
     if(!fs || cluster_num < 2)
         return 0;
@@ -881,6 +1532,13 @@ uint8_t fat_get_dir_entry_of_path(struct fat_fs_struct* fs, const char* path, st
  * \ingroup fat_file
  * Opens a file on a FAT filesystem.
  *
+ * A file may be opened more than once. All handles of a file share
+ * its size and cluster chain, so data written through one handle is
+ * seen by the others without reading the directory entry again. The
+ * given directory entry is ignored if the file is already open.
+ *
+ * With FAT_FILE_BUFFERING, the handles of a file share its buffer as well.
+ *
  * \param[in] fs The filesystem on which the file to open lies.
  * \param[in] dir_entry The directory entry of the file to open.
  * \returns The file handle, or 0 on failure.
@@ -908,11 +1566,53 @@ struct fat_file_struct* fat_open_file(struct fat_fs_struct* fs, const struct fat
     if(i >= FAT_FILE_COUNT)
         return 0;
 #endif
-    
-    memcpy(&fd->dir_entry, dir_entry, sizeof(*dir_entry));
+
+    /* share the node of a file which is already open */
+    struct fat_file_node* node = fat_find_file_node(fs, dir_entry->entry_offset);
+
+    if(!node)
+    {
+#if USE_DYNAMIC_MEMORY
+        node = malloc(sizeof(*node));
+        if(!node)
+        {
+            free(fd);
+            return 0;
+        }
+#else
+        /* there are never more nodes in use than handles */
+        node = fat_file_nodes;
+        while(node->ref_count)
+            ++node;
+#endif
+
+        memcpy(&node->dir_entry, dir_entry, sizeof(*dir_entry));
+        node->ref_count = 0;
+#if FAT_WRITE_SUPPORT
+        node->cluster_last = 0;
+        node->size_synced = dir_entry->file_size;
+#endif
+#if FAT_FILE_BUFFERING
+        node->buffer_offset = 0;
+        node->buffer_cluster = 0;
+        node->buffer_start = 0;
+        node->buffer_end = 0;
+        node->buffer_dirty = 0;
+#endif
+        node->next = fs->file_nodes;
+        fs->file_nodes = node;
+    }
+    ++node->ref_count;
+
     fd->fs = fs;
+    fd->node = node;
     fd->pos = 0;
-    fd->pos_cluster = dir_entry->cluster;
+    fd->pos_cluster = node->dir_entry.cluster;
+    fd->advice = FAT_FADV_NORMAL;
+    fd->mapped = 0;
+#if FAT_WRITE_SUPPORT
+    fd->options = 0;
+#endif
 
     return fd;
 }
@@ -921,398 +1621,2174 @@ struct fat_file_struct* fat_open_file(struct fat_fs_struct* fs, const struct fat
  * \ingroup fat_file
  * Closes a file.
  *
+ * Buffered data and a file size which has been deferred are
+ * written to disk.
+ *
  * \param[in] fd The file handle of the file to close.
  * \see fat_open_file
  */
 void fat_close_file(struct fat_file_struct* fd)
 {
     if(fd)
+    {
+        fat_unmap(fd);
+
+#if FAT_WRITE_SUPPORT
+        fat_sync_file(fd);
+#endif
+
+        /* release the node when its last handle gets closed */
+        struct fat_file_node* node = fd->node;
+        if(--node->ref_count == 0)
+        {
+#if FAT_WRITE_SUPPORT
+            if(node->dir_entry.size_deferred)
+            {
+                /* the size is up to date, so drop the mark */
+                node->dir_entry.size_deferred = 0;
+                fat_write_dir_entry(fd->fs, &node->dir_entry);
+            }
+#endif
+
+            struct fat_file_node** link = &fd->fs->file_nodes;
+            while(*link != node)
+                link = &(*link)->next;
+            *link = node->next;
+#if USE_DYNAMIC_MEMORY
+            free(node);
+#endif
+        }
+
 #if USE_DYNAMIC_MEMORY
         free(fd);
 #else
         fd->fs = 0;
 #endif
+    }
 }
 
 /**
  * \ingroup fat_file
- * Reads data from a file.
- * 
- * The data requested is read from the current file location.
+ * Finds the node of an open file.
  *
- * \param[in] fd The file handle of the file from which to read.
- * \param[out] buffer The buffer into which to write.
- * \param[in] buffer_len The amount of data to read.
- * \returns The number of bytes read, 0 on end of file, or -1 on failure.
- * \see fat_write_file
+ * \param[in] fs The filesystem on which the file lies.
+ * \param[in] entry_offset The offset of the file's directory entry.
+ * \returns The node of the file, or 0 if the file is not open.
  */
-intptr_t fat_read_file(struct fat_file_struct* fd, uint8_t* buffer, uintptr_t buffer_len)
+struct fat_file_node* fat_find_file_node(const struct fat_fs_struct* fs, offset_t entry_offset)
 {
-    /* check arguments */
-    if(!fd || !buffer || buffer_len < 1)
-        return -1;
+    struct fat_file_node* node = fs->file_nodes;
+    while(node && node->dir_entry.entry_offset != entry_offset)
+        node = node->next;
 
-    /* determine number of bytes to read */
-    if(fd->pos + buffer_len > fd->dir_entry.file_size)
-        buffer_len = fd->dir_entry.file_size - fd->pos;
-    if(buffer_len == 0)
+    return node;
+}
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Changes the options of a file handle.
+ *
+ * The options are a mask of the following constants:
+ * - \b FAT_FILE_DEFER_SIZE: When a write enlarges the file, the new
+ *   size is kept in memory instead of being written to the directory
+ *   entry each time. The directory entry is updated when the file is
+ *   closed or synced, when the size grew by FAT_DEFER_SIZE_CLUSTERS
+ *   clusters, or when the size was last written more than
+ *   FAT_DEFER_SIZE_MS milliseconds ago. After a power loss, the data
+ *   written since then is lost, and the cluster chain may reach beyond
+ *   the size. Use fat_recover() to cut it back.
+ * - \b FAT_FILE_APPEND: Each write appends to the end of the file.
+ *   When the option gets set, the last cluster of the file is searched
+ *   once and remembered, so later writes extend the cluster chain
+ *   without walking it.
+ *
+ * When an option is cleared, pending changes are written to disk.
+ *
+ * \param[in] fd The file handle whose options to change.
+ * \param[in] options The new options.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_sync_file
+ */
+uint8_t fat_set_file_options(struct fat_file_struct* fd, uint8_t options)
+{
+    if(!fd)
         return 0;
-    
-    uint16_t cluster_size = fd->fs->header.cluster_size;
-    cluster_t cluster_num = fd->pos_cluster;
-    uintptr_t buffer_left = buffer_len;
-    uint16_t first_cluster_offset = (uint16_t) (fd->pos & (cluster_size - 1));
 
-    /* find cluster in which to start reading */
-    if(!cluster_num)
+#if FAT_FILE_BUFFERING
+    if(!fat_flush_file_buffer(fd))
+        return 0;
+#endif
+
+    if((options & FAT_FILE_APPEND) && !(fd->options & FAT_FILE_APPEND))
     {
-        cluster_num = fd->dir_entry.cluster;
-        
-        if(!cluster_num)
+        /* find the last cluster of the file once */
+        uint16_t cluster_size = fd->fs->header.cluster_size;
+        cluster_t cluster_num = fd->node->dir_entry.cluster;
+        uint32_t size = 0;
+        if(cluster_num)
         {
-            if(!fd->pos)
-                return 0;
-            else
-                return -1;
-        }
+            size = cluster_size;
 
-        if(fd->pos)
-        {
-            uint32_t pos = fd->pos;
-            while(pos >= cluster_size)
+            cluster_t cluster_next;
+            while((cluster_next = fat_get_next_cluster(fd->fs, cluster_num)))
             {
-                pos -= cluster_size;
-                cluster_num = fat_get_next_cluster(fd->fs, cluster_num);
-                if(!cluster_num)
-                    return -1;
+                cluster_num = cluster_next;
+                size += cluster_size;
             }
         }
-    }
-    
-    /* read data */
-    do
-    {
-        /* calculate data size to copy from cluster */
-        offset_t cluster_offset = fat_cluster_offset(fd->fs, cluster_num) + first_cluster_offset;
-        uint16_t copy_length = cluster_size - first_cluster_offset;
-        if(copy_length > buffer_left)
-            copy_length = buffer_left;
 
-        /* read data */
-        if(!fd->fs->partition->device_read(cluster_offset, buffer, copy_length))
-            return buffer_len - buffer_left;
+        /* the cluster chain is too short for the file */
+        if(size < fd->node->dir_entry.file_size)
+            return 0;
 
-        /* calculate new file position */
-        buffer += copy_length;
-        buffer_left -= copy_length;
-        fd->pos += copy_length;
+        /* remember the cluster only if the file ends within it */
+        if(size - fd->node->dir_entry.file_size < cluster_size)
+            fd->node->cluster_last = cluster_num;
+    }
 
-        if(first_cluster_offset + copy_length >= cluster_size)
-        {
-            /* we are on a cluster boundary, so get the next cluster */
-            if((cluster_num = fat_get_next_cluster(fd->fs, cluster_num)))
-            {
-                first_cluster_offset = 0;
-            }
-            else
-            {
-                fd->pos_cluster = 0;
-                return buffer_len - buffer_left;
-            }
-        }
+    fd->options = options;
+    return fat_write_file_size(fd, 0);
+}
+#endif
 
-        fd->pos_cluster = cluster_num;
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Writes pending changes of a file to disk.
+ *
+ * This writes buffered data first, then the changes to the FATs and
+ * finally a file size which has been deferred. The device is synced
+ * after each of these steps, so after a power loss the directory entry
+ * never references data which has not been written.
+ *
+ * Changes to the FATs made on behalf of other files are written as well.
+ *
+ * \param[in] fd The file handle of the file to sync.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_sync, fat_set_file_options
+ */
+uint8_t fat_sync_file(struct fat_file_struct* fd)
+{
+    if(!fd)
+        return 0;
 
-    } while(buffer_left > 0); /* check if we are done */
+#if FAT_FILE_BUFFERING
+    if(!fat_flush_file_buffer(fd))
+        return 0;
+#endif
 
-    return buffer_len;
+    return fat_sync_device() &&
+           fat_sync_fat(fd->fs, 0) &&
+           fat_sync_device() &&
+           fat_write_file_size(fd, 1) &&
+           fat_sync_device();
 }
+#endif
 
 #if DOXYGEN || FAT_WRITE_SUPPORT
 /**
- * \ingroup fat_file
- * Writes data to a file.
- * 
- * The data is written to the current file location.
+ * \ingroup fat_fs
+ * Writes all pending changes of a filesystem to disk.
  *
- * \param[in] fd The file handle of the file to which to write.
- * \param[in] buffer The buffer from which to read the data to be written.
- * \param[in] buffer_len The amount of data to write.
- * \returns The number of bytes written, 0 on disk full, or -1 on failure.
- * \see fat_read_file
+ * Like fat_sync_file(), but for all files opened on the filesystem.
+ * The buffered data of all files is written first, then the changes
+ * to the FATs and finally all deferred file sizes. The device is
+ * synced after each of these steps.
+ *
+ * \param[in] fs The filesystem to sync.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_sync_file
  */
-intptr_t fat_write_file(struct fat_file_struct* fd, const uint8_t* buffer, uintptr_t buffer_len)
+uint8_t fat_sync(struct fat_fs_struct* fs)
 {
-    /* check arguments */
-    if(!fd || !buffer || buffer_len < 1)
-        return -1;
-    if(fd->pos > fd->dir_entry.file_size)
-        return -1;
-
-    uint16_t cluster_size = fd->fs->header.cluster_size;
-    cluster_t cluster_num = fd->pos_cluster;
-    uintptr_t buffer_left = buffer_len;
-    uint16_t first_cluster_offset = (uint16_t) (fd->pos & (cluster_size - 1));
+    if(!fs)
+        return 0;
 
-    /* find cluster in which to start writing */
-    if(!cluster_num)
+#if FAT_FILE_BUFFERING
+    for(struct fat_file_node* node = fs->file_nodes; node; node = node->next)
     {
-        cluster_num = fd->dir_entry.cluster;
-        
-        if(!cluster_num)
-        {
-            if(!fd->pos)
-            {
-                /* empty file */
-                fd->dir_entry.cluster = cluster_num = fat_append_clusters(fd->fs, 0, 1);
-                if(!cluster_num)
-                    return -1;
-            }
-            else
-            {
-                return -1;
-            }
-        }
+        if(!fat_flush_node_buffer(fs, node))
+            return 0;
+    }
+#endif
 
-        if(fd->pos)
-        {
-            uint32_t pos = fd->pos;
-            cluster_t cluster_num_next;
-            while(pos >= cluster_size)
-            {
-                pos -= cluster_size;
-                cluster_num_next = fat_get_next_cluster(fd->fs, cluster_num);
-                if(!cluster_num_next && pos == 0)
-                    /* the file exactly ends on a cluster boundary, and we append to it */
-                    cluster_num_next = fat_append_clusters(fd->fs, cluster_num, 1);
-                if(!cluster_num_next)
-                    return -1;
+    if(!fat_sync_device() ||
+       !fat_sync_fat(fs, 0) ||
+       !fat_sync_device())
+        return 0;
 
-                cluster_num = cluster_num_next;
-            }
-        }
-    }
-    
-    /* write data */
-    do
+    for(struct fat_file_node* node = fs->file_nodes; node; node = node->next)
     {
-        /* calculate data size to write to cluster */
-        offset_t cluster_offset = fat_cluster_offset(fd->fs, cluster_num) + first_cluster_offset;
-        uint16_t write_length = cluster_size - first_cluster_offset;
-        if(write_length > buffer_left)
-            write_length = buffer_left;
+        if(!fat_write_node_size(fs, node))
+            return 0;
+    }
 
-        /* write data which fits into the current cluster */
-        if(!fd->fs->partition->device_write(cluster_offset, buffer, write_length))
-            break;
+    if(!fat_sync_device())
+        return 0;
 
-        /* calculate new file position */
-        buffer += write_length;
-        buffer_left -= write_length;
-        fd->pos += write_length;
+#if FAT_AUTOSYNC_BYTES || FAT_AUTOSYNC_MS
+    fs->dirty = 0;
+    fs->dirty_bytes = 0;
+#endif
+    return 1;
+}
+#endif
 
-        if(first_cluster_offset + write_length >= cluster_size)
-        {
-            /* we are on a cluster boundary, so get the next cluster */
-            cluster_t cluster_num_next = fat_get_next_cluster(fd->fs, cluster_num);
-            if(!cluster_num_next && buffer_left > 0)
-                /* we reached the last cluster, append a new one */
-                cluster_num_next = fat_append_clusters(fd->fs, cluster_num, 1);
-            if(!cluster_num_next)
-            {
-                fd->pos_cluster = 0;
-                break;
-            }
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Syncs the filesystem if the autosync policy demands it.
+ *
+ * The filesystem is synced with fat_sync() when more than
+ * FAT_AUTOSYNC_BYTES bytes of file data have been written or the
+ * oldest unsynced change is more than FAT_AUTOSYNC_MS milliseconds
+ * old. Call this regularly from the main loop. As writes to files
+ * call it as well, the byte limit also holds between calls. While
+ * fat_job_step() runs, no sync is done, so the step stays short.
+ *
+ * \param[in] fs The filesystem to check.
+ * \returns 0 if a sync failed, 1 otherwise.
+ * \see fat_sync
+ */
+uint8_t fat_tick(struct fat_fs_struct* fs)
+{
+    if(!fs)
+        return 0;
 
-            cluster_num = cluster_num_next;
-            first_cluster_offset = 0;
-        }
+#if FAT_AUTOSYNC_BYTES || FAT_AUTOSYNC_MS
+    if(!fs->dirty || fs->in_job)
+        return 1;
 
-        fd->pos_cluster = cluster_num;
+    uint8_t due = 0;
+#if FAT_AUTOSYNC_BYTES
+    if(fs->dirty_bytes >= FAT_AUTOSYNC_BYTES)
+        due = 1;
+#endif
+#if FAT_AUTOSYNC_MS
+    if((uint32_t) (fat_get_millis() - fs->dirty_ms) >= FAT_AUTOSYNC_MS)
+        due = 1;
+#endif
+    if(due)
+        return fat_sync(fs);
+#endif
 
-    } while(buffer_left > 0); /* check if we are done */
+    return 1;
+}
+#endif
 
-    /* update directory entry */
-    if(fd->pos > fd->dir_entry.file_size)
-    {
-        uint32_t size_old = fd->dir_entry.file_size;
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Writes the size of a file to its directory entry, if needed.
+ *
+ * Unless \c force is set, a deferred size is written only if one
+ * of the limits given by FAT_DEFER_SIZE_CLUSTERS and FAT_DEFER_SIZE_MS
+ * is reached. As the directory entry does not reference the cluster
+ * chain of an empty file, the first size is never deferred. Before the
+ * size starts to lag behind, the file is marked for fat_recover()
+ * with fat_mark_size_deferred().
+ *
+ * \param[in] fd The file handle of the file whose size to write.
+ * \param[in] force Whether to write a deferred size in any case.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_write_file_size(struct fat_file_struct* fd, uint8_t force)
+{
+    uint32_t size = fd->node->dir_entry.file_size;
+    if(size == fd->node->size_synced)
+        return 1;
 
-        /* update file size */
-        fd->dir_entry.file_size = fd->pos;
-        /* write directory entry */
-        if(!fat_write_dir_entry(fd->fs, &fd->dir_entry))
+    if(!force && (fd->options & FAT_FILE_DEFER_SIZE) && fd->node->size_synced && size > fd->node->size_synced)
+    {
+        uint8_t due = 0;
+#if FAT_DEFER_SIZE_CLUSTERS
+        if(size - fd->node->size_synced >= (uint32_t) FAT_DEFER_SIZE_CLUSTERS * fd->fs->header.cluster_size)
+            due = 1;
+#endif
+#if FAT_DEFER_SIZE_MS
+        if((uint32_t) (fat_get_millis() - fd->node->size_synced_ms) >= FAT_DEFER_SIZE_MS)
+            due = 1;
+#endif
+        if(!fd->node->dir_entry.size_deferred)
         {
-            /* We do not return an error here since we actually wrote
-             * some data to disk. So we calculate the amount of data
-             * we wrote to disk and which lies within the old file size.
-             */
-            buffer_left = fd->pos - size_old;
-            fd->pos = size_old;
+            /* the size is going to lag behind the data */
+            if(!fat_mark_size_deferred(fd))
+                return 0;
+            due = 1;
         }
+        if(!due)
+            return 1;
     }
 
-    return buffer_len - buffer_left;
+    return fat_write_node_size(fd->fs, fd->node);
 }
-#endif
 
 /**
  * \ingroup fat_file
- * Repositions the read/write file offset.
- *
- * Changes the file offset where the next call to fat_read_file()
- * or fat_write_file() starts reading/writing.
- *
- * If the new offset is beyond the end of the file, fat_resize_file()
- * is implicitly called, i.e. the file is expanded.
+ * Marks a file whose size is going to lag behind its data.
  *
- * The new offset can be given in different ways determined by
- * the \c whence parameter:
- * - \b FAT_SEEK_SET: \c *offset is relative to the beginning of the file.
- * - \b FAT_SEEK_CUR: \c *offset is relative to the current file position.
- * - \b FAT_SEEK_END: \c *offset is relative to the end of the file.
+ * The volume is marked as not unmounted cleanly, and the directory
+ * entry is flagged when the size gets written next. Each size written
+ * while the size is deferred is a checkpoint, to which fat_recover()
+ * cuts the file back after a power loss. The flag stays until the last
+ * handle of the file gets closed.
  *
- * The resulting absolute offset is written to the location the \c offset
- * parameter points to.
- * 
- * \param[in] fd The file decriptor of the file on which to seek.
- * \param[in,out] offset A pointer to the new offset, as affected by the \c whence
- *                   parameter. The function writes the new absolute offset
- *                   to this location before it returns.
- * \param[in] whence Affects the way \c offset is interpreted, see above.
+ * \param[in] fd The file handle of the file to mark.
  * \returns 0 on failure, 1 on success.
  */
-uint8_t fat_seek_file(struct fat_file_struct* fd, int32_t* offset, uint8_t whence)
+uint8_t fat_mark_size_deferred(struct fat_file_struct* fd)
 {
-    if(!fd || !offset)
-        return 0;
-
-    uint32_t new_pos = fd->pos;
-    switch(whence)
+    struct fat_fs_struct* fs = fd->fs;
+    if(fs->unclean == FAT_VOLUME_CLEAN)
     {
-        case FAT_SEEK_SET:
-            new_pos = *offset;
-            break;
-        case FAT_SEEK_CUR:
-            new_pos += *offset;
-            break;
-        case FAT_SEEK_END:
-            new_pos = fd->dir_entry.file_size + *offset;
-            break;
-        default:
+        if(!fat_set_clean(fs, 0))
             return 0;
+        fs->unclean = FAT_VOLUME_DIRTY;
     }
 
-    if(new_pos > fd->dir_entry.file_size
-#if FAT_WRITE_SUPPORT
-       && !fat_resize_file(fd, new_pos)
-#endif
-       )
+    fd->node->dir_entry.size_deferred = 1;
+    return 1;
+}
+
+/**
+ * \ingroup fat_file
+ * Writes the size of an open file to its directory entry, if it changed.
+ *
+ * \param[in] fs The filesystem on which the file lies.
+ * \param[in] node The node of the file whose size to write.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_write_node_size(struct fat_fs_struct* fs, struct fat_file_node* node)
+{
+    uint32_t size = node->dir_entry.file_size;
+    if(size == node->size_synced)
+        return 1;
+
+    if(!fat_write_dir_entry(fs, &node->dir_entry))
         return 0;
 
-    fd->pos = new_pos;
-    fd->pos_cluster = 0;
+    node->size_synced = size;
+#if FAT_DEFER_SIZE_MS
+    node->size_synced_ms = fat_get_millis();
+#endif
 
-    *offset = (int32_t) new_pos;
     return 1;
 }
+#endif
 
-#if DOXYGEN || FAT_WRITE_SUPPORT
 /**
  * \ingroup fat_file
- * Resizes a file to have a specific size.
+ * Reads data from a file.
+ * 
+ * The data requested is read from the current file location.
  *
- * Enlarges or shrinks the file pointed to by the file descriptor to have
- * exactly the specified size.
+ * \param[in] fd The file handle of the file from which to read.
+ * \param[out] buffer The buffer into which to write.
+ * \param[in] buffer_len The amount of data to read.
+ * \returns The number of bytes read, 0 on end of file, or -1 on failure.
+ * \see fat_write_file, fat_readv
+ */
+intptr_t fat_read_file(struct fat_file_struct* fd, uint8_t* buffer, uintptr_t buffer_len)
+{
+    /* check arguments */
+    if(!fd || !buffer || buffer_len < 1)
+        return -1;
+
+#if FAT_FILE_BUFFERING
+    if(buffer_len < sizeof(fd->node->buffer))
+        return fat_read_file_buffered(fd, buffer, buffer_len);
+#endif
+
+    struct fat_iovec iov;
+    iov.buffer = buffer;
+    iov.buffer_len = buffer_len;
+    return fat_readv(fd, &iov, 1);
+}
+
+/**
+ * \ingroup fat_file
+ * Sums up the lengths of multiple buffers.
  *
- * If the file is truncated, all bytes having an equal or larger offset
- * than the given size are lost. If the file is expanded, the additional
- * bytes are allocated.
+ * \param[in] iov The buffers.
+ * \param[in] iovcnt The number of buffers.
+ * \returns The total length, or -1 if it exceeds INTPTR_MAX.
+ */
+intptr_t fat_iov_length(const struct fat_iovec* iov, uint8_t iovcnt)
+{
+    uintptr_t length = 0;
+    for(uint8_t i = 0; i < iovcnt; ++i)
+    {
+        if(iov[i].buffer_len > (uintptr_t) INTPTR_MAX - length)
+            return -1;
+        length += iov[i].buffer_len;
+    }
+
+    return length;
+}
+
+/**
+ * \ingroup fat_file
+ * Reads data from a file into multiple buffers.
  *
- * \note Please be aware that this function just allocates or deallocates disk
- * space, it does not explicitely clear it. To avoid data leakage, this
- * must be done manually.
+ * The data requested is read from the current file location and
+ * scattered across the given buffers in order. The cluster in which
+ * to start reading is looked up only once for all of the buffers.
  *
- * \param[in] fd The file decriptor of the file which to resize.
- * \param[in] size The new size of the file.
- * \returns 0 on failure, 1 on success.
+ * The buffers may hold at most INTPTR_MAX bytes altogether, so the
+ * number of bytes read can be returned.
+ *
+ * \param[in] fd The file handle of the file from which to read.
+ * \param[in] iov The buffers into which to write.
+ * \param[in] iovcnt The number of buffers.
+ * \returns The number of bytes read, 0 on end of file, or -1 on failure.
+ * \see fat_read_file, fat_writev
  */
-uint8_t fat_resize_file(struct fat_file_struct* fd, uint32_t size)
+intptr_t fat_readv(struct fat_file_struct* fd, const struct fat_iovec* iov, uint8_t iovcnt)
 {
-    if(!fd)
+    /* check arguments */
+    if(!fd || !iov || iovcnt < 1)
+        return -1;
+
+#if FAT_FILE_BUFFERING && FAT_WRITE_SUPPORT
+    if(!fat_flush_file_buffer(fd))
+        return -1;
+#endif
+
+    intptr_t iov_len = fat_iov_length(iov, iovcnt);
+    if(iov_len < 1)
+        return -1;
+    uintptr_t buffer_len = iov_len;
+
+    /* determine number of bytes to read */
+    if(fd->pos + buffer_len > fd->node->dir_entry.file_size)
+        buffer_len = fd->node->dir_entry.file_size - fd->pos;
+    if(buffer_len == 0)
         return 0;
+    
+    /* find cluster in which to start reading */
+    cluster_t cluster_num = fat_get_read_cluster(fd);
+    if(!cluster_num)
+        return -1;
 
-    cluster_t cluster_num = fd->dir_entry.cluster;
     uint16_t cluster_size = fd->fs->header.cluster_size;
-    uint32_t size_new = size;
+    uint8_t* buffer = iov->buffer;
+    uintptr_t segment_left = iov->buffer_len;
+    uintptr_t buffer_left = buffer_len;
+    uint16_t first_cluster_offset = (uint16_t) (fd->pos & (cluster_size - 1));
 
+    /* read data */
     do
     {
-        if(cluster_num == 0 && size_new == 0)
-            /* the file stays empty */
-            break;
+        /* continue with the next buffer */
+        while(!segment_left)
+        {
+            ++iov;
+            buffer = iov->buffer;
+            segment_left = iov->buffer_len;
+        }
 
-        /* seek to the next cluster as long as we need the space */
-        while(size_new > cluster_size)
+        /* calculate data size to copy from cluster */
+        offset_t cluster_offset = fat_cluster_offset(fd->fs, cluster_num) + first_cluster_offset;
+        uint16_t copy_length = cluster_size - first_cluster_offset;
+        if(copy_length > segment_left)
+            copy_length = segment_left;
+        if(copy_length > buffer_left)
+            copy_length = buffer_left;
+
+        /* read data */
+        if(!fat_read_file_data(fd, cluster_offset, buffer, copy_length))
+            return buffer_len - buffer_left;
+
+        /* calculate new file position */
+        buffer += copy_length;
+        segment_left -= copy_length;
+        buffer_left -= copy_length;
+        fd->pos += copy_length;
+        first_cluster_offset += copy_length;
+
+        if(first_cluster_offset >= cluster_size)
         {
-            /* get next cluster of file */
-            cluster_t cluster_num_next = fat_get_next_cluster(fd->fs, cluster_num);
-            if(cluster_num_next)
+            /* we are on a cluster boundary, so get the next cluster */
+            if((cluster_num = fat_get_next_cluster(fd->fs, cluster_num)))
             {
-                cluster_num = cluster_num_next;
-                size_new -= cluster_size;
+                first_cluster_offset = 0;
             }
             else
             {
-                break;
+                fd->pos_cluster = 0;
+                return buffer_len - buffer_left;
             }
         }
 
-        if(size_new > cluster_size || cluster_num == 0)
-        {
-            /* Allocate new cluster chain and append
-             * it to the existing one, if available.
-             */
-            cluster_t cluster_count = (size_new + cluster_size - 1) / cluster_size;
-            cluster_t cluster_new_chain = fat_append_clusters(fd->fs, cluster_num, cluster_count);
-            if(!cluster_new_chain)
-                return 0;
+        fd->pos_cluster = cluster_num;
+
+    } while(buffer_left > 0); /* check if we are done */
+
+    return buffer_len;
+}
+
+/**
+ * \ingroup fat_file
+ * Announces how a file is going to be accessed.
+ *
+ * Streaming a file through the block cache of the device evicts the
+ * FAT and directory sectors which other operations need again soon.
+ * The advice given here lets the file's data bypass the cache:
+ * - \b FAT_FADV_NORMAL: All data goes through the cache. This is the default.
+ * - \b FAT_FADV_SEQUENTIAL: Whole sectors of data bypass the cache, while
+ *   small sequential accesses still benefit from it.
+ * - \b FAT_FADV_NOREUSE: All data reads bypass the cache unless the data is
+ *   already cached, as do writes of whole sectors.
+ * - \b FAT_FADV_WILLNEED: Loads the sector at the current file position into
+ *   the cache, and otherwise behaves like \b FAT_FADV_NORMAL.
+ *
+ * Filesystem metadata is always accessed through the cache.
+ *
+ * \param[in] fd The file handle of the file to give advice about.
+ * \param[in] advice One of the FAT_FADV_* constants.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_set_cache_bypass
+ */
+uint8_t fat_fadvise(struct fat_file_struct* fd, uint8_t advice)
+{
+    if(!fd || advice > FAT_FADV_WILLNEED)
+        return 0;
+
+    if(advice == FAT_FADV_WILLNEED)
+    {
+        advice = FAT_FADV_NORMAL;
+
+        /* preload the sector in which the file position lies */
+        cluster_t cluster_num;
+        uint8_t b;
+        if(fd->pos < fd->node->dir_entry.file_size &&
+           (cluster_num = fat_get_read_cluster(fd)) &&
+           !fd->fs->partition->device_read(fat_cluster_offset(fd->fs, cluster_num) + (fd->pos & (fd->fs->header.cluster_size - 1)), &b, 1))
+            return 0;
+    }
+
+    fd->advice = advice;
+    return 1;
+}
+
+/**
+ * \ingroup fat_file
+ * Maps file data into memory for reading it in place.
+ *
+ * Returns a pointer to the device's cached copy of the sector which
+ * holds the file data at \c offset. Parsers can use the data there
+ * instead of copying it with fat_read_file(), which needs no buffer of
+ * its own. The mapping ends with the sector or the file, whichever
+ * comes first. The file position is moved to \c offset.
+ *
+ * Only one sector can be mapped at a time. Until fat_unmap() is called,
+ * the sector is kept in the cache, so the filesystem must not be
+ * changed meanwhile. Reading other data is fine, but bypasses the cache.
+ *
+ * \param[in] fd The file handle of the file to map.
+ * \param[in] offset The file offset of the data to map.
+ * \param[out] buffer Receives the pointer to the data.
+ * \param[out] length Receives the number of bytes mapped.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_map_writable, fat_unmap
+ */
+uint8_t fat_map(struct fat_file_struct* fd, uint32_t offset, const uint8_t** buffer, uint16_t* length)
+{
+    if(!buffer)
+        return 0;
+
+    *buffer = fat_map_data(fd, offset, length);
+    return *buffer != 0;
+}
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Maps file data into memory for changing it in place.
+ *
+ * Like fat_map(), but the mapped data may be changed. It is written
+ * back to the device by fat_unmap(). The file size cannot be changed
+ * this way.
+ *
+ * \param[in] fd The file handle of the file to map.
+ * \param[in] offset The file offset of the data to map.
+ * \param[out] buffer Receives the pointer to the data.
+ * \param[out] length Receives the number of bytes mapped.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_map, fat_unmap
+ */
+uint8_t fat_map_writable(struct fat_file_struct* fd, uint32_t offset, uint8_t** buffer, uint16_t* length)
+{
+    if(!buffer)
+        return 0;
+
+    *buffer = fat_map_data(fd, offset, length);
+    if(!*buffer)
+        return 0;
+
+    fd->mapped = FAT_MAP_WRITE;
+    return 1;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Maps the space behind the end of a file for appending data in place.
+ *
+ * Returns a pointer into the device's cache where the data following
+ * the end of the file can be assembled, so it need not be copied there
+ * from a buffer of its own. The space ends with the sector. If the file
+ * ends on a sector boundary, the sector is not read from the device.
+ * Call fat_unmap_append() with the number of bytes put there to append
+ * them to the file.
+ *
+ * The file position is moved to the end of the file. The restrictions
+ * of fat_map() apply, so the filesystem must not be changed until the
+ * data has been appended.
+ *
+ * \param[in] fd The file handle of the file to append to.
+ * \param[out] buffer Receives the pointer to the space.
+ * \param[out] length Receives the number of bytes which can be appended.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_unmap_append, fat_map
+ */
+uint8_t fat_map_append(struct fat_file_struct* fd, uint8_t** buffer, uint16_t* length)
+{
+    if(!fd || !buffer || !length || fd->mapped)
+        return 0;
+
+    int32_t pos = 0;
+    if(!fat_seek_file(fd, &pos, FAT_SEEK_END) ||
+       !fat_prepare_write_file(fd))
+        return 0;
+
+    /* allocate the cluster to append to */
+    cluster_t cluster_num = fat_get_write_cluster(fd);
+    if(!cluster_num)
+        return 0;
+    fd->pos_cluster = cluster_num;
+
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    *buffer = fat_map_device(fat_cluster_offset(fd->fs, cluster_num) + (fd->pos & (cluster_size - 1)), length, 1);
+    if(!*buffer)
+        return 0;
+
+    fd->mapped = FAT_MAP_APPEND;
+    return 1;
+}
+
+/**
+ * \ingroup fat_file
+ * Appends the data assembled in the space mapped by fat_map_append().
+ *
+ * The mapping is released. Like with fat_write_file(), the new file
+ * size is written to the directory entry unless deferred.
+ *
+ * \param[in] fd The file handle of the file to append to.
+ * \param[in] length The number of bytes to append, at most the number mapped.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_map_append
+ */
+uint8_t fat_unmap_append(struct fat_file_struct* fd, uint16_t length)
+{
+    if(!fd || fd->mapped != FAT_MAP_APPEND)
+        return 0;
+
+    fd->mapped = 0;
+    if(!fat_unmap_device(length > 0))
+        return 0;
+    if(!length)
+        return 1;
+
+    uint32_t size_old = fd->node->dir_entry.file_size;
+    fd->pos += length;
+    if(!(fd->pos & (fd->fs->header.cluster_size - 1)))
+        /* the cluster holding the new position is not known yet */
+        fd->pos_cluster = 0;
+
+    fd->node->dir_entry.file_size = fd->pos;
+    if(!fat_write_file_size(fd, 0))
+    {
+        fd->pos = size_old;
+        fd->pos_cluster = 0;
+        return 0;
+    }
+
+    fat_mark_dirty(fd->fs, length);
+    return fat_tick(fd->fs);
+}
+#endif
+
+/**
+ * \ingroup fat_file
+ * Releases the data mapped by fat_map() or fat_map_writable().
+ *
+ * Data mapped with fat_map_writable() is written back to the device.
+ * Closing the file releases its mapping as well, and an unused mapping
+ * made by fat_map_append().
+ *
+ * \param[in] fd The file handle whose mapping to release.
+ * \returns 0 on failure or if nothing is mapped, 1 on success.
+ * \see fat_map, fat_map_writable
+ */
+uint8_t fat_unmap(struct fat_file_struct* fd)
+{
+    if(!fd || !fd->mapped)
+        return 0;
+
+#if FAT_WRITE_SUPPORT
+    if(fd->mapped == FAT_MAP_APPEND)
+        return fat_unmap_append(fd, 0);
+#endif
+
+    uint8_t dirty = (fd->mapped == FAT_MAP_WRITE);
+    fd->mapped = 0;
+    if(!fat_unmap_device(dirty))
+        return 0;
+
+#if FAT_WRITE_SUPPORT
+    if(dirty)
+    {
+#if FAT_FILE_BUFFERING
+        /* the file buffer may hold an old copy of the data */
+        if(!fd->node->buffer_dirty)
+        {
+            fd->node->buffer_start = 0;
+            fd->node->buffer_end = 0;
+        }
+#endif
+        fat_mark_dirty(fd->fs, 0);
+    }
+#endif
+
+    return 1;
+}
+
+/**
+ * \ingroup fat_file
+ * Maps the sector holding some file data.
+ *
+ * \param[in] fd The file handle of the file to map.
+ * \param[in] offset The file offset of the data to map.
+ * \param[out] length Receives the number of bytes mapped.
+ * \returns A pointer to the data, or 0 on failure.
+ */
+uint8_t* fat_map_data(struct fat_file_struct* fd, uint32_t offset, uint16_t* length)
+{
+    if(!fd || !length || fd->mapped || offset >= fd->node->dir_entry.file_size)
+        return 0;
+
+    int32_t pos = (int32_t) offset;
+    if(!fat_seek_file(fd, &pos, FAT_SEEK_SET))
+        return 0;
+
+    cluster_t cluster_num = fat_get_read_cluster(fd);
+    if(!cluster_num)
+        return 0;
+    fd->pos_cluster = cluster_num;
+
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    uint8_t* buffer = fat_map_device(fat_cluster_offset(fd->fs, cluster_num) + (offset & (cluster_size - 1)), length, 0);
+    if(!buffer)
+        return 0;
+
+    /* do not map data behind the end of the file */
+    if(*length > fd->node->dir_entry.file_size - offset)
+        *length = fd->node->dir_entry.file_size - offset;
+
+    fd->mapped = FAT_MAP_READ;
+    return buffer;
+}
+
+/**
+ * \ingroup fat_file
+ * Reads file data from the device, following the advice given for the file.
+ *
+ * \param[in] fd The file handle of the file the data belongs to.
+ * \param[in] offset The device offset from which to read.
+ * \param[out] buffer The buffer into which to write.
+ * \param[in] length The amount of data to read.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_fadvise
+ */
+uint8_t fat_read_file_data(const struct fat_file_struct* fd, offset_t offset, uint8_t* buffer, uintptr_t length)
+{
+    if(fd->advice == FAT_FADV_NORMAL)
+        return fd->fs->partition->device_read(offset, buffer, length);
+
+    fat_set_cache_bypass(fd->advice == FAT_FADV_NOREUSE ? FAT_CACHE_BYPASS_READS : FAT_CACHE_BYPASS_BLOCKS);
+    uint8_t result = fd->fs->partition->device_read(offset, buffer, length);
+    fat_set_cache_bypass(FAT_CACHE_USE);
+
+    return result;
+}
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Writes file data to the device, following the advice given for the file.
+ *
+ * \param[in] fd The file handle of the file the data belongs to.
+ * \param[in] offset The device offset to which to write.
+ * \param[in] buffer The buffer from which to read the data to be written.
+ * \param[in] length The amount of data to write.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_fadvise
+ */
+uint8_t fat_write_file_data(const struct fat_file_struct* fd, offset_t offset, const uint8_t* buffer, uintptr_t length)
+{
+    if(fd->advice == FAT_FADV_NORMAL)
+        return fd->fs->partition->device_write(offset, buffer, length);
+
+    fat_set_cache_bypass(FAT_CACHE_BYPASS_BLOCKS);
+    uint8_t result = fd->fs->partition->device_write(offset, buffer, length);
+    fat_set_cache_bypass(FAT_CACHE_USE);
+
+    return result;
+}
+#endif
+
+/**
+ * \ingroup fat_file
+ * Looks up the cluster in which the current file position resides.
+ *
+ * \param[in] fd The file handle of the file to read from.
+ * \returns The cluster number, or 0 if the position lies beyond the cluster chain.
+ */
+cluster_t fat_get_read_cluster(const struct fat_file_struct* fd)
+{
+    cluster_t cluster_num = fd->pos_cluster;
+    if(cluster_num)
+        return cluster_num;
+
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    uint32_t pos = fd->pos;
+    cluster_num = fd->node->dir_entry.cluster;
+    while(cluster_num && pos >= cluster_size)
+    {
+        pos -= cluster_size;
+        cluster_num = fat_get_next_cluster(fd->fs, cluster_num);
+    }
+
+    return cluster_num;
+}
+
+/**
+ * \ingroup fat_file
+ * Reads data from a file and passes it to a callback function.
+ *
+ * Starting at the current file location, the data is passed to the
+ * callback one sector at a time. Each sector is mapped into the
+ * device's block cache with fat_map_device(), and the callback gets a
+ * pointer right into the cache, so the data is not copied. The first
+ * and last chunk may be shorter than a sector. The callback returns 0
+ * to stop reading after it.
+ *
+ * \note The callback must not access the filesystem or the device, as
+ * the block cache stays mapped while it runs. The cache bypass given by
+ * fat_fadvise() does not apply.
+ *
+ * \param[in] fd The file handle of the file from which to read.
+ * \param[in] length The maximum number of bytes to read in total.
+ * \param[in] callback The function to which to pass the data read.
+ * \param[in] p An opaque pointer directly passed to the callback function.
+ * \returns The number of bytes read, 0 on end of file, or -1 on failure.
+ * \see fat_read_file, fat_write_file_from
+ */
+int32_t fat_read_file_to(struct fat_file_struct* fd, uint32_t length, fat_read_callback_t callback, void* p)
+{
+    /* check arguments */
+    if(!fd || !callback || fd->mapped)
+        return -1;
+
+#if FAT_FILE_BUFFERING && FAT_WRITE_SUPPORT
+    if(!fat_flush_file_buffer(fd))
+        return -1;
+#endif
+
+    /* determine number of bytes to read */
+    if(fd->pos + length > fd->node->dir_entry.file_size || fd->pos + length < fd->pos)
+        length = fd->node->dir_entry.file_size - fd->pos;
+    if(length == 0)
+        return 0;
+
+    /* find cluster in which to start reading */
+    cluster_t cluster_num = fat_get_read_cluster(fd);
+    if(!cluster_num)
+        return -1;
+
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    uint16_t first_cluster_offset = (uint16_t) (fd->pos & (cluster_size - 1));
+    uint32_t length_left = length;
+    uint8_t more;
+
+    do
+    {
+        /* map the data up to the end of the sector */
+        uint16_t copy_length;
+        const uint8_t* buffer = fat_map_device(fat_cluster_offset(fd->fs, cluster_num) + first_cluster_offset, &copy_length, 0);
+        if(!buffer)
+            break;
+        if(copy_length > length_left)
+            copy_length = length_left;
+
+        more = callback(buffer, copy_length, p);
+        fat_unmap_device(0);
+
+        /* calculate new file position */
+        length_left -= copy_length;
+        fd->pos += copy_length;
+        first_cluster_offset += copy_length;
+
+        if(first_cluster_offset >= cluster_size)
+        {
+            /* we are on a cluster boundary, so get the next cluster */
+            if(!(cluster_num = fat_get_next_cluster(fd->fs, cluster_num)))
+            {
+                fd->pos_cluster = 0;
+                break;
+            }
+            first_cluster_offset = 0;
+        }
+
+        fd->pos_cluster = cluster_num;
+
+    } while(more && length_left > 0);
+
+    if(length_left == length)
+        return -1;
+    return length - length_left;
+}
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Writes data to a file.
+ * 
+ * The data is written to the current file location.
+ *
+ * \param[in] fd The file handle of the file to which to write.
+ * \param[in] buffer The buffer from which to read the data to be written.
+ * \param[in] buffer_len The amount of data to write.
+ * \returns The number of bytes written, 0 on disk full, or -1 on failure.
+ * \see fat_read_file, fat_writev
+ */
+intptr_t fat_write_file(struct fat_file_struct* fd, const uint8_t* buffer, uintptr_t buffer_len)
+{
+    /* check arguments */
+    if(!fd || !buffer || buffer_len < 1)
+        return -1;
+
+#if FAT_FILE_BUFFERING
+    if(buffer_len < sizeof(fd->node->buffer))
+    {
+        intptr_t written = fat_write_file_buffered(fd, buffer, buffer_len);
+        if(written > 0)
+        {
+            fat_mark_dirty(fd->fs, written);
+            fat_tick(fd->fs);
+        }
+        return written;
+    }
+#endif
+
+    struct fat_iovec iov;
+    iov.buffer = (uint8_t*) buffer;
+    iov.buffer_len = buffer_len;
+    return fat_writev(fd, &iov, 1);
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Writes data from multiple buffers to a file.
+ *
+ * The data of the given buffers is gathered in order and written to
+ * the current file location. The cluster in which to start writing is
+ * looked up only once, and the directory entry is updated at most once
+ * for all of the buffers. The buffers may hold at most INTPTR_MAX bytes
+ * altogether, so the number of bytes written can be returned.
+ *
+ * \param[in] fd The file handle of the file to which to write.
+ * \param[in] iov The buffers from which to read the data to be written.
+ * \param[in] iovcnt The number of buffers.
+ * \returns The number of bytes written, 0 on disk full, or -1 on failure.
+ * \see fat_write_file, fat_readv
+ */
+intptr_t fat_writev(struct fat_file_struct* fd, const struct fat_iovec* iov, uint8_t iovcnt)
+{
+    /* check arguments */
+    if(!fd || !iov || iovcnt < 1)
+        return -1;
+
+    if(!fat_prepare_write_file(fd))
+        return -1;
+
+    intptr_t written = fat_write_file_direct(fd, iov, iovcnt);
+    if(written > 0)
+    {
+        fat_mark_dirty(fd->fs, written);
+        fat_tick(fd->fs);
+    }
+    return written;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Writes data from multiple buffers to a file, bypassing the file buffer.
+ *
+ * \param[in] fd The file handle of the file to which to write.
+ * \param[in] iov The buffers from which to read the data to be written.
+ * \param[in] iovcnt The number of buffers.
+ * \returns The number of bytes written, 0 on disk full, or -1 on failure.
+ * \see fat_writev
+ */
+intptr_t fat_write_file_direct(struct fat_file_struct* fd, const struct fat_iovec* iov, uint8_t iovcnt)
+{
+    if(fd->pos > fd->node->dir_entry.file_size)
+        return -1;
+
+    intptr_t iov_len = fat_iov_length(iov, iovcnt);
+    if(iov_len < 1)
+        return -1;
+    uintptr_t buffer_len = iov_len;
+
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    const uint8_t* buffer = iov->buffer;
+    uintptr_t segment_left = iov->buffer_len;
+    uintptr_t buffer_left = buffer_len;
+    uint16_t first_cluster_offset = (uint16_t) (fd->pos & (cluster_size - 1));
+
+    /* find cluster in which to start writing */
+    cluster_t cluster_num = fat_get_write_cluster(fd);
+    if(!cluster_num)
+        return -1;
+
+    /* write data */
+    do
+    {
+        /* continue with the next buffer */
+        while(!segment_left)
+        {
+            ++iov;
+            buffer = iov->buffer;
+            segment_left = iov->buffer_len;
+        }
+
+        /* calculate data size to write to cluster */
+        offset_t cluster_offset = fat_cluster_offset(fd->fs, cluster_num) + first_cluster_offset;
+        uint16_t write_length = cluster_size - first_cluster_offset;
+        if(write_length > segment_left)
+            write_length = segment_left;
+
+        /* write data which fits into the current cluster */
+        if(!fat_write_file_data(fd, cluster_offset, buffer, write_length))
+        {
+            /* the file may no longer end within its last cluster */
+            fd->node->cluster_last = 0;
+            break;
+        }
+
+        /* calculate new file position */
+        buffer += write_length;
+        segment_left -= write_length;
+        buffer_left -= write_length;
+        fd->pos += write_length;
+        first_cluster_offset += write_length;
+
+        if(first_cluster_offset >= cluster_size)
+        {
+            /* we are on a cluster boundary, so get the next cluster */
+            cluster_num = fat_get_next_write_cluster(fd, cluster_num, buffer_left > 0);
+            if(!cluster_num)
+            {
+                fd->pos_cluster = 0;
+                break;
+            }
+
+            first_cluster_offset = 0;
+        }
+
+        fd->pos_cluster = cluster_num;
+
+    } while(buffer_left > 0); /* check if we are done */
+
+    /* update directory entry */
+    if(fd->pos > fd->node->dir_entry.file_size)
+    {
+        uint32_t size_old = fd->node->dir_entry.file_size;
+
+        /* update file size */
+        fd->node->dir_entry.file_size = fd->pos;
+        /* write directory entry, unless deferred */
+        if(!fat_write_file_size(fd, 0))
+        {
+            /* We do not return an error here since we actually wrote
+             * some data to disk. So we calculate the amount of data
+             * we wrote to disk and which lies within the old file size.
+             */
+            buffer_left = fd->pos - size_old;
+            fd->pos = size_old;
+            fd->pos_cluster = 0;
+        }
+    }
+
+    return buffer_len - buffer_left;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Looks up the cluster in which to write at the current file position.
+ *
+ * If the file is empty or exactly ends on a cluster boundary at the
+ * current position, a new cluster is appended to the file.
+ *
+ * \param[in] fd The file handle of the file to write to.
+ * \returns The cluster number, or 0 on failure.
+ */
+cluster_t fat_get_write_cluster(struct fat_file_struct* fd)
+{
+    cluster_t cluster_num = fd->pos_cluster;
+    if(cluster_num)
+        return cluster_num;
+
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    cluster_num = fd->node->dir_entry.cluster;
+    
+    if(!cluster_num)
+    {
+        if(fd->pos)
+            return 0;
+
+        /* empty file */
+        fd->node->dir_entry.cluster = cluster_num = fat_append_clusters(fd->fs, 0, 1);
+        if(cluster_num)
+            fd->node->cluster_last = cluster_num;
+        return cluster_num;
+    }
+
+    if(fd->pos && fd->pos == fd->node->dir_entry.file_size && fd->node->cluster_last)
+    {
+        /* we append to the file, so start at its last cluster */
+        cluster_num = fd->node->cluster_last;
+        if(!(fd->pos & (cluster_size - 1)))
+        {
+            /* the file exactly ends on a cluster boundary */
+            cluster_num = fat_append_clusters(fd->fs, cluster_num, 1);
+            if(cluster_num)
+                fd->node->cluster_last = cluster_num;
+        }
+    }
+    else if(fd->pos)
+    {
+        uint32_t pos = fd->pos;
+        cluster_t cluster_num_next;
+        while(pos >= cluster_size)
+        {
+            pos -= cluster_size;
+            cluster_num_next = fat_get_next_cluster(fd->fs, cluster_num);
+            if(!cluster_num_next && pos == 0)
+            {
+                /* the file exactly ends on a cluster boundary, and we append to it */
+                cluster_num_next = fat_append_clusters(fd->fs, cluster_num, 1);
+                fd->node->cluster_last = cluster_num_next;
+            }
+            if(!cluster_num_next)
+                return 0;
+
+            cluster_num = cluster_num_next;
+        }
+    }
+
+    return cluster_num;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Looks up the cluster following the one just written to.
+ *
+ * \param[in] fd The file handle of the file to write to.
+ * \param[in] cluster_num The cluster which has been written up to its end.
+ * \param[in] append Whether to append a new cluster if \c cluster_num is the last one.
+ * \returns The next cluster number, or 0 if there is none.
+ */
+cluster_t fat_get_next_write_cluster(struct fat_file_struct* fd, cluster_t cluster_num, uint8_t append)
+{
+    cluster_t cluster_num_next = 0;
+    if(cluster_num != fd->node->cluster_last)
+        cluster_num_next = fat_get_next_cluster(fd->fs, cluster_num);
+    if(!cluster_num_next)
+    {
+        /* we reached the last cluster, append a new one if needed */
+        fd->node->cluster_last = cluster_num;
+        if(append)
+        {
+            cluster_num_next = fat_append_clusters(fd->fs, cluster_num, 1);
+            if(cluster_num_next)
+                fd->node->cluster_last = cluster_num_next;
+        }
+    }
+
+    return cluster_num_next;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Writes data obtained from a callback function to a file.
+ *
+ * The data is written to the current file location one sector at a
+ * time. For each sector, the cluster holding it is looked up or
+ * allocated first. The sector is then mapped into the device's block
+ * cache with fat_map_device(), and the callback gets a pointer right
+ * into the cache, where it puts the data, so the data is not copied.
+ * Space behind the end of the file starting on a sector boundary is not
+ * read from the device. The callback returns the number of bytes it has
+ * put into the space, or zero to stop writing.
+ *
+ * As the cluster is allocated before the callback is asked for data,
+ * running out of disk space never loses data already taken from the
+ * callback. If the device fails to take a sector, the bytes of that
+ * sector are lost. \c consumed then tells how many bytes the callback
+ * has delivered in total, beyond the number of bytes written. The
+ * directory entry is updated once when writing stops.
+ *
+ * \note The callback must not access the filesystem or the device, as
+ * the block cache stays mapped while it runs.
+ *
+ * \param[in] fd The file handle of the file to which to write.
+ * \param[in] callback The function used to obtain the bytes to write.
+ * \param[in] p An opaque pointer directly passed to the callback function.
+ * \param[out] consumed If not 0, receives the number of bytes delivered by the callback.
+ * \returns The number of bytes written, 0 on disk full, or -1 on failure.
+ * \see fat_write_file, fat_read_file_to
+ */
+int32_t fat_write_file_from(struct fat_file_struct* fd, fat_write_callback_t callback, void* p, uint32_t* consumed)
+{
+    if(consumed)
+        *consumed = 0;
+
+    /* check arguments */
+    if(!fd || !callback || fd->mapped)
+        return -1;
+
+    if(!fat_prepare_write_file(fd) || fd->pos > fd->node->dir_entry.file_size)
+        return -1;
+
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    uint32_t size_old = fd->node->dir_entry.file_size;
+    uint32_t pos_old = fd->pos;
+    uint32_t delivered = 0;
+    int8_t result = 0;
+
+    while(1)
+    {
+        /* find the cluster to write to before asking for data */
+        cluster_t cluster_num = fat_get_write_cluster(fd);
+        if(!cluster_num)
+        {
+            /* no more disk space, unless the file is broken */
+            if(fd->pos & (cluster_size - 1))
+                result = -1;
+            break;
+        }
+        fd->pos_cluster = cluster_num;
+
+        /* map the sector, without reading it if it lies behind the end of the file */
+        uint16_t first_cluster_offset = (uint16_t) (fd->pos & (cluster_size - 1));
+        uint16_t write_length;
+        uint8_t* buffer = fat_map_device(fat_cluster_offset(fd->fs, cluster_num) + first_cluster_offset,
+                                         &write_length,
+                                         fd->pos >= fd->node->dir_entry.file_size);
+        if(!buffer)
+        {
+            result = -1;
+            break;
+        }
+
+        write_length = callback(buffer, write_length, p);
+        delivered += write_length;
+        if(!fat_unmap_device(write_length > 0))
+        {
+            /* the file may no longer end within its last cluster */
+            fd->node->cluster_last = 0;
+            result = -1;
+            break;
+        }
+        if(!write_length)
+            break;
+
+        /* calculate new file position */
+        fd->pos += write_length;
+        if(fd->pos > fd->node->dir_entry.file_size)
+            fd->node->dir_entry.file_size = fd->pos;
+
+        if(!(fd->pos & (cluster_size - 1)))
+        {
+            /* we are on a cluster boundary, so get the next cluster,
+             * but defer appending one until the next round
+             */
+            fd->pos_cluster = fat_get_next_write_cluster(fd, cluster_num, 0);
+        }
+    }
+
+    if(consumed)
+        *consumed = delivered;
+
+    /* update directory entry */
+    if(fd->node->dir_entry.file_size > size_old && !fat_write_file_size(fd, 0))
+    {
+        /* report the data written within the old file size only */
+        fd->node->dir_entry.file_size = size_old;
+        fd->pos = size_old > pos_old ? size_old : pos_old;
+        fd->pos_cluster = 0;
+        result = -1;
+    }
+
+    if(fd->pos > pos_old)
+    {
+        fat_mark_dirty(fd->fs, fd->pos - pos_old);
+        fat_tick(fd->fs);
+        return fd->pos - pos_old;
+    }
+    return result;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Prepares the file position for writing directly to the device.
+ *
+ * Flushes and drops the file buffer, and moves the file position to
+ * the end of the file if it is opened for appending.
+ *
+ * \param[in] fd The file handle of the file to which to write.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_prepare_write_file(struct fat_file_struct* fd)
+{
+#if FAT_FILE_BUFFERING
+    /* write directly, bypassing the file buffer */
+    if(!fat_flush_file_buffer(fd))
+        return 0;
+    fd->node->buffer_start = fd->node->buffer_end = 0;
+#endif
+
+    if((fd->options & FAT_FILE_APPEND) && fd->pos != fd->node->dir_entry.file_size)
+    {
+        /* append to the end of the file */
+        fd->pos = fd->node->dir_entry.file_size;
+        fd->pos_cluster = 0;
+    }
+
+    return fd->pos <= fd->node->dir_entry.file_size;
+}
+#endif
+
+/**
+ * \ingroup fat_file
+ * Repositions the read/write file offset.
+ *
+ * Changes the file offset where the next call to fat_read_file()
+ * or fat_write_file() starts reading/writing.
+ *
+ * If the new offset is beyond the end of the file, fat_resize_file()
+ * is implicitly called, i.e. the file is expanded.
+ *
+ * The new offset can be given in different ways determined by
+ * the \c whence parameter:
+ * - \b FAT_SEEK_SET: \c *offset is relative to the beginning of the file.
+ * - \b FAT_SEEK_CUR: \c *offset is relative to the current file position.
+ * - \b FAT_SEEK_END: \c *offset is relative to the end of the file.
+ *
+ * The resulting absolute offset is written to the location the \c offset
+ * parameter points to.
+ *
+ * Seeking within the current cluster or forward is cheap, as the
+ * cluster chain is followed from the current position. Seeking
+ * backwards beyond the current cluster follows it from the beginning
+ * of the file once the file is accessed again.
+ * 
+ * \param[in] fd The file decriptor of the file on which to seek.
+ * \param[in,out] offset A pointer to the new offset, as affected by the \c whence
+ *                   parameter. The function writes the new absolute offset
+ *                   to this location before it returns.
+ * \param[in] whence Affects the way \c offset is interpreted, see above.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_seek_file(struct fat_file_struct* fd, int32_t* offset, uint8_t whence)
+{
+    if(!fd || !offset)
+        return 0;
+
+#if FAT_FILE_BUFFERING && FAT_WRITE_SUPPORT
+    if(!fat_flush_file_buffer(fd))
+        return 0;
+#endif
+
+    uint32_t new_pos = fd->pos;
+    switch(whence)
+    {
+        case FAT_SEEK_SET:
+            new_pos = *offset;
+            break;
+        case FAT_SEEK_CUR:
+            new_pos += *offset;
+            break;
+        case FAT_SEEK_END:
+            new_pos = fd->node->dir_entry.file_size + *offset;
+            break;
+        default:
+            return 0;
+    }
+
+    if(new_pos > fd->node->dir_entry.file_size
+#if FAT_WRITE_SUPPORT
+       && !fat_resize_file(fd, new_pos)
+#endif
+       )
+        return 0;
+
+    /* Unless the new offset lies before the current cluster, look up
+     * its cluster starting at the current one instead of at the
+     * beginning of the file.
+     */
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    cluster_t cluster_num = fd->pos_cluster;
+    if(cluster_num && new_pos >= (fd->pos & ~((uint32_t) cluster_size - 1)))
+    {
+        for(uint32_t n = new_pos / cluster_size - fd->pos / cluster_size; n > 0 && cluster_num; --n)
+            cluster_num = fat_get_next_cluster(fd->fs, cluster_num);
+    }
+    else
+    {
+        cluster_num = 0;
+    }
+
+    fd->pos = new_pos;
+    fd->pos_cluster = cluster_num;
+
+    *offset = (int32_t) new_pos;
+    return 1;
+}
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Resizes a file to have a specific size.
+ *
+ * Enlarges or shrinks the file pointed to by the file descriptor to have
+ * exactly the specified size.
+ *
+ * If the file is truncated, all bytes having an equal or larger offset
+ * than the given size are lost. If the file is expanded, the additional
+ * bytes are allocated.
+ *
+ * \note Please be aware that this function just allocates or deallocates disk
+ * space, it does not explicitely clear it. To avoid data leakage, this
+ * must be done manually.
+ *
+ * \note A file which is opened more than once cannot be truncated.
+ *
+ * \param[in] fd The file decriptor of the file which to resize.
+ * \param[in] size The new size of the file.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_resize_file(struct fat_file_struct* fd, uint32_t size)
+{
+    if(!fd)
+        return 0;
+
+    /* other handles may still reference the clusters to free */
+    if(size < fd->node->dir_entry.file_size && fd->node->ref_count > 1)
+        return 0;
+
+#if FAT_FILE_BUFFERING
+    if(!fat_flush_file_buffer(fd))
+        return 0;
+    fd->node->buffer_start = fd->node->buffer_end = 0;
+#endif
+
+    cluster_t cluster_num = fd->node->dir_entry.cluster;
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    uint32_t size_new = size;
+
+    do
+    {
+        if(cluster_num == 0 && size_new == 0)
+            /* the file stays empty */
+            break;
+
+        /* seek to the next cluster as long as we need the space */
+        while(size_new > cluster_size)
+        {
+            /* get next cluster of file */
+            cluster_t cluster_num_next = fat_get_next_cluster(fd->fs, cluster_num);
+            if(cluster_num_next)
+            {
+                cluster_num = cluster_num_next;
+                size_new -= cluster_size;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        if(size_new > cluster_size || cluster_num == 0)
+        {
+            /* Allocate new cluster chain and append
+             * it to the existing one, if available.
+             */
+            cluster_t cluster_count = (size_new + cluster_size - 1) / cluster_size;
+            cluster_t cluster_new_chain = fat_append_clusters(fd->fs, cluster_num, cluster_count);
+            if(!cluster_new_chain)
+                return 0;
+
+            if(!cluster_num)
+            {
+                cluster_num = cluster_new_chain;
+                fd->node->dir_entry.cluster = cluster_num;
+            }
+        }
+
+        /* write new directory entry */
+        fd->node->dir_entry.file_size = size;
+        if(size == 0)
+            fd->node->dir_entry.cluster = 0;
+        if(!fat_write_dir_entry(fd->fs, &fd->node->dir_entry))
+            return 0;
+
+        fd->node->size_synced = size;
+        fd->node->cluster_last = 0;
+
+        if(size == 0)
+        {
+            /* free all clusters of file */
+            fat_free_clusters(fd->fs, cluster_num);
+        }
+        else if(size_new <= cluster_size)
+        {
+            /* free all clusters no longer needed */
+            fat_terminate_clusters(fd->fs, cluster_num);
+        }
+
+    } while(0);
+
+    /* correct file position */
+    if(size < fd->pos)
+    {
+        fd->pos = size;
+        fd->pos_cluster = 0;
+    }
+
+    return 1;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Copies a file into a directory.
+ *
+ * The new file gets all of its clusters in one step, contiguously if the
+ * filesystem has a large enough run of free clusters. The data is then
+ * copied cluster run by cluster run through the block cache, without
+ * intermediate file size updates, and the directory entry of the new
+ * file is written once the data is complete.
+ *
+ * \param[in] src The file handle of the file to copy.
+ * \param[in] dst_dir The handle of the directory in which to create the copy.
+ * \param[in] name The name of the copy, which must not exist yet.
+ * \param[out] dir_entry The directory entry to fill for the copy.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_create_file
+ */
+uint8_t fat_copy_file(struct fat_file_struct* src, struct fat_dir_struct* dst_dir, const char* name, struct fat_dir_entry_struct* dir_entry)
+{
+    if(!src || !dst_dir || !name || !dir_entry || src->fs != dst_dir->fs)
+        return 0;
+
+#if FAT_FILE_BUFFERING
+    /* the data still gathered in the buffer has to be copied as well */
+    if(!fat_flush_file_buffer(src))
+        return 0;
+#endif
+
+    struct fat_fs_struct* fs = src->fs;
+    uint16_t cluster_size = fs->header.cluster_size;
+    uint16_t sector_size = fs->header.sector_size;
+    uint32_t size = src->node->dir_entry.file_size;
+    if(!fat_create_file(dst_dir, name, dir_entry))
+        return 0;
+    if(size == 0)
+        return 1;
+
+    /* allocate all clusters at once, preferably in a single run */
+    cluster_t cluster_count = (size + cluster_size - 1) / cluster_size;
+    cluster_t cluster_first = fat_find_free_clusters(fs, cluster_count);
+    if(cluster_first)
+        fs->cluster_free = cluster_first;
+    cluster_first = fat_append_clusters(fs, 0, cluster_count);
+    if(!cluster_first)
+    {
+        fat_delete_file(fs, dir_entry);
+        return 0;
+    }
+
+    cluster_t cluster_src = src->node->dir_entry.cluster;
+    cluster_t cluster_dst = cluster_first;
+    uint32_t size_left = size;
+    uint8_t result = 0;
+    while(cluster_src && cluster_dst)
+    {
+        /* determine the runs of consecutive clusters in both files */
+        cluster_t run_src = cluster_src;
+        cluster_t run_dst = cluster_dst;
+        uint32_t run_length = 0;
+        do
+        {
+            run_length += cluster_size;
+            cluster_src = fat_get_next_cluster(fs, cluster_src);
+            cluster_dst = fat_get_next_cluster(fs, cluster_dst);
+        } while(run_length < size_left &&
+                cluster_src == run_src + run_length / cluster_size &&
+                cluster_dst == run_dst + run_length / cluster_size);
+
+        if(run_length > size_left)
+            run_length = size_left;
+        size_left -= run_length;
+
+        /* copy the runs, up to the end of the sector holding the last byte */
+        if(!fat_copy_device_data(fs, fat_cluster_offset(fs, run_src), fat_cluster_offset(fs, run_dst),
+                                 (run_length + sector_size - 1) / sector_size * sector_size))
+            break;
+
+        if(size_left == 0)
+        {
+            result = 1;
+            break;
+        }
+    }
+
+    if(result)
+    {
+        /* write directory entry */
+        dir_entry->cluster = cluster_first;
+        dir_entry->file_size = size;
+        result = fat_write_dir_entry(fs, dir_entry);
+    }
+
+    if(!result)
+    {
+        /* remove the incomplete copy */
+        fat_free_clusters(fs, cluster_first);
+        dir_entry->cluster = 0;
+        fat_delete_file(fs, dir_entry);
+    }
+    else
+    {
+        fat_mark_dirty(fs, size);
+        fat_tick(fs);
+    }
+
+    return result;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Allocates a contiguous area of disk space for an empty file.
+ *
+ * The clusters needed for \c size bytes are taken from the first run
+ * of free clusters large enough to hold all of them, and the file
+ * size is set to \c size. Use fat_get_extents() to get the location of
+ * the area, and fat_resize_file() to trim the file to the amount of
+ * data actually written.
+ *
+ * \note Just like fat_resize_file(), this function does not clear the
+ * disk space allocated.
+ *
+ * \param[in] fd The file decriptor of the empty file for which to allocate space.
+ * \param[in] size The size of the file.
+ * \returns 0 on failure or if there is no contiguous free area large enough, 1 on success.
+ * \see fat_get_extents
+ */
+uint8_t fat_allocate_file(struct fat_file_struct* fd, uint32_t size)
+{
+    if(!fd || size < 1)
+        return 0;
+
+#if FAT_FILE_BUFFERING
+    if(!fat_flush_file_buffer(fd))
+        return 0;
+    fd->node->buffer_start = fd->node->buffer_end = 0;
+#endif
+
+    if(fd->node->dir_entry.cluster || fd->node->dir_entry.file_size)
+        return 0;
+
+    struct fat_fs_struct* fs = fd->fs;
+    cluster_t cluster_count = (size + fs->header.cluster_size - 1) / fs->header.cluster_size;
+
+    /* search a free area and allocate it by directing the next search to it */
+    cluster_t cluster_num = fat_find_free_clusters(fs, cluster_count);
+    if(!cluster_num)
+        return 0;
+    fs->cluster_free = cluster_num;
+    cluster_num = fat_append_clusters(fs, 0, cluster_count);
+    if(!cluster_num)
+        return 0;
+
+    /* write new directory entry */
+    fd->node->dir_entry.cluster = cluster_num;
+    fd->node->dir_entry.file_size = size;
+    if(!fat_write_dir_entry(fs, &fd->node->dir_entry))
+    {
+        fat_free_clusters(fs, cluster_num);
+        fd->node->dir_entry.cluster = 0;
+        fd->node->dir_entry.file_size = 0;
+        return 0;
+    }
+
+    fd->node->size_synced = size;
+    fd->node->cluster_last = cluster_num + cluster_count - 1;
+    fd->pos_cluster = 0;
+
+    return 1;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Searches the FAT for a run of consecutive free clusters.
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in] count The number of free clusters needed.
+ * \returns The first cluster of the run, or 0 if there is none.
+ */
+cluster_t fat_find_free_clusters(const struct fat_fs_struct* fs, cluster_t count)
+{
+    uint8_t fat[32];
+    struct fat_find_free_clusters_callback_arg arg;
+    arg.cluster = 0;
+    arg.run_first = 0;
+    arg.run_count = 0;
+    arg.count = count;
+    arg.buffer_size = sizeof(fat);
+#if FAT_FAT32_SUPPORT
+    arg.is_fat32 = (fs->partition->type == PARTITION_TYPE_FAT32);
+#endif
+
+    offset_t fat_offset = fs->header.fat_offset;
+    uint32_t fat_size = fs->header.fat_size;
+    while(fat_size > 0 && arg.run_count < count)
+    {
+        uintptr_t length = UINTPTR_MAX - 1;
+        if(fat_size < length)
+            length = fat_size;
+
+        if(!fs->partition->device_read_interval(fat_offset,
+                                                fat,
+                                                sizeof(fat),
+                                                length,
+                                                fat_find_free_clusters_callback,
+                                                &arg
+                                               )
+          )
+            return 0;
+
+        fat_offset += length;
+        fat_size -= length;
+    }
+
+    return arg.run_count < count ? 0 : arg.run_first;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Callback function used for searching a run of free clusters in a FAT.
+ */
+uint8_t fat_find_free_clusters_callback(uint8_t* buffer, offset_t offset, void* p)
+{
+    struct fat_find_free_clusters_callback_arg* arg = p;
+    uintptr_t buffer_size = arg->buffer_size;
+
+    while(buffer_size > 0)
+    {
+        uint8_t is_free;
+#if FAT_FAT32_SUPPORT
+        if(arg->is_fat32)
+        {
+            is_free = (*((uint32_t*) buffer) == HTOL32(FAT32_CLUSTER_FREE));
+            buffer += 4;
+            buffer_size -= 4;
+        }
+        else
+#endif
+        {
+            is_free = (*((uint16_t*) buffer) == HTOL16(FAT16_CLUSTER_FREE));
+            buffer += 2;
+            buffer_size -= 2;
+        }
+
+        /* the first two entries do not describe clusters */
+        if(is_free && arg->cluster >= 2)
+        {
+            if(!arg->run_count++)
+                arg->run_first = arg->cluster;
+            if(arg->run_count >= arg->count)
+                return 0;
+        }
+        else
+        {
+            arg->run_count = 0;
+        }
+
+        ++arg->cluster;
+    }
+
+    return 1;
+}
+#endif
+
+/**
+ * \ingroup fat_file
+ * Retrieves the location of a file's data on the device.
+ *
+ * Each extent describes a run of consecutive clusters of the file,
+ * i.e. an area of the device which holds a contiguous part of the
+ * file's data. The extents cover all of the clusters allocated to the
+ * file, so the last one may extend beyond the end of the file.
+ *
+ * Together with fat_allocate_file(), this allows to write a file's
+ * data directly to the device, e.g. with sd_raw_write_blocks(). While
+ * doing so, the file must not be accessed through its file descriptor.
+ *
+ * \param[in] fd The file decriptor of the file whose extents to retrieve.
+ * \param[out] extents The array which receives the extents.
+ * \param[in,out] count The number of entries available in \c extents.
+ *                      Receives the number of extents written to it.
+ * \returns 0 on failure or if the file has more extents than fit into \c extents, 1 on success.
+ * \see fat_allocate_file
+ */
+uint8_t fat_get_extents(struct fat_file_struct* fd, struct fat_extent* extents, uint8_t* count)
+{
+    if(!fd || !extents || !count)
+        return 0;
+
+#if FAT_FILE_BUFFERING && FAT_WRITE_SUPPORT
+    if(!fat_flush_file_buffer(fd))
+        return 0;
+    fd->node->buffer_start = fd->node->buffer_end = 0;
+#endif
+
+    struct fat_fs_struct* fs = fd->fs;
+    uint16_t cluster_size = fs->header.cluster_size;
+    uint8_t extent_max = *count;
+    struct fat_extent* extent = extents - 1;
+    cluster_t cluster_prev = 0;
+
+    *count = 0;
+    for(cluster_t cluster_num = fd->node->dir_entry.cluster; cluster_num; cluster_num = fat_get_next_cluster(fs, cluster_num))
+    {
+        if(cluster_prev && cluster_num == cluster_prev + 1)
+        {
+            /* the run of clusters continues */
+            extent->length += cluster_size;
+        }
+        else
+        {
+            /* a new run of clusters starts */
+            if(*count >= extent_max)
+                return 0;
+
+            ++extent;
+            ++*count;
+            extent->offset = fat_cluster_offset(fs, cluster_num);
+            extent->length = cluster_size;
+        }
+
+        cluster_prev = cluster_num;
+    }
+
+    return 1;
+}
+
+#if DOXYGEN || FAT_FILE_BUFFERING
+/**
+ * \ingroup fat_fs
+ * Reads data from a file through the file buffer.
+ *
+ * The buffer holds the sector in which the file position lies. It
+ * is loaded with a single device access, subsequent small reads are
+ * served from memory.
+ *
+ * \param[in] fd The file handle of the file from which to read.
+ * \param[out] buffer The buffer into which to write.
+ * \param[in] buffer_len The amount of data to read.
+ * \returns The number of bytes read, 0 on end of file, or -1 on failure.
+ * \see fat_read_file
+ */
+intptr_t fat_read_file_buffered(struct fat_file_struct* fd, uint8_t* buffer, uintptr_t buffer_len)
+{
+#if FAT_WRITE_SUPPORT
+    if(!fat_flush_file_buffer(fd))
+        return -1;
+#endif
+
+    uint16_t cluster_size = fd->fs->header.cluster_size;
+    uintptr_t buffer_left = buffer_len;
+    while(buffer_left > 0 && fd->pos < fd->node->dir_entry.file_size)
+    {
+        if(fd->pos < fd->node->buffer_offset + fd->node->buffer_start ||
+           fd->pos >= fd->node->buffer_offset + fd->node->buffer_end)
+        {
+            /* find cluster in which the file position lies */
+            cluster_t cluster_num = fd->pos_cluster;
+            if(!cluster_num)
+            {
+                cluster_num = fd->node->dir_entry.cluster;
+
+                uint32_t pos = fd->pos;
+                while(cluster_num && pos >= cluster_size)
+                {
+                    pos -= cluster_size;
+                    cluster_num = fat_get_next_cluster(fd->fs, cluster_num);
+                }
+                if(!cluster_num)
+                    break;
+            }
+
+            /* load the sector into the buffer */
+            offset_t buffer_offset = fd->pos & ~((offset_t) sizeof(fd->node->buffer) - 1);
+            uint16_t buffer_end = sizeof(fd->node->buffer);
+            if(fd->node->dir_entry.file_size - buffer_offset < buffer_end)
+                buffer_end = fd->node->dir_entry.file_size - buffer_offset;
+
+            fd->node->buffer_start = fd->node->buffer_end = 0;
+            if(!fat_read_file_data(fd,
+                                   fat_cluster_offset(fd->fs, cluster_num) + (buffer_offset & (cluster_size - 1)),
+                                   fd->node->buffer,
+                                   buffer_end
+                                  )
+              )
+                break;
+
+            fd->node->buffer_offset = buffer_offset;
+            fd->node->buffer_cluster = cluster_num;
+            fd->node->buffer_end = buffer_end;
+        }
+
+        /* copy data from the buffer */
+        uint16_t copy_offset = fd->pos - fd->node->buffer_offset;
+        uint16_t copy_length = fd->node->buffer_end - copy_offset;
+        if(copy_length > buffer_left)
+            copy_length = buffer_left;
+
+        memcpy(buffer, fd->node->buffer + copy_offset, copy_length);
+        buffer += copy_length;
+        buffer_left -= copy_length;
+        fat_move_file_buffer_pos(fd, copy_length);
+    }
+
+    if(buffer_left == buffer_len && fd->pos < fd->node->dir_entry.file_size)
+        return -1;
+
+    return buffer_len - buffer_left;
+}
+#endif
+
+#if DOXYGEN || (FAT_FILE_BUFFERING && FAT_WRITE_SUPPORT)
+/**
+ * \ingroup fat_fs
+ * Writes data to a file through the file buffer.
+ *
+ * Data is gathered within the buffer until the sector it belongs
+ * to is complete, or until the file buffer gets flushed.
+ *
+ * \param[in] fd The file handle of the file to which to write.
+ * \param[in] buffer The buffer from which to read the data to be written.
+ * \param[in] buffer_len The amount of data to write.
+ * \returns The number of bytes written, 0 on disk full, or -1 on failure.
+ * \see fat_write_file
+ */
+intptr_t fat_write_file_buffered(struct fat_file_struct* fd, const uint8_t* buffer, uintptr_t buffer_len)
+{
+    /* determine file size including buffered data */
+    uint32_t size = fd->node->dir_entry.file_size;
+    if(fd->node->buffer_dirty && fd->node->buffer_offset + fd->node->buffer_end > size)
+        size = fd->node->buffer_offset + fd->node->buffer_end;
+
+    if((fd->options & FAT_FILE_APPEND) && fd->pos != size)
+    {
+        /* append to the end of the file */
+        if(!fat_flush_file_buffer(fd))
+            return -1;
+        fd->pos = fd->node->dir_entry.file_size;
+        fd->pos_cluster = 0;
+    }
+    if(fd->pos > size)
+        return -1;
+
+    uintptr_t buffer_left = buffer_len;
+    while(buffer_left > 0)
+    {
+        offset_t buffer_offset = fd->pos & ~((offset_t) sizeof(fd->node->buffer) - 1);
+        uint16_t copy_offset = fd->pos - buffer_offset;
+        if(buffer_offset != fd->node->buffer_offset ||
+           fd->node->buffer_start >= fd->node->buffer_end ||
+           copy_offset < fd->node->buffer_start ||
+           copy_offset > fd->node->buffer_end)
+        {
+            /* the data does not continue the buffer, so start anew */
+            if(!fat_flush_file_buffer(fd))
+                break;
+
+            fd->node->buffer_offset = buffer_offset;
+            fd->node->buffer_cluster = fd->pos_cluster;
+            fd->node->buffer_start = fd->node->buffer_end = copy_offset;
+        }
+
+        /* copy data into the buffer */
+        uint16_t copy_length = sizeof(fd->node->buffer) - copy_offset;
+        if(copy_length > buffer_left)
+            copy_length = buffer_left;
+
+        memcpy(fd->node->buffer + copy_offset, buffer, copy_length);
+        buffer += copy_length;
+        buffer_left -= copy_length;
+        if(copy_offset + copy_length > fd->node->buffer_end)
+            fd->node->buffer_end = copy_offset + copy_length;
+        fd->node->buffer_dirty = 1;
+        fat_move_file_buffer_pos(fd, copy_length);
+
+        /* write the sector as soon as it is complete */
+        if(fd->node->buffer_end >= sizeof(fd->node->buffer) && !fat_flush_file_buffer(fd))
+            break;
+    }
+
+    if(buffer_left == buffer_len)
+        return -1;
+
+    return buffer_len - buffer_left;
+}
+#endif
+
+#if DOXYGEN || (FAT_FILE_BUFFERING && FAT_WRITE_SUPPORT)
+/**
+ * \ingroup fat_fs
+ * Writes the data gathered within the file buffer to disk.
+ *
+ * \param[in] fd The file handle whose buffer to flush.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_flush_file_buffer(struct fat_file_struct* fd)
+{
+    if(!fd->node->buffer_dirty)
+        return 1;
 
-            if(!cluster_num)
-            {
-                cluster_num = cluster_new_chain;
-                fd->dir_entry.cluster = cluster_num;
-            }
-        }
+    /* write the buffered data at the position it belongs to */
+    uint32_t pos = fd->pos;
+    cluster_t pos_cluster = fd->pos_cluster;
+    uint16_t length = fd->node->buffer_end - fd->node->buffer_start;
 
-        /* write new directory entry */
-        fd->dir_entry.file_size = size;
-        if(size == 0)
-            fd->dir_entry.cluster = 0;
-        if(!fat_write_dir_entry(fd->fs, &fd->dir_entry))
-            return 0;
+    struct fat_iovec iov;
+    iov.buffer = fd->node->buffer + fd->node->buffer_start;
+    iov.buffer_len = length;
 
-        if(size == 0)
-        {
-            /* free all clusters of file */
-            fat_free_clusters(fd->fs, cluster_num);
-        }
-        else if(size_new <= cluster_size)
-        {
-            /* free all clusters no longer needed */
-            fat_terminate_clusters(fd->fs, cluster_num);
-        }
+    fd->pos = fd->node->buffer_offset + fd->node->buffer_start;
+    fd->pos_cluster = fd->node->buffer_cluster;
+    if(fat_write_file_direct(fd, &iov, 1) != length)
+    {
+        fd->pos = pos;
+        fd->pos_cluster = pos_cluster;
+        return 0;
+    }
 
-    } while(0);
+    fd->node->buffer_dirty = 0;
+    if(fd->node->buffer_end < sizeof(fd->node->buffer))
+        /* the position stayed within the cluster of the buffer */
+        fd->node->buffer_cluster = fd->pos_cluster;
+    else
+        fd->node->buffer_start = fd->node->buffer_end = 0;
 
-    /* correct file position */
-    if(size < fd->pos)
+    if(fd->pos != pos)
     {
-        fd->pos = size;
-        fd->pos_cluster = 0;
+        fd->pos = pos;
+        fd->pos_cluster = pos_cluster;
     }
 
     return 1;
 }
+
+/**
+ * \ingroup fat_file
+ * Writes the buffered data of an open file to disk.
+ *
+ * Used where no handle of the file is at hand, like fat_sync().
+ *
+ * \param[in] fs The filesystem on which the file lies.
+ * \param[in] node The node of the file whose buffer to write.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_flush_node_buffer(struct fat_fs_struct* fs, struct fat_file_node* node)
+{
+    if(!node->buffer_dirty)
+        return 1;
+
+    /* The callers write the file size anyway. No options are set, so
+     * the flush does not mark the file as having a deferred size.
+     */
+    struct fat_file_struct fd;
+    memset(&fd, 0, sizeof(fd));
+    fd.fs = fs;
+    fd.node = node;
+    fd.pos_cluster = node->dir_entry.cluster;
+
+    return fat_flush_file_buffer(&fd);
+}
+#endif
+
+#if DOXYGEN || FAT_FILE_BUFFERING
+/**
+ * \ingroup fat_fs
+ * Advances the file position within the file buffer.
+ *
+ * Keeps track of the cluster in which the new file position lies.
+ *
+ * \param[in] fd The file handle whose position to advance.
+ * \param[in] length The number of bytes by which to advance.
+ */
+void fat_move_file_buffer_pos(struct fat_file_struct* fd, uint16_t length)
+{
+    fd->pos += length;
+
+    if(fd->pos - fd->node->buffer_offset < sizeof(fd->node->buffer) ||
+       (fd->pos & (fd->fs->header.cluster_size - 1)))
+        /* the position stays within the cluster of the buffer */
+        fd->pos_cluster = fd->node->buffer_cluster;
+    else if(fd->node->buffer_cluster)
+        /* the position moved onto the next cluster */
+        fd->pos_cluster = fat_get_next_cluster(fd->fs, fd->node->buffer_cluster);
+    else
+        fd->pos_cluster = 0;
+}
 #endif
 
 /**
@@ -1420,6 +3896,16 @@ uint8_t fat_read_dir(struct fat_dir_struct* dd, struct fat_dir_entry_struct* dir
     uint8_t buffer[32];
     while(!arg.finished)
     {
+        if(cluster_offset >= cluster_size)
+        {
+            /* we reached the cluster border and switch to the next cluster */
+            cluster_offset = 0;
+
+            /* get number of next cluster */
+            if(cluster_num == 0 || !(cluster_num = fat_get_next_cluster(fs, cluster_num)))
+                break;
+        }
+
         /* read directory entries up to the cluster border */
         uint16_t cluster_left = cluster_size - cluster_offset;
         uint32_t pos = cluster_offset;
@@ -1438,27 +3924,37 @@ uint8_t fat_read_dir(struct fat_dir_struct* dd, struct fat_dir_entry_struct* dir
           )
             return 0;
 
-        cluster_offset += arg.bytes_read;
-
-        if(cluster_offset >= cluster_size)
+        if(arg.cluster_end)
         {
-            /* we reached the cluster border and switch to the next cluster */
-            cluster_offset = 0;
-
-            /* get number of next cluster */
-            if(!(cluster_num = fat_get_next_cluster(fs, cluster_num)))
-            {
-                /* directory entry not found, reset directory handle */
-                cluster_num = dd->dir_entry.cluster;
-                break;
-            }
+            /* the rest of the cluster is free */
+            cluster_offset = cluster_size;
+            arg.cluster_end = 0;
+        }
+        else
+        {
+            cluster_offset += arg.bytes_read;
         }
     }
 
+    if(!arg.finished || dir_entry->long_name[0] == '\0')
+    {
+        /* directory entry not found, reset directory handle */
+        fat_reset_dir(dd);
+        return 0;
+    }
+
     dd->entry_cluster = cluster_num;
     dd->entry_offset = cluster_offset;
 
-    return dir_entry->long_name[0] != '\0' ? 1 : 0;
+    /* report the current state of a file which is open */
+    struct fat_file_node* node = fat_find_file_node(fs, dir_entry->entry_offset);
+    if(node)
+    {
+        dir_entry->cluster = node->dir_entry.cluster;
+        dir_entry->file_size = node->dir_entry.file_size;
+    }
+
+    return 1;
 }
 
 /**
@@ -1482,6 +3978,228 @@ uint8_t fat_reset_dir(struct fat_dir_struct* dd)
     return 1;
 }
 
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_dir
+ * Reserves space for new entries within a directory.
+ *
+ * Makes sure that at least the given number of free directory
+ * entries follow the last used entry of the directory. If needed,
+ * clusters are appended to the directory and cleared ahead of time,
+ * so creating files or directories later on neither allocates nor
+ * clears clusters. As reading a directory skips the rest of a
+ * cluster at its first empty entry, the reserved space hardly slows
+ * down reading it.
+ *
+ * \note A file takes one directory entry for its 8.3 name and
+ * one more for each 13 characters of its long name. As entries
+ * are not split at cluster borders, reserve some extra entries.
+ *
+ * \param[in] dd The handle of the directory in which to reserve entries.
+ * \param[in] entry_count The number of directory entries to reserve.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_create_file
+ */
+uint8_t fat_reserve_dir(struct fat_dir_struct* dd, uint16_t entry_count)
+{
+    if(!dd)
+        return 0;
+
+    struct fat_fs_struct* fs = dd->fs;
+    const struct fat_header_struct* header = &fs->header;
+    struct fat_find_offsets_callback_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+
+    cluster_t cluster_num = dd->dir_entry.cluster;
+#if FAT_FAT32_SUPPORT
+    if(cluster_num == 0 && fs->partition->type == PARTITION_TYPE_FAT32)
+        cluster_num = header->root_dir_cluster;
+#endif
+
+    /* count the free entries behind the last used entry of the directory */
+    uint8_t buffer[32];
+    uint32_t entries_free = 0;
+    while(1)
+    {
+        offset_t offset;
+        offset_t offset_to;
+        if(cluster_num == 0)
+        {
+            offset = header->root_dir_offset;
+            offset_to = header->cluster_zero_offset;
+        }
+        else
+        {
+            offset = fat_cluster_offset(fs, cluster_num);
+            offset_to = offset + header->cluster_size;
+        }
+
+        /* live entries may follow empty ones, so read all clusters */
+        arg.free_entries = 0;
+        if(!fs->partition->device_read_interval(offset,
+                                                buffer,
+                                                sizeof(buffer),
+                                                offset_to - offset,
+                                                fat_find_offsets_callback,
+                                                &arg)
+          )
+            return 0;
+
+        if(arg.free_entries == (offset_to - offset) / 32)
+            entries_free += arg.free_entries;
+        else
+            entries_free = arg.free_entries;
+
+        if(cluster_num == 0)
+            /* the fixed root directory cannot grow */
+            return entries_free >= entry_count;
+
+        cluster_t cluster_next = fat_get_next_cluster(fs, cluster_num);
+        if(!cluster_next)
+            break;
+        cluster_num = cluster_next;
+    }
+
+    if(entries_free >= entry_count)
+        return 1;
+
+    /* append and clear the missing clusters */
+    uint16_t entries_per_cluster = header->cluster_size / 32;
+    cluster_t cluster_count = (entry_count - entries_free + entries_per_cluster - 1) / entries_per_cluster;
+    cluster_t cluster_new = fat_append_clusters(fs, cluster_num, cluster_count);
+    if(!cluster_new)
+        return 0;
+
+    if(!fat_clear_clusters(fs, cluster_new))
+    {
+        fat_terminate_clusters(fs, cluster_num);
+        return 0;
+    }
+
+    return 1;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Repairs the files of a volume whose sizes have been deferred.
+ *
+ * When file sizes are deferred with FAT_FILE_DEFER_SIZE and power
+ * is lost, the cluster chain of a file may reach beyond its size. Such
+ * files are marked in their directory entries. The size last written
+ * is the checkpoint up to which the data is known to be valid. The
+ * cluster chain of each marked file is cut back to it, and the mark is
+ * cleared. Data written after the checkpoint is lost.
+ *
+ * All directories of the volume are searched, down to a depth of
+ * #FAT_DELETE_TREE_DEPTH levels. Files which are open are skipped.
+ * Unless all of this succeeds, fat_close() leaves the volume marked as
+ * not unmounted cleanly, so recovery is tried again on the next mount.
+ *
+ * If the volume has been unmounted cleanly, nothing is done, so this
+ * is cheap to call after mounting the filesystem.
+ *
+ * \param[in] fs The filesystem to repair.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_set_file_options
+ */
+uint8_t fat_recover(struct fat_fs_struct* fs)
+{
+    if(!fs)
+        return 0;
+    if(fs->unclean != FAT_VOLUME_RECOVER)
+        return 1;
+
+    int8_t clean = fat_get_clean(fs);
+    if(clean < 0)
+        return 0;
+    if(clean)
+    {
+        fs->unclean = FAT_VOLUME_CLEAN;
+        return 1;
+    }
+
+    uint16_t cluster_size = fs->header.cluster_size;
+    struct fat_recover_level levels[FAT_DELETE_TREE_DEPTH];
+    uint8_t depth = 0;
+    struct fat_dir_entry_struct dir_entry;
+
+    /* walk the tree, starting with the root directory */
+    struct fat_dir_struct dd;
+    memset(&dd, 0, sizeof(dd));
+    dd.fs = fs;
+
+    while(1)
+    {
+        if(!fat_read_dir(&dd, &dir_entry))
+        {
+            /* we reached the end of the directory and return to its parent */
+            if(depth == 0)
+                break;
+
+            --depth;
+            dd.dir_entry.cluster = levels[depth].dir_cluster;
+            dd.entry_cluster = levels[depth].entry_cluster;
+            dd.entry_offset = levels[depth].entry_offset;
+            continue;
+        }
+
+        if(dir_entry.attributes & FAT_ATTRIB_DIR)
+        {
+            /* skip the "." and ".." directory references */
+            if(!dir_entry.cluster ||
+               (dir_entry.long_name[0] == '.' &&
+                (!dir_entry.long_name[1] || (dir_entry.long_name[1] == '.' && !dir_entry.long_name[2]))))
+                continue;
+            if(depth >= FAT_DELETE_TREE_DEPTH)
+                return 0;
+
+            /* descend into the subdirectory */
+            levels[depth].dir_cluster = dd.dir_entry.cluster;
+            levels[depth].entry_cluster = dd.entry_cluster;
+            levels[depth].entry_offset = dd.entry_offset;
+            ++depth;
+
+            dd.dir_entry.cluster = dd.entry_cluster = dir_entry.cluster;
+            dd.entry_offset = 0;
+            continue;
+        }
+
+        if(!dir_entry.size_deferred || (dir_entry.attributes & FAT_ATTRIB_VOLUME) ||
+           fat_find_file_node(fs, dir_entry.entry_offset))
+            continue;
+
+        /* cut the cluster chain back to the checkpointed size */
+        cluster_t cluster_num = dir_entry.cluster;
+        if(cluster_num && !dir_entry.file_size)
+        {
+            if(!fat_free_clusters(fs, cluster_num))
+                return 0;
+            dir_entry.cluster = 0;
+        }
+        else if(cluster_num)
+        {
+            for(uint32_t pos = cluster_size; pos < dir_entry.file_size && cluster_num; pos += cluster_size)
+                cluster_num = fat_get_next_cluster(fs, cluster_num);
+
+            if(cluster_num && fat_get_next_cluster(fs, cluster_num) &&
+               !fat_terminate_clusters(fs, cluster_num))
+                return 0;
+        }
+
+        dir_entry.size_deferred = 0;
+        if(!fat_write_dir_entry(fs, &dir_entry))
+            return 0;
+    }
+
+    /* let fat_close() mark the volume as clean again */
+    fs->unclean = FAT_VOLUME_DIRTY;
+    return 1;
+}
+#endif
+
 /**
  * \ingroup fat_fs
  * Callback function for reading a directory entry.
@@ -1493,8 +4211,19 @@ uint8_t fat_dir_entry_read_callback(uint8_t* buffer, offset_t offset, void* p)
 
     arg->bytes_read += 32;
 
-    /* skip deleted or empty entries */
-    if(buffer[0] == FAT_DIRENTRY_DELETED || !buffer[0])
+    /* An empty entry marks the end of the directory. Older versions
+     * of this code left empty entries at the end of a cluster and
+     * continued in the next one, so only skip the rest of the cluster.
+     */
+    if(!buffer[0])
+    {
+        memset(dir_entry, 0, sizeof(*dir_entry));
+        arg->cluster_end = 1;
+        return 0;
+    }
+
+    /* skip deleted entries */
+    if(buffer[0] == FAT_DIRENTRY_DELETED)
         return 1;
 
     if(!dir_entry->entry_offset)
@@ -1609,6 +4338,7 @@ uint8_t fat_interpret_dir_entry(struct fat_dir_entry_struct* dir_entry, const ui
         dir_entry->cluster |= ((cluster_t) ltoh16(*((uint16_t*) &raw_entry[20]))) << 16;
 #endif
         dir_entry->file_size = ltoh32(*((uint32_t*) &raw_entry[28]));
+        dir_entry->size_deferred = (raw_entry[12] & FAT_DIRENTRY_SIZE_DEFERRED) ? 1 : 0;
 
 #if FAT_DATETIME_SUPPORT
         dir_entry->modification_time = ltoh16(*((uint16_t*) &raw_entry[22]));
@@ -1622,111 +4352,249 @@ uint8_t fat_interpret_dir_entry(struct fat_dir_entry_struct* dir_entry, const ui
 #if DOXYGEN || FAT_WRITE_SUPPORT
 /**
  * \ingroup fat_fs
- * Searches for space where to store a directory entry.
+ * Searches for space where to store directory entries.
+ *
+ * The whole cluster chain of the directory is read only once, as
+ * live entries may follow empty ones in the next cluster. Meanwhile,
+ * the names of the existing entries are compared to the new ones and
+ * runs of free entries are assigned to the new entries in order.
+ * Entries which do not fit are placed behind the last used entry of
+ * the directory. If needed, the directory is grown by all missing
+ * clusters at once.
  *
  * \param[in] fs The filesystem on which to operate.
  * \param[in] parent The directory in which to search.
- * \param[in] dir_entry The directory entry for which to search space.
- * \returns 0 on failure, a device offset on success.
+ * \param[in,out] dir_entries The directory entries for which to search space.
+ * \param[in] count The number of directory entries.
+ * \returns 0 on failure or if a name already exists, 1 on success.
  */
-offset_t fat_find_offset_for_dir_entry(const struct fat_fs_struct* fs, const struct fat_dir_struct* parent, const struct fat_dir_entry_struct* dir_entry)
+uint8_t fat_find_offsets_for_dir_entries(struct fat_fs_struct* fs, const struct fat_dir_struct* parent, struct fat_dir_entry_struct* dir_entries, uint8_t count)
 {
-    if(!fs || !dir_entry)
-        return 0;
+    const struct fat_header_struct* header = &fs->header;
+    struct fat_find_offsets_callback_arg arg;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.dir_entries = dir_entries;
+    arg.count = count;
 
-    /* search for a place where to write the directory entry to disk */
-    uint8_t free_dir_entries_needed = (strlen(dir_entry->long_name) + 12) / 13 + 1;
-    uint8_t free_dir_entries_found = 0;
     cluster_t cluster_num = parent->dir_entry.cluster;
-    offset_t dir_entry_offset = 0;
-    offset_t offset = 0;
-    offset_t offset_to = 0;
 #if FAT_FAT32_SUPPORT
-    uint8_t is_fat32 = (fs->partition->type == PARTITION_TYPE_FAT32);
+    if(cluster_num == 0 && fs->partition->type == PARTITION_TYPE_FAT32)
+        cluster_num = header->root_dir_cluster;
 #endif
 
-    if(cluster_num == 0)
+    /* check for collisions and search for free entries in a single pass */
+    uint8_t buffer[32];
+    offset_t offset;
+    offset_t offset_to;
+    while(1)
     {
-#if FAT_FAT32_SUPPORT
-        if(is_fat32)
+        if(cluster_num == 0)
         {
-            cluster_num = fs->header.root_dir_cluster;
+            /* we read from the fixed root directory */
+            offset = header->root_dir_offset;
+            offset_to = header->cluster_zero_offset;
         }
         else
-#endif
         {
-            /* we read/write from the root directory entry */
-            offset = fs->header.root_dir_offset;
-            offset_to = fs->header.cluster_zero_offset;
-            dir_entry_offset = offset;
+            offset = fat_cluster_offset(fs, cluster_num);
+            offset_to = offset + header->cluster_size;
         }
+
+        /* directory entries must not span a cluster border */
+        arg.free_entries = 0;
+        memset(&arg.dir_entry, 0, sizeof(arg.dir_entry));
+
+        if(!fs->partition->device_read_interval(offset,
+                                                buffer,
+                                                sizeof(buffer),
+                                                offset_to - offset,
+                                                fat_find_offsets_callback,
+                                                &arg)
+          )
+            return 0;
+
+        if(arg.collision)
+            return 0;
+
+        if(cluster_num == 0)
+            break;
+
+        cluster_t cluster_next = fat_get_next_cluster(fs, cluster_num);
+        if(!cluster_next)
+            break;
+        cluster_num = cluster_next;
     }
-    
-    while(1)
+
+    /* the free entries left over reach up to the end of the directory */
+    if(arg.free_entries)
+        offset = arg.free_offset;
+    else
+        offset = offset_to;
+
+    return fat_place_dir_entries(fs, &arg, cluster_num, offset, offset_to);
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Places the directory entries not yet placed behind the last used
+ * entry of a directory.
+ *
+ * If the last cluster of the directory is too small, the directory
+ * is grown by all missing clusters at once. The new clusters are cleared.
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in,out] arg The state of the directory search.
+ * \param[in] cluster_num The last cluster of the directory, or 0 for the fixed root directory.
+ * \param[in] offset The offset behind the last used entry of the directory.
+ * \param[in] offset_to The offset where the cluster containing \c offset ends.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_place_dir_entries(struct fat_fs_struct* fs, struct fat_find_offsets_callback_arg* arg, cluster_t cluster_num, offset_t offset, offset_t offset_to)
+{
+    const struct fat_header_struct* header = &fs->header;
+    struct fat_dir_entry_struct* dir_entries = arg->dir_entries;
+    uint8_t count = arg->count;
+
+    while(arg->placed < count)
     {
-        if(offset == offset_to)
+        struct fat_dir_entry_struct* dir_entry = &dir_entries[arg->placed];
+        uint8_t free_dir_entries_needed = (strlen(dir_entry->long_name) + 12) / 13 + 1;
+
+        if(offset + free_dir_entries_needed * 32 > offset_to)
         {
+            /* We reached a cluster boundary and have to switch to
+             * the next cluster. Nothing but free entries follows, so
+             * flag the ones we skip as deleted. This way they do not
+             * mark the end of the directory for other systems.
+             */
+            uint8_t deleted = FAT_DIRENTRY_DELETED;
+            for(; offset < offset_to; offset += 32)
+            {
+                if(!fs->partition->device_write(offset, &deleted, sizeof(deleted)))
+                    return 0;
+            }
+
             if(cluster_num == 0)
                 /* We iterated through the whole root directory and
-                 * could not find enough space for the directory entry.
+                 * could not find enough space for the directory entries.
                  */
                 return 0;
 
-            if(offset)
+            cluster_t cluster_next = fat_get_next_cluster(fs, cluster_num);
+            if(!cluster_next)
             {
-                /* We reached a cluster boundary and have to
-                 * switch to the next cluster.
-                 */
-
-                cluster_t cluster_next = fat_get_next_cluster(fs, cluster_num);
-                if(!cluster_next)
-                {
-                    cluster_next = fat_append_clusters(fs, cluster_num, 1);
-                    if(!cluster_next)
-                        return 0;
-
-                    /* we appended a new cluster and know it is free */
-                    dir_entry_offset = fs->header.cluster_zero_offset +
-                                       (offset_t) (cluster_next - 2) * fs->header.cluster_size;
+                /* count the clusters still needed and append them at once */
+                uint16_t entries_per_cluster = header->cluster_size / 32;
+                uint16_t entries_used = entries_per_cluster;
+                cluster_t cluster_count = 0;
+                for(uint8_t i = arg->placed; i < count; ++i)
+                {
+                    uint8_t entries_needed = (strlen(dir_entries[i].long_name) + 12) / 13 + 1;
+                    if(entries_used + entries_needed > entries_per_cluster)
+                    {
+                        ++cluster_count;
+                        entries_used = 0;
+                    }
+                    entries_used += entries_needed;
+                }
 
-                    /* clear cluster to avoid garbage directory entries */
-                    fat_clear_cluster(fs, cluster_next);
+                cluster_next = fat_append_clusters(fs, cluster_num, cluster_count);
+                if(!cluster_next)
+                    return 0;
 
-                    break;
+                /* clear clusters to avoid garbage directory entries */
+                if(!fat_clear_clusters(fs, cluster_next))
+                {
+                    fat_terminate_clusters(fs, cluster_num);
+                    return 0;
                 }
-                cluster_num = cluster_next;
             }
+            cluster_num = cluster_next;
 
             offset = fat_cluster_offset(fs, cluster_num);
-            offset_to = offset + fs->header.cluster_size;
-            dir_entry_offset = offset;
-            free_dir_entries_found = 0;
+            offset_to = offset + header->cluster_size;
         }
-        
-        /* read next lfn or 8.3 entry */
-        uint8_t first_char;
-        if(!fs->partition->device_read(offset, &first_char, sizeof(first_char)))
-            return 0;
 
-        /* check if we found a free directory entry */
-        if(first_char == FAT_DIRENTRY_DELETED || !first_char)
+        dir_entry->entry_offset = offset;
+        offset += free_dir_entries_needed * 32;
+        ++arg->placed;
+    }
+
+    return 1;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Callback function for checking names and searching free directory entries.
+ */
+uint8_t fat_find_offsets_callback(uint8_t* buffer, offset_t offset, void* p)
+{
+    struct fat_find_offsets_callback_arg* arg = p;
+    struct fat_dir_entry_struct* dir_entry = &arg->dir_entry;
+
+    if(buffer[0] == FAT_DIRENTRY_DELETED || !buffer[0])
+    {
+        /* drop partial lfn entries */
+        memset(dir_entry, 0, sizeof(*dir_entry));
+
+        if(!arg->free_entries++)
+            arg->free_offset = offset;
+
+        /* check if we have the needed number of available entries */
+        while(arg->placed < arg->count)
         {
-            /* check if we have the needed number of available entries */
-            ++free_dir_entries_found;
-            if(free_dir_entries_found >= free_dir_entries_needed)
+            struct fat_dir_entry_struct* dir_entry_new = &arg->dir_entries[arg->placed];
+            uint8_t free_dir_entries_needed = (strlen(dir_entry_new->long_name) + 12) / 13 + 1;
+            if(arg->free_entries < free_dir_entries_needed)
                 break;
 
-            offset += 32;
+            dir_entry_new->entry_offset = arg->free_offset;
+            arg->free_offset += free_dir_entries_needed * 32;
+            arg->free_entries -= free_dir_entries_needed;
+            ++arg->placed;
         }
-        else
+
+        return 1;
+    }
+
+    arg->free_entries = 0;
+
+    if(!dir_entry->entry_offset)
+        dir_entry->entry_offset = offset;
+
+    switch(fat_interpret_dir_entry(dir_entry, buffer))
+    {
+        case 0: /* failure */
+        {
+            return 0;
+        }
+        case 1: /* buffer successfully parsed, continue */
+        {
+            return 1;
+        }
+        case 2: /* directory entry complete, check for collision */
         {
-            offset += 32;
-            dir_entry_offset = offset;
-            free_dir_entries_found = 0;
+            for(uint8_t i = 0; i < arg->count; ++i)
+            {
+                if(strcmp(arg->dir_entries[i].long_name, dir_entry->long_name) == 0)
+                {
+                    memcpy(&arg->dir_entries[i], dir_entry, sizeof(*dir_entry));
+                    arg->collision = 1;
+                    return 0;
+                }
+            }
+
+            memset(dir_entry, 0, sizeof(*dir_entry));
+            return 1;
         }
     }
 
-    return dir_entry_offset;
+    return 0;
 }
 #endif
 
@@ -1750,10 +4618,12 @@ offset_t fat_find_offset_for_dir_entry(const struct fat_fs_struct* fs, const str
  * \param[in] dir_entry The directory entry to write.
  * \returns 0 on failure, 1 on success.
  */
-uint8_t fat_write_dir_entry(const struct fat_fs_struct* fs, struct fat_dir_entry_struct* dir_entry)
+uint8_t fat_write_dir_entry(struct fat_fs_struct* fs, struct fat_dir_entry_struct* dir_entry)
 {
     if(!fs || !dir_entry)
         return 0;
+
+    fat_mark_dirty(fs, 0);
     
 #if FAT_DATETIME_SUPPORT
     {
@@ -1831,6 +4701,8 @@ uint8_t fat_write_dir_entry(const struct fat_fs_struct* fs, struct fat_dir_entry
     /* fill directory entry buffer */
     memset(&buffer[11], 0, sizeof(buffer) - 11);
     buffer[0x0b] = dir_entry->attributes;
+    if(dir_entry->size_deferred)
+        buffer[0x0c] = FAT_DIRENTRY_SIZE_DEFERRED;
 #if FAT_DATETIME_SUPPORT
     *((uint16_t*) &buffer[0x16]) = htol16(dir_entry->modification_time);
     *((uint16_t*) &buffer[0x18]) = htol16(dir_entry->modification_date);
@@ -1932,36 +4804,71 @@ uint8_t fat_write_dir_entry(const struct fat_fs_struct* fs, struct fat_dir_entry
  */
 uint8_t fat_create_file(struct fat_dir_struct* parent, const char* file, struct fat_dir_entry_struct* dir_entry)
 {
-    if(!parent || !file || !file[0] || !dir_entry)
+    return fat_create_files(parent, &file, 1, dir_entry);
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_file
+ * Creates multiple files within the same directory.
+ *
+ * In contrast to calling fat_create_file() for each file, the
+ * parent directory is read only once. During this single pass,
+ * all names are checked for collisions and space for all of the
+ * new directory entries is searched. If the directory needs to
+ * grow, all of the required clusters are allocated at once.
+ * Finally the new entries are written in directory order, such
+ * that entries sharing a sector are written to disk together.
+ *
+ * If one of the files already exists or a name is given twice,
+ * no file is created at all and the directory entry of the
+ * existing file is returned at the position of the colliding name.
+ *
+ * \note The notes which apply to fat_create_file() also apply
+ * to this function.
+ *
+ * \param[in] parent The handle of the directory in which to create the files.
+ * \param[in] files The names of the files to create.
+ * \param[in] count The number of files to create.
+ * \param[out] dir_entries An array of \c count directory entries to fill for the new files.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_create_file
+ */
+uint8_t fat_create_files(struct fat_dir_struct* parent, const char* const* files, uint8_t count, struct fat_dir_entry_struct* dir_entries)
+{
+    if(!parent || !files || !count || !dir_entries)
         return 0;
 
-    /* check if the file already exists */
-    while(1)
+    struct fat_fs_struct* fs = parent->fs;
+
+    /* prepare directory entries with values already known */
+    for(uint8_t i = 0; i < count; ++i)
     {
-        if(!fat_read_dir(parent, dir_entry))
-            break;
+        if(!files[i] || !files[i][0])
+            return 0;
 
-        if(strcmp(file, dir_entry->long_name) == 0)
+        for(uint8_t j = 0; j < i; ++j)
         {
-            fat_reset_dir(parent);
-            return 0;
+            if(strcmp(files[i], files[j]) == 0)
+                return 0;
         }
+
+        memset(&dir_entries[i], 0, sizeof(dir_entries[i]));
+        strncpy(dir_entries[i].long_name, files[i], sizeof(dir_entries[i].long_name) - 1);
     }
 
-    struct fat_fs_struct* fs = parent->fs;
+    /* check for collisions and find places where to store the directory entries */
+    if(!fat_find_offsets_for_dir_entries(fs, parent, dir_entries, count))
+        return 0;
 
-    /* prepare directory entry with values already known */
-    memset(dir_entry, 0, sizeof(*dir_entry));
-    strncpy(dir_entry->long_name, file, sizeof(dir_entry->long_name) - 1);
+    /* write directory entries to disk */
+    for(uint8_t i = 0; i < count; ++i)
+    {
+        if(!fat_write_dir_entry(fs, &dir_entries[i]))
+            return 0;
+    }
 
-    /* find place where to store directory entry */
-    if(!(dir_entry->entry_offset = fat_find_offset_for_dir_entry(fs, parent, dir_entry)))
-        return 0;
-    
-    /* write directory entry to disk */
-    if(!fat_write_dir_entry(fs, dir_entry))
-        return 0;
-    
     return 1;
 }
 #endif
@@ -1975,6 +4882,8 @@ uint8_t fat_create_file(struct fat_dir_struct* parent, const char* file, struct
  * subdirectories and files, disk space occupied by these
  * files will get wasted as there is no chance to release
  * it and mark it as free.
+ *
+ * A file which is open cannot be deleted.
  * 
  * \param[in] fs The filesystem on which to operate.
  * \param[in] dir_entry The directory entry of the file to delete.
@@ -1986,9 +4895,37 @@ uint8_t fat_delete_file(struct fat_fs_struct* fs, struct fat_dir_entry_struct* d
     if(!fs || !dir_entry)
         return 0;
 
-    /* get offset of the file's directory entry */
-    offset_t dir_entry_offset = dir_entry->entry_offset;
-    if(!dir_entry_offset)
+    /* the handles of an open file would go on using the freed clusters */
+    if(fat_find_file_node(fs, dir_entry->entry_offset))
+        return 0;
+
+    /* mark the file's directory entry as deleted */
+    if(!fat_delete_dir_entry(fs, dir_entry->entry_offset))
+        return 0;
+
+    /* We deleted the directory entry. The next thing to do is
+     * marking all occupied clusters as free.
+     */
+    return (dir_entry->cluster == 0 || fat_free_clusters(fs, dir_entry->cluster));
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Marks a directory entry as deleted.
+ *
+ * All lfn entries belonging to the file and the final 8.3
+ * entry are marked as deleted. If the entries continue in the
+ * next cluster of the directory, the cluster chain is followed.
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in] dir_entry_offset The offset of the first lfn or 8.3 entry of the file.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t fat_delete_dir_entry(const struct fat_fs_struct* fs, offset_t dir_entry_offset)
+{
+    if(!fs || !dir_entry_offset)
         return 0;
 
     uint8_t buffer[12];
@@ -2010,12 +4947,311 @@ uint8_t fat_delete_file(struct fat_fs_struct* fs, struct fat_dir_entry_struct* d
             break;
 
         dir_entry_offset += 32;
+
+        /* continue in the next cluster when reaching the cluster border */
+        const struct fat_header_struct* header = &fs->header;
+        if(dir_entry_offset > header->cluster_zero_offset &&
+           (dir_entry_offset - header->cluster_zero_offset) % header->cluster_size == 0)
+        {
+            cluster_t cluster_num = (dir_entry_offset - header->cluster_zero_offset) / header->cluster_size + 1;
+            cluster_num = fat_get_next_cluster(fs, cluster_num);
+            if(!cluster_num)
+                return 0;
+
+            dir_entry_offset = fat_cluster_offset(fs, cluster_num);
+        }
     }
 
-    /* We deleted the directory entry. The next thing to do is
-     * marking all occupied clusters as free.
-     */
-    return (dir_entry->cluster == 0 || fat_free_clusters(fs, dir_entry->cluster));
+    return 1;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_dir
+ * Deletes a directory including all of its files and subdirectories.
+ *
+ * The directory tree is walked iteratively. Files are handled in
+ * batches of up to one sector of directory entries: first all of
+ * their directory entries are marked as deleted, then all of their
+ * cluster chains are freed. This way the directory sector and the
+ * FAT sectors are written in one go instead of alternately.
+ *
+ * Each file and directory is unlinked from its parent before its
+ * clusters are freed. If the operation is interrupted, the part of
+ * the tree which was not yet deleted is still consistent and the
+ * call may just be repeated.
+ *
+ * For directories nested deeper than #FAT_DELETE_TREE_DEPTH levels,
+ * the parent directories are found by their ".." entries and
+ * rescanned from their beginning.
+ *
+ * If \c discard is set and #FAT_DISCARD_SUPPORT is enabled, the
+ * device is told that the data within the freed clusters is no
+ * longer needed.
+ *
+ * \note If the directory entry describes a file, only this file
+ * is deleted.
+ *
+ * \note The deletion stops with a failure at the first file found
+ * which is open. The files deleted up to there stay deleted.
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[in] dir_entry The directory entry of the directory to delete.
+ * \param[in] discard Whether to discard the freed clusters on the device.
+ * \returns 0 on failure, 1 on success.
+ * \see fat_delete_dir, fat_delete_file
+ */
+uint8_t fat_delete_tree(struct fat_fs_struct* fs, struct fat_dir_entry_struct* dir_entry, uint8_t discard)
+{
+    if(!fs || !dir_entry || !dir_entry->entry_offset)
+        return 0;
+
+#if !FAT_DISCARD_SUPPORT
+    discard = 0;
+#endif
+
+    uint16_t cluster_size = fs->header.cluster_size;
+    uint16_t sector_size = fs->header.sector_size;
+    struct fat_delete_tree_level levels[FAT_DELETE_TREE_DEPTH];
+    struct fat_delete_tree_level* level = levels;
+    uint16_t depth = 0;
+    cluster_t cluster_finished = 0;
+    struct fat_delete_tree_callback_arg arg;
+    uint8_t buffer[32];
+
+    if(sector_size > sizeof(arg.file_cluster) / sizeof(arg.file_cluster[0]) * 32)
+        sector_size = sizeof(arg.file_cluster) / sizeof(arg.file_cluster[0]) * 32;
+
+    level->cluster_first = level->cluster = dir_entry->cluster;
+    level->cluster_offset = 0;
+    level->entry_offset = 0;
+
+    while((dir_entry->attributes & FAT_ATTRIB_DIR) && dir_entry->cluster)
+    {
+        if(level->cluster_offset >= cluster_size)
+        {
+            /* we reached the cluster border and switch to the next cluster */
+            cluster_t cluster_next = fat_get_next_cluster(fs, level->cluster);
+            if(cluster_next)
+            {
+                /* lfn entries may continue in the next cluster, so keep where they start */
+                level->cluster = cluster_next;
+                level->cluster_offset = 0;
+                continue;
+            }
+
+            memset(&arg, 0, sizeof(arg));
+            arg.finished = 1;
+        }
+        else
+        {
+            /* collect the entries up to the next sector border */
+            offset_t cluster_offset = fat_cluster_offset(fs, level->cluster);
+            memset(&arg, 0, sizeof(arg));
+            arg.entry_offset = level->entry_offset;
+#if FAT_FAT32_SUPPORT
+            arg.is_fat32 = (fs->partition->type == PARTITION_TYPE_FAT32);
+#endif
+            if(!fs->partition->device_read_interval(cluster_offset + level->cluster_offset,
+                                                    buffer,
+                                                    sizeof(buffer),
+                                                    sector_size - (level->cluster_offset & (sector_size - 1)),
+                                                    fat_delete_tree_callback,
+                                                    &arg
+                                                   )
+              )
+                return 0;
+
+            /* keep files which are open, and the tree around them */
+            for(uint8_t i = 0; i < arg.file_count; ++i)
+            {
+                if(fat_find_file_node(fs, arg.file_offset[i]))
+                    return 0;
+            }
+
+            /* first unlink all files found, then free their clusters */
+            for(uint8_t i = 0; i < arg.file_count; ++i)
+            {
+                if(!fat_delete_dir_entry(fs, arg.file_offset[i]))
+                    return 0;
+            }
+            for(uint8_t i = 0; i < arg.file_count; ++i)
+            {
+                /* empty files do not occupy any clusters */
+                if(!arg.file_cluster[i])
+                    continue;
+#if FAT_DISCARD_SUPPORT
+                if(discard)
+                    fat_discard_clusters(fs, arg.file_cluster[i]);
+#endif
+                if(!fat_free_clusters(fs, arg.file_cluster[i]))
+                    return 0;
+            }
+
+            if(arg.dir_found)
+            {
+                /* The 8.3 entry is read again when we return to this
+                 * level. Its lfn entries may start in the previous cluster.
+                 */
+                level->cluster_offset += arg.bytes_read - 32;
+                level->entry_offset = arg.dir_offset;
+
+                if(arg.dir_cluster == 0 || arg.dir_cluster == cluster_finished)
+                {
+                    /* the subdirectory is empty now, so drop it */
+                    if(!fat_delete_dir_entry(fs, arg.dir_offset))
+                        return 0;
+                    if(arg.dir_cluster)
+                    {
+#if FAT_DISCARD_SUPPORT
+                        if(discard)
+                            fat_discard_clusters(fs, arg.dir_cluster);
+#endif
+                        if(!fat_free_clusters(fs, arg.dir_cluster))
+                            return 0;
+                    }
+
+                    cluster_finished = 0;
+                    continue;
+                }
+
+                /* descend into the subdirectory */
+                if(depth < FAT_DELETE_TREE_DEPTH - 1)
+                    ++level;
+                ++depth;
+
+                level->cluster_first = level->cluster = arg.dir_cluster;
+                level->cluster_offset = 0;
+                level->entry_offset = 0;
+                continue;
+            }
+
+            if(arg.cluster_end)
+                /* the rest of the cluster is free */
+                level->cluster_offset = cluster_size;
+            else
+                level->cluster_offset += arg.bytes_read;
+            level->entry_offset = arg.entry_offset;
+        }
+
+        if(!arg.finished)
+            continue;
+
+        /* We reached the end of the directory. All of its
+         * files and subdirectories have been deleted.
+         */
+        if(depth == 0)
+            break;
+
+        cluster_finished = level->cluster_first;
+        if(--depth < FAT_DELETE_TREE_DEPTH - 1)
+        {
+            --level;
+        }
+        else
+        {
+            /* We did not keep track of the parent directory,
+             * so find it through the ".." entry and rescan it.
+             */
+            uint16_t cluster_parent[2] = { 0, 0 };
+            offset_t dotdot_offset = fat_cluster_offset(fs, cluster_finished) + 32;
+            if(!fs->partition->device_read(dotdot_offset + 26, (uint8_t*) &cluster_parent[0], sizeof(cluster_parent[0])))
+                return 0;
+#if FAT_FAT32_SUPPORT
+            if(fs->partition->type == PARTITION_TYPE_FAT32 &&
+               !fs->partition->device_read(dotdot_offset + 20, (uint8_t*) &cluster_parent[1], sizeof(cluster_parent[1])))
+                return 0;
+            level->cluster_first = ((cluster_t) ltoh16(cluster_parent[1]) << 16) | ltoh16(cluster_parent[0]);
+#else
+            level->cluster_first = ltoh16(cluster_parent[0]);
+#endif
+            if(level->cluster_first < 2)
+                return 0;
+
+            level->cluster = level->cluster_first;
+            level->cluster_offset = 0;
+            level->entry_offset = 0;
+        }
+    }
+
+    /* finally delete the directory itself */
+    if(!fat_delete_dir_entry(fs, dir_entry->entry_offset))
+        return 0;
+    if(dir_entry->cluster == 0)
+        return 1;
+
+#if FAT_DISCARD_SUPPORT
+    if(discard)
+        fat_discard_clusters(fs, dir_entry->cluster);
+#endif
+    return fat_free_clusters(fs, dir_entry->cluster);
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_fs
+ * Callback function for collecting the entries to delete with fat_delete_tree().
+ */
+uint8_t fat_delete_tree_callback(uint8_t* buffer, offset_t offset, void* p)
+{
+    struct fat_delete_tree_callback_arg* arg = p;
+
+    arg->bytes_read += 32;
+
+    /* an empty entry ends the directory entries of its cluster */
+    if(!buffer[0])
+    {
+        arg->entry_offset = 0;
+        arg->cluster_end = 1;
+        return 0;
+    }
+
+    /* skip deleted entries */
+    if(buffer[0] == FAT_DIRENTRY_DELETED)
+    {
+        arg->entry_offset = 0;
+        return 1;
+    }
+
+    /* remember where the lfn entries of the file start */
+    if(!arg->entry_offset)
+        arg->entry_offset = offset;
+    if(buffer[11] == 0x0f)
+        return 1;
+
+    offset_t entry_offset = arg->entry_offset;
+    arg->entry_offset = 0;
+
+    /* skip the volume label and the "." and ".." directory references */
+    if(buffer[11] & FAT_ATTRIB_VOLUME)
+        return 1;
+    if(buffer[0] == '.' &&
+       (buffer[1] == ' ' || (buffer[1] == '.' && buffer[2] == ' ')))
+        return 1;
+
+    cluster_t cluster = ltoh16(*((uint16_t*) &buffer[26]));
+#if FAT_FAT32_SUPPORT
+    if(arg->is_fat32)
+        cluster |= ((cluster_t) ltoh16(*((uint16_t*) &buffer[20]))) << 16;
+#endif
+
+    if(buffer[11] & FAT_ATTRIB_DIR)
+    {
+        arg->dir_found = 1;
+        arg->dir_cluster = cluster;
+        arg->dir_offset = entry_offset;
+        return 0;
+    }
+
+    /* empty files are collected too, as they may be open */
+    arg->file_cluster[arg->file_count] = cluster;
+    arg->file_offset[arg->file_count] = entry_offset;
+    if(++arg->file_count >= sizeof(arg->file_cluster) / sizeof(arg->file_cluster[0]))
+        return 0;
+
+    return 1;
 }
 #endif
 
@@ -2037,24 +5273,24 @@ uint8_t fat_delete_file(struct fat_fs_struct* fs, struct fat_dir_entry_struct* d
  * \param[out] dir_entry The directory entry to fill for the new directory.
  * \returns 0 on failure, 1 on success.
  * \see fat_delete_dir
- */
-uint8_t fat_create_dir(struct fat_dir_struct* parent, const char* dir, struct fat_dir_entry_struct* dir_entry)
-{
-    if(!parent || !dir || !dir[0] || !dir_entry)
-        return 0;
-
-    /* check if the file or directory already exists */
-    while(fat_read_dir(parent, dir_entry))
-    {
-        if(strcmp(dir, dir_entry->long_name) == 0)
-        {
-            fat_reset_dir(parent);
-            return 0;
-        }
-    }
+ */
+uint8_t fat_create_dir(struct fat_dir_struct* parent, const char* dir, struct fat_dir_entry_struct* dir_entry)
+{
+    if(!parent || !dir || !dir[0] || !dir_entry)
+        return 0;
 
     struct fat_fs_struct* fs = parent->fs;
 
+    /* check if the file or directory already exists and
+     * find place where to store directory entry
+     */
+    memset(dir_entry, 0, sizeof(*dir_entry));
+    strncpy(dir_entry->long_name, dir, sizeof(dir_entry->long_name) - 1);
+    if(!fat_find_offsets_for_dir_entries(fs, parent, dir_entry, 1))
+        return 0;
+
+    offset_t dir_entry_offset = dir_entry->entry_offset;
+
     /* allocate cluster which will hold directory entries */
     cluster_t dir_cluster = fat_append_clusters(fs, 0, 1);
     if(!dir_cluster)
@@ -2090,13 +5326,7 @@ uint8_t fat_create_dir(struct fat_dir_struct* parent, const char* dir, struct fa
     /* fill directory entry */
     strncpy(dir_entry->long_name, dir, sizeof(dir_entry->long_name) - 1);
     dir_entry->cluster = dir_cluster;
-
-    /* find place where to store directory entry */
-    if(!(dir_entry->entry_offset = fat_find_offset_for_dir_entry(fs, parent, dir_entry)))
-    {
-        fat_free_clusters(fs, dir_cluster);
-        return 0;
-    }
+    dir_entry->entry_offset = dir_entry_offset;
 
     /* write directory to disk */
     if(!fat_write_dir_entry(fs, dir_entry))
@@ -2117,7 +5347,8 @@ uint8_t fat_create_dir(struct fat_dir_struct* parent, const char* dir, struct fa
  * If a directory is deleted without first deleting its
  * subdirectories and files, disk space occupied by these
  * files will get wasted as there is no chance to release
- * it and mark it as free.
+ * it and mark it as free. Use fat_delete_tree() to delete
+ * a directory together with its content.
  * 
  * \param[in] fs The filesystem on which to operate.
  * \param[in] dir_entry The directory entry of the directory to delete.
@@ -2325,3 +5556,558 @@ uint8_t fat_get_fs_free_32_callback(uint8_t* buffer, offset_t offset, void* p)
 }
 #endif
 
+
+/**
+ * \ingroup fat_job
+ * Allocates a job handle.
+ *
+ * \param[in] fs The filesystem on which the job operates.
+ * \param[in] type The kind of the job.
+ * \returns The job handle, or 0 if all handles are in use.
+ */
+struct fat_job_struct* fat_job_alloc(struct fat_fs_struct* fs, uint8_t type)
+{
+#if USE_DYNAMIC_MEMORY
+    struct fat_job_struct* job = malloc(sizeof(*job));
+    if(!job)
+        return 0;
+#else
+    struct fat_job_struct* job = fat_job_handles;
+    uint8_t i;
+    for(i = 0; i < FAT_JOB_COUNT; ++i)
+    {
+        if(!job->fs)
+            break;
+
+        ++job;
+    }
+    if(i >= FAT_JOB_COUNT)
+        return 0;
+#endif
+
+    memset(job, 0, sizeof(*job));
+    job->fs = fs;
+    job->type = type;
+
+    return job;
+}
+
+/**
+ * \ingroup fat_job
+ * Starts counting the free storage capacity of a filesystem.
+ *
+ * Each step counts the free clusters of one sector of the FAT.
+ *
+ * \param[in] fs The filesystem on which to operate.
+ * \param[out] free Receives the free filesystem space in bytes when the job is done.
+ * \returns The job handle, or 0 on failure.
+ * \see fat_get_fs_free, fat_job_step
+ */
+struct fat_job_struct* fat_job_get_fs_free(struct fat_fs_struct* fs, offset_t* free)
+{
+    if(!fs || !free)
+        return 0;
+
+    struct fat_job_struct* job = fat_job_alloc(fs, FAT_JOB_TYPE_FS_FREE);
+    if(!job)
+        return 0;
+
+    job->free = free;
+    job->offset = fs->header.fat_offset;
+    job->offset_to = fs->header.fat_offset + fs->header.fat_size;
+
+    return job;
+}
+
+/**
+ * \ingroup fat_job
+ * Counts the free clusters of one FAT sector.
+ *
+ * \param[in] job The job to advance.
+ * \returns One of the FAT_JOB_* codes.
+ */
+uint8_t fat_job_fs_free_step(struct fat_job_struct* job)
+{
+    struct fat_fs_struct* fs = job->fs;
+
+    if(job->offset >= job->offset_to)
+    {
+        *job->free = (offset_t) job->cluster_count * fs->header.cluster_size;
+        return FAT_JOB_DONE;
+    }
+
+    uint8_t fat[32];
+    struct fat_usage_count_callback_arg count_arg;
+    count_arg.cluster_count = job->cluster_count;
+    count_arg.buffer_size = sizeof(fat);
+
+    uintptr_t length = fs->header.sector_size - (job->offset - fs->header.fat_offset) % fs->header.sector_size;
+    if(length > job->offset_to - job->offset)
+        length = job->offset_to - job->offset;
+
+    if(!fs->partition->device_read_interval(job->offset,
+                                            fat,
+                                            sizeof(fat),
+                                            length,
+#if FAT_FAT32_SUPPORT
+                                            (fs->partition->type == PARTITION_TYPE_FAT16) ?
+                                                fat_get_fs_free_16_callback :
+                                                fat_get_fs_free_32_callback,
+#else
+                                            fat_get_fs_free_16_callback,
+#endif
+                                            &count_arg
+                                           )
+      )
+        return FAT_JOB_FAILED;
+
+    job->cluster_count = count_arg.cluster_count;
+    job->offset += length;
+
+    return FAT_JOB_BUSY;
+}
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_job
+ * Starts writing data to a file.
+ *
+ * Each step writes the data up to the end of the current sector. Before
+ * a cluster gets appended to the file, the steps search the FAT for a
+ * free cluster, one FAT sector per step. No step syncs the filesystem,
+ * regardless of the autosync policy.
+ *
+ * The file has to stay open until the job has finished. If the job
+ * fails, the position of the file tells how much data has been written.
+ *
+ * \note The first step may have to follow the cluster chain of the
+ *       file up to its position. This is avoided by writing to a file
+ *       which has been written or seeked to with fat_write_file() or
+ *       fat_seek_file() before.
+ *
+ * \param[in] fd The file handle of the file to write to.
+ * \param[in] buffer The buffer from which to write. It has to stay valid until the job has finished.
+ * \param[in] buffer_len The amount of data to write.
+ * \returns The job handle, or 0 on failure.
+ * \see fat_write_file, fat_job_step
+ */
+struct fat_job_struct* fat_job_write(struct fat_file_struct* fd, const uint8_t* buffer, uintptr_t buffer_len)
+{
+    if(!fd || !buffer)
+        return 0;
+
+    struct fat_job_struct* job = fat_job_alloc(fd->fs, FAT_JOB_TYPE_WRITE);
+    if(!job)
+        return 0;
+
+    job->fd = fd;
+    job->buffer = buffer;
+    job->buffer_len = buffer_len;
+
+    return job;
+}
+
+/**
+ * \ingroup fat_job
+ * Writes the data of a write job up to the end of the current sector.
+ *
+ * \param[in] job The job to advance.
+ * \returns One of the FAT_JOB_* codes.
+ */
+uint8_t fat_job_write_step(struct fat_job_struct* job)
+{
+    struct fat_file_struct* fd = job->fd;
+    struct fat_fs_struct* fs = job->fs;
+
+    if(!job->buffer_len)
+        return FAT_JOB_DONE;
+
+    uint32_t file_size = fd->node->dir_entry.file_size;
+    uint32_t pos = (fd->options & FAT_FILE_APPEND) ? file_size : fd->pos;
+
+    /* a new cluster gets appended, so make sure a free one is known */
+    if(pos % fs->header.cluster_size == 0 && pos >= file_size)
+    {
+        switch(fat_job_find_free_cluster(job))
+        {
+            case 0:
+                return FAT_JOB_FAILED;
+            case 2:
+                return FAT_JOB_BUSY;
+        }
+    }
+
+    uintptr_t length = fs->header.sector_size - pos % fs->header.sector_size;
+    if(length > job->buffer_len)
+        length = job->buffer_len;
+
+    intptr_t written = fat_write_file(fd, job->buffer, length);
+    if(written <= 0)
+        return FAT_JOB_FAILED;
+
+    job->buffer += written;
+    job->buffer_len -= written;
+    job->cluster_count = 0;
+
+    return job->buffer_len ? FAT_JOB_BUSY : FAT_JOB_DONE;
+}
+
+/**
+ * \ingroup fat_job
+ * Searches one FAT sector for a free cluster.
+ *
+ * The search starts at the cluster where fat_append_clusters() starts
+ * its search and moves that position to the free cluster found.
+ *
+ * \param[in] job The job on whose behalf to search.
+ * \returns 0 on failure or if the filesystem is full, 1 if a free cluster has been found, 2 if the search has to continue.
+ */
+uint8_t fat_job_find_free_cluster(struct fat_job_struct* job)
+{
+    struct fat_fs_struct* fs = job->fs;
+#if FAT_FAT32_SUPPORT
+    uint8_t entry_size = (fs->partition->type == PARTITION_TYPE_FAT32 ? 4 : 2);
+#else
+    uint8_t entry_size = 2;
+#endif
+    cluster_t cluster_max = fs->header.fat_size / entry_size;
+    cluster_t cluster = fs->cluster_free;
+    if(cluster < 2 || cluster >= cluster_max)
+        cluster = 2;
+
+    uint16_t sector_size = fs->header.sector_size;
+    uint32_t offset = (uint32_t) cluster * entry_size;
+    uint32_t offset_end = offset - offset % sector_size + sector_size;
+    if(offset_end > (uint32_t) cluster_max * entry_size)
+        offset_end = (uint32_t) cluster_max * entry_size;
+
+    uint8_t buffer[32];
+    while(offset < offset_end)
+    {
+        uint8_t length = sizeof(buffer);
+        if(length > offset_end - offset)
+            length = offset_end - offset;
+
+        if(!fs->partition->device_read(fs->header.fat_offset + offset, buffer, length))
+            return 0;
+
+        for(uint8_t i = 0; i < length; i += entry_size, ++cluster)
+        {
+            uint8_t j;
+            for(j = 0; j < entry_size && !buffer[i + j]; ++j);
+            if(j == entry_size)
+            {
+                fs->cluster_free = cluster;
+                return 1;
+            }
+        }
+
+        job->cluster_count += length / entry_size;
+        offset += length;
+    }
+
+    /* give up once the whole FAT has been searched */
+    if(job->cluster_count >= cluster_max)
+        return 0;
+
+    fs->cluster_free = cluster;
+    return 2;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_job
+ * Starts writing all pending changes of a filesystem to disk.
+ *
+ * Does the same as fat_sync(), in this order: Each step writes the
+ * buffered data of one file, copies one sector of FAT changes or
+ * writes the size of one file. The device is synced between these
+ * phases.
+ *
+ * \param[in] fs The filesystem to sync.
+ * \returns The job handle, or 0 on failure.
+ * \see fat_sync, fat_job_step
+ */
+struct fat_job_struct* fat_job_sync(struct fat_fs_struct* fs)
+{
+    if(!fs)
+        return 0;
+
+    return fat_job_alloc(fs, FAT_JOB_TYPE_SYNC);
+}
+
+/**
+ * \ingroup fat_job
+ * Does the next step of a sync job.
+ *
+ * \param[in] job The job to advance.
+ * \returns One of the FAT_JOB_* codes.
+ */
+uint8_t fat_job_sync_step(struct fat_job_struct* job)
+{
+    struct fat_fs_struct* fs = job->fs;
+
+    switch(job->state)
+    {
+        case FAT_JOB_SYNC_FLUSH:
+        {
+#if FAT_FILE_BUFFERING
+            /* the index counts the files done */
+            struct fat_file_node* node = fs->file_nodes;
+            for(uint8_t i = 0; node && i < job->index; ++i)
+                node = node->next;
+            if(node)
+            {
+                ++job->index;
+                return fat_flush_node_buffer(fs, node) ? FAT_JOB_BUSY : FAT_JOB_FAILED;
+            }
+#endif
+            job->state = FAT_JOB_SYNC_FAT;
+            return fat_sync_device() ? FAT_JOB_BUSY : FAT_JOB_FAILED;
+        }
+        case FAT_JOB_SYNC_FAT:
+        {
+            switch(fat_sync_fat(fs, 1))
+            {
+                case 0:
+                    return FAT_JOB_FAILED;
+                case 1:
+                    job->state = FAT_JOB_SYNC_SIZES;
+                    job->index = 0;
+                    return fat_sync_device() ? FAT_JOB_BUSY : FAT_JOB_FAILED;
+            }
+            return FAT_JOB_BUSY;
+        }
+        case FAT_JOB_SYNC_SIZES:
+        {
+            /* the index counts the files done */
+            struct fat_file_node* node = fs->file_nodes;
+            for(uint8_t i = 0; node && i < job->index; ++i)
+                node = node->next;
+            if(node)
+            {
+                ++job->index;
+                return fat_write_node_size(fs, node) ? FAT_JOB_BUSY : FAT_JOB_FAILED;
+            }
+            if(!fat_sync_device())
+                return FAT_JOB_FAILED;
+
+#if FAT_AUTOSYNC_BYTES || FAT_AUTOSYNC_MS
+            fs->dirty = 0;
+            fs->dirty_bytes = 0;
+#endif
+            return FAT_JOB_DONE;
+        }
+    }
+
+    return FAT_JOB_FAILED;
+}
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+/**
+ * \ingroup fat_job
+ * Starts creating a file.
+ *
+ * Each step reads one sector of the parent directory, checking the
+ * names and searching for free directory entries like
+ * fat_create_file(). Then one step places the new entry and a last one
+ * writes it. The directory must not be changed otherwise until the job
+ * has finished.
+ *
+ * If the file already exists, the job fails and \c dir_entry receives
+ * the directory entry of the existing file.
+ *
+ * \note If the directory has to grow, the step placing the entry clears
+ *       a whole cluster. Reserve entries with fat_reserve_dir() in
+ *       advance to avoid this.
+ *
+ * \param[in] parent The handle of the directory in which to create the file.
+ * \param[in] file The name of the file to create.
+ * \param[out] dir_entry The directory entry to fill for the new file. It has to stay valid until the job has finished.
+ * \returns The job handle, or 0 on failure.
+ * \see fat_create_file, fat_job_step
+ */
+struct fat_job_struct* fat_job_create_file(struct fat_dir_struct* parent, const char* file, struct fat_dir_entry_struct* dir_entry)
+{
+    if(!parent || !file || !file[0] || !dir_entry)
+        return 0;
+
+    struct fat_fs_struct* fs = parent->fs;
+    struct fat_job_struct* job = fat_job_alloc(fs, FAT_JOB_TYPE_CREATE_FILE);
+    if(!job)
+        return 0;
+
+    memset(dir_entry, 0, sizeof(*dir_entry));
+    strncpy(dir_entry->long_name, file, sizeof(dir_entry->long_name) - 1);
+
+    job->find_arg.dir_entries = dir_entry;
+    job->find_arg.count = 1;
+
+    job->cluster_num = parent->dir_entry.cluster;
+#if FAT_FAT32_SUPPORT
+    if(job->cluster_num == 0 && fs->partition->type == PARTITION_TYPE_FAT32)
+        job->cluster_num = fs->header.root_dir_cluster;
+#endif
+    if(job->cluster_num == 0)
+    {
+        /* we read from the fixed root directory */
+        job->offset = fs->header.root_dir_offset;
+        job->offset_to = fs->header.cluster_zero_offset;
+    }
+    else
+    {
+        job->offset = fat_cluster_offset(fs, job->cluster_num);
+        job->offset_to = job->offset + fs->header.cluster_size;
+    }
+
+    return job;
+}
+
+/**
+ * \ingroup fat_job
+ * Does the next step of a create job.
+ *
+ * \param[in] job The job to advance.
+ * \returns One of the FAT_JOB_* codes.
+ */
+uint8_t fat_job_create_file_step(struct fat_job_struct* job)
+{
+    struct fat_fs_struct* fs = job->fs;
+    struct fat_find_offsets_callback_arg* arg = &job->find_arg;
+
+    switch(job->state)
+    {
+        case FAT_JOB_CREATE_SCAN:
+        {
+            uint8_t buffer[32];
+            uintptr_t length = fs->header.sector_size - job->offset % fs->header.sector_size;
+            if(length > job->offset_to - job->offset)
+                length = job->offset_to - job->offset;
+
+            if(!fs->partition->device_read_interval(job->offset,
+                                                    buffer,
+                                                    sizeof(buffer),
+                                                    length,
+                                                    fat_find_offsets_callback,
+                                                    arg)
+              )
+                return FAT_JOB_FAILED;
+
+            if(arg->collision)
+                return FAT_JOB_FAILED;
+
+            job->offset += length;
+            if(job->offset < job->offset_to)
+                return FAT_JOB_BUSY;
+
+            cluster_t cluster_next = 0;
+            if(job->cluster_num != 0)
+                cluster_next = fat_get_next_cluster(fs, job->cluster_num);
+            if(!cluster_next)
+            {
+                /* the free entries left over reach up to the end of the directory */
+                if(arg->free_entries)
+                    job->offset = arg->free_offset;
+                job->state = FAT_JOB_CREATE_PLACE;
+                return FAT_JOB_BUSY;
+            }
+
+            /* directory entries must not span a cluster border */
+            job->cluster_num = cluster_next;
+            job->offset = fat_cluster_offset(fs, cluster_next);
+            job->offset_to = job->offset + fs->header.cluster_size;
+            arg->free_entries = 0;
+            memset(&arg->dir_entry, 0, sizeof(arg->dir_entry));
+
+            return FAT_JOB_BUSY;
+        }
+        case FAT_JOB_CREATE_PLACE:
+        {
+            if(!fat_place_dir_entries(fs, arg, job->cluster_num, job->offset, job->offset_to))
+                return FAT_JOB_FAILED;
+
+            job->state = FAT_JOB_CREATE_WRITE;
+            return FAT_JOB_BUSY;
+        }
+        case FAT_JOB_CREATE_WRITE:
+        {
+            return fat_write_dir_entry(fs, arg->dir_entries) ? FAT_JOB_DONE : FAT_JOB_FAILED;
+        }
+    }
+
+    return FAT_JOB_FAILED;
+}
+#endif
+
+/**
+ * \ingroup fat_job
+ * Does the next step of a job.
+ *
+ * Each step does a bounded amount of device I/O, so the caller may
+ * do other work between the steps. When the step finishes the job or
+ * the job fails, the job handle is released and becomes invalid.
+ *
+ * \param[in] job The job to advance.
+ * \returns FAT_JOB_BUSY if more steps are needed, FAT_JOB_DONE if the job has finished, FAT_JOB_FAILED on failure.
+ * \see fat_job_cancel
+ */
+uint8_t fat_job_step(struct fat_job_struct* job)
+{
+    if(!job)
+        return FAT_JOB_FAILED;
+
+#if FAT_WRITE_SUPPORT && (FAT_AUTOSYNC_BYTES || FAT_AUTOSYNC_MS)
+    job->fs->in_job = 1;
+#endif
+
+    uint8_t result = FAT_JOB_FAILED;
+    switch(job->type)
+    {
+        case FAT_JOB_TYPE_FS_FREE:
+            result = fat_job_fs_free_step(job);
+            break;
+#if FAT_WRITE_SUPPORT
+        case FAT_JOB_TYPE_WRITE:
+            result = fat_job_write_step(job);
+            break;
+        case FAT_JOB_TYPE_SYNC:
+            result = fat_job_sync_step(job);
+            break;
+        case FAT_JOB_TYPE_CREATE_FILE:
+            result = fat_job_create_file_step(job);
+            break;
+#endif
+    }
+
+#if FAT_WRITE_SUPPORT && (FAT_AUTOSYNC_BYTES || FAT_AUTOSYNC_MS)
+    job->fs->in_job = 0;
+#endif
+
+    if(result != FAT_JOB_BUSY)
+        fat_job_cancel(job);
+
+    return result;
+}
+
+/**
+ * \ingroup fat_job
+ * Releases a job before it has finished.
+ *
+ * The steps done so far are not undone. Changes made by them become
+ * persistent with the next sync, as if the job had been a sequence
+ * of smaller operations.
+ *
+ * \param[in] job The job to release.
+ * \see fat_job_step
+ */
+void fat_job_cancel(struct fat_job_struct* job)
+{
+    if(job)
+#if USE_DYNAMIC_MEMORY
+        free(job);
+#else
+        job->fs = 0;
+#endif
+}
@@ -56,6 +56,36 @@ extern "C"
 /** The given offset is relative to the end of the file. */
 #define FAT_SEEK_END 2
 
+/** Defer writing the file size to the directory entry. */
+#define FAT_FILE_DEFER_SIZE (1 << 0)
+/** Append each write to the end of the file. */
+#define FAT_FILE_APPEND (1 << 1)
+
+/** No advice on how the file is accessed. */
+#define FAT_FADV_NORMAL 0
+/** The file is accessed sequentially. */
+#define FAT_FADV_SEQUENTIAL 1
+/** The file's data is accessed only once. */
+#define FAT_FADV_NOREUSE 2
+/** The file's data at the current position is needed soon. */
+#define FAT_FADV_WILLNEED 3
+
+/**
+ * @}
+ */
+
+/**
+ * \addtogroup fat_job
+ * @{
+ */
+
+/** The job has failed. */
+#define FAT_JOB_FAILED 0
+/** The job has finished. */
+#define FAT_JOB_DONE 1
+/** The job needs more steps. */
+#define FAT_JOB_BUSY 2
+
 /**
  * @}
  */
@@ -64,6 +94,7 @@ struct partition_struct;
 struct fat_fs_struct;
 struct fat_file_struct;
 struct fat_dir_struct;
+struct fat_job_struct;
 
 /**
  * \ingroup fat_file
@@ -85,29 +116,98 @@ struct fat_dir_entry_struct
     cluster_t cluster;
     /** The file's size. */
     uint32_t file_size;
+    /** Whether the file's cluster chain may reach beyond its size, see fat_recover(). */
+    uint8_t size_deferred;
     /** The total disk offset of this directory entry. */
     offset_t entry_offset;
 };
 
+/**
+ * \ingroup fat_file
+ * Describes a buffer for reading or writing with fat_readv() and fat_writev().
+ */
+struct fat_iovec
+{
+    /** The start of the buffer. */
+    uint8_t* buffer;
+    /** The length of the buffer. */
+    uintptr_t buffer_len;
+};
+
+/**
+ * \ingroup fat_file
+ * Describes a contiguous area of a file's data on the device.
+ */
+struct fat_extent
+{
+    /** The device offset at which the area starts. */
+    offset_t offset;
+    /** The length of the area in bytes. */
+    uint32_t length;
+};
+
+/**
+ * \ingroup fat_file
+ * A function pointer passed to fat_read_file_to().
+ *
+ * \param[in] buffer The data read, within the device's block cache.
+ * \param[in] length The number of bytes in \c buffer.
+ * \param[in] p An opaque pointer.
+ * \returns 0 to stop reading, 1 to continue.
+ */
+typedef uint8_t (*fat_read_callback_t)(const uint8_t* buffer, uint16_t length, void* p);
+
+/**
+ * \ingroup fat_file
+ * A function pointer passed to fat_write_file_from().
+ *
+ * \param[in] buffer The space within the device's block cache which receives the data to write.
+ * \param[in] length The maximum number of bytes to put into \c buffer.
+ * \param[in] p An opaque pointer.
+ * \returns The number of bytes put into \c buffer, or 0 to stop writing.
+ */
+typedef uint16_t (*fat_write_callback_t)(uint8_t* buffer, uint16_t length, void* p);
+
 struct fat_fs_struct* fat_open(struct partition_struct* partition);
 void fat_close(struct fat_fs_struct* fs);
+uint8_t fat_sync(struct fat_fs_struct* fs);
+uint8_t fat_tick(struct fat_fs_struct* fs);
+uint8_t fat_recover(struct fat_fs_struct* fs);
 
 struct fat_file_struct* fat_open_file(struct fat_fs_struct* fs, const struct fat_dir_entry_struct* dir_entry);
 void fat_close_file(struct fat_file_struct* fd);
 intptr_t fat_read_file(struct fat_file_struct* fd, uint8_t* buffer, uintptr_t buffer_len);
 intptr_t fat_write_file(struct fat_file_struct* fd, const uint8_t* buffer, uintptr_t buffer_len);
+intptr_t fat_readv(struct fat_file_struct* fd, const struct fat_iovec* iov, uint8_t iovcnt);
+intptr_t fat_writev(struct fat_file_struct* fd, const struct fat_iovec* iov, uint8_t iovcnt);
+int32_t fat_read_file_to(struct fat_file_struct* fd, uint32_t length, fat_read_callback_t callback, void* p);
+int32_t fat_write_file_from(struct fat_file_struct* fd, fat_write_callback_t callback, void* p, uint32_t* consumed);
 uint8_t fat_seek_file(struct fat_file_struct* fd, int32_t* offset, uint8_t whence);
 uint8_t fat_resize_file(struct fat_file_struct* fd, uint32_t size);
+uint8_t fat_allocate_file(struct fat_file_struct* fd, uint32_t size);
+uint8_t fat_get_extents(struct fat_file_struct* fd, struct fat_extent* extents, uint8_t* count);
+uint8_t fat_set_file_options(struct fat_file_struct* fd, uint8_t options);
+uint8_t fat_sync_file(struct fat_file_struct* fd);
+uint8_t fat_fadvise(struct fat_file_struct* fd, uint8_t advice);
+uint8_t fat_map(struct fat_file_struct* fd, uint32_t offset, const uint8_t** buffer, uint16_t* length);
+uint8_t fat_map_writable(struct fat_file_struct* fd, uint32_t offset, uint8_t** buffer, uint16_t* length);
+uint8_t fat_unmap(struct fat_file_struct* fd);
+uint8_t fat_map_append(struct fat_file_struct* fd, uint8_t** buffer, uint16_t* length);
+uint8_t fat_unmap_append(struct fat_file_struct* fd, uint16_t length);
 
 struct fat_dir_struct* fat_open_dir(struct fat_fs_struct* fs, const struct fat_dir_entry_struct* dir_entry);
 void fat_close_dir(struct fat_dir_struct* dd);
 uint8_t fat_read_dir(struct fat_dir_struct* dd, struct fat_dir_entry_struct* dir_entry);
 uint8_t fat_reset_dir(struct fat_dir_struct* dd);
+uint8_t fat_reserve_dir(struct fat_dir_struct* dd, uint16_t entry_count);
 
 uint8_t fat_create_file(struct fat_dir_struct* parent, const char* file, struct fat_dir_entry_struct* dir_entry);
+uint8_t fat_create_files(struct fat_dir_struct* parent, const char* const* files, uint8_t count, struct fat_dir_entry_struct* dir_entries);
 uint8_t fat_delete_file(struct fat_fs_struct* fs, struct fat_dir_entry_struct* dir_entry);
+uint8_t fat_copy_file(struct fat_file_struct* src, struct fat_dir_struct* dst_dir, const char* name, struct fat_dir_entry_struct* dir_entry);
 uint8_t fat_create_dir(struct fat_dir_struct* parent, const char* dir, struct fat_dir_entry_struct* dir_entry);
 #define fat_delete_dir fat_delete_file
+uint8_t fat_delete_tree(struct fat_fs_struct* fs, struct fat_dir_entry_struct* dir_entry, uint8_t discard);
 
 void fat_get_file_modification_date(const struct fat_dir_entry_struct* dir_entry, uint16_t* year, uint8_t* month, uint8_t* day);
 void fat_get_file_modification_time(const struct fat_dir_entry_struct* dir_entry, uint8_t* hour, uint8_t* min, uint8_t* sec);
@@ -117,6 +217,13 @@ uint8_t fat_get_dir_entry_of_path(struct fat_fs_struct* fs, const char* path, st
 offset_t fat_get_fs_size(const struct fat_fs_struct* fs);
 offset_t fat_get_fs_free(const struct fat_fs_struct* fs);
 
+struct fat_job_struct* fat_job_write(struct fat_file_struct* fd, const uint8_t* buffer, uintptr_t buffer_len);
+struct fat_job_struct* fat_job_create_file(struct fat_dir_struct* parent, const char* file, struct fat_dir_entry_struct* dir_entry);
+struct fat_job_struct* fat_job_sync(struct fat_fs_struct* fs);
+struct fat_job_struct* fat_job_get_fs_free(struct fat_fs_struct* fs, offset_t* free);
+uint8_t fat_job_step(struct fat_job_struct* job);
+void fat_job_cancel(struct fat_job_struct* job);
+
 /**
  * @}
  */
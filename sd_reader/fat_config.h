@@ -74,6 +74,196 @@ extern "C"
 /* forward declaration for the above */
 void get_datetime(uint16_t* year, uint8_t* month, uint8_t* day, uint8_t* hour, uint8_t* min, uint8_t* sec);
 
+/**
+ * \ingroup fat_config
+ * Controls discarding of freed clusters.
+ *
+ * Set to 1 to allow telling the storage device about clusters which
+ * were freed, e.g. when deleting a directory tree with fat_delete_tree().
+ *
+ * \note Used only when FAT_WRITE_SUPPORT is 1.
+ */
+#define FAT_DISCARD_SUPPORT 1
+
+/**
+ * \ingroup fat_config
+ * Determines the function used for discarding a range of the device.
+ *
+ * Define this to the function call which shall be used to tell the
+ * device that a range of data is no longer in use.
+ *
+ * \note Used only when FAT_DISCARD_SUPPORT is 1.
+ *
+ * \param[in] offset The device offset where the range starts.
+ * \param[in] length The length of the range in bytes.
+ */
+#define fat_discard(offset, length) \
+    sd_raw_erase(offset, length)
+/* forward declaration for the above */
+uint8_t sd_raw_erase(offset_t offset, offset_t length);
+
+/**
+ * \ingroup fat_config
+ * Determines the function used for letting file data bypass the block cache.
+ *
+ * Define this to the function call which shall be used to tell the
+ * device which of the following accesses may bypass its block cache.
+ * Mode 0 uses the cache for all accesses, mode 1 bypasses it for
+ * accesses of whole blocks, and mode 2 additionally for partial reads.
+ * Define this to nothing if the device has no such cache.
+ *
+ * \param[in] mode The bypass mode.
+ * \see fat_fadvise
+ */
+#define fat_set_cache_bypass(mode) \
+    sd_raw_set_bypass(mode)
+/* forward declaration for the above */
+void sd_raw_set_bypass(uint8_t mode);
+
+/**
+ * \ingroup fat_config
+ * Determines the function used for writing cached data to the device.
+ *
+ * Define this to the function call which shall be used to write any
+ * data the device still caches to the medium. fat_sync() and
+ * fat_sync_file() use it to order the writes of data, FAT entries and
+ * directory entries. Define this to 1 if the device has no write cache.
+ *
+ * \note Used only when FAT_WRITE_SUPPORT is 1.
+ */
+#define fat_sync_device() \
+    sd_raw_sync()
+/* forward declaration for the above */
+uint8_t sd_raw_sync(void);
+
+/**
+ * \ingroup fat_config
+ * Determines the function used for mapping device data into memory.
+ *
+ * Define this to the function call which shall return a pointer to
+ * the device data at the given offset and store the number of bytes
+ * accessible through it, or return 0 if the data cannot be mapped. The
+ * data has to stay in place until fat_unmap_device() is called. A host
+ * build working on a memory-mapped image may return a pointer into the
+ * image. Define this to 0 if the device has no cache.
+ *
+ * \param[in] offset The device offset of the data to map.
+ * \param[out] length Receives the number of bytes accessible, as a uint16_t.
+ * \param[in] discard Set if the data is going to be overwritten, so it need not be read.
+ * \see fat_map, fat_map_append
+ */
+#define fat_map_device(offset, length, discard) \
+    sd_raw_map(offset, length, discard)
+/* forward declaration for the above */
+uint8_t* sd_raw_map(offset_t offset, uint16_t* length, uint8_t discard);
+
+/**
+ * \ingroup fat_config
+ * Determines the function used for releasing data mapped with fat_map_device().
+ *
+ * \param[in] dirty Whether the mapped data has been changed and has to be written.
+ * \see fat_unmap
+ */
+#define fat_unmap_device(dirty) \
+    sd_raw_unmap(dirty)
+/* forward declaration for the above */
+uint8_t sd_raw_unmap(uint8_t dirty);
+
+/**
+ * \ingroup fat_config
+ * Controls the per-file buffer.
+ *
+ * Set to 1 to give each open file a buffer of one sector, which is
+ * shared by all handles of the file. Reads and writes of less than a
+ * sector are then served from and gathered in memory. This costs 512
+ * bytes of RAM per file handle.
+ */
+#define FAT_FILE_BUFFERING 0
+
+/**
+ * \ingroup fat_config
+ * Number of clusters after which a deferred file size gets written.
+ *
+ * With FAT_FILE_DEFER_SIZE, the directory entry of a file is updated
+ * whenever its size grew by this number of clusters. Set to 0 to
+ * disable this limit.
+ */
+#define FAT_DEFER_SIZE_CLUSTERS 8
+
+/**
+ * \ingroup fat_config
+ * Number of milliseconds after which a deferred file size gets written.
+ *
+ * With FAT_FILE_DEFER_SIZE, the directory entry of a file is updated
+ * by the first write enlarging the file after this time has passed
+ * since the last update. Set to 0 to disable this limit.
+ */
+#define FAT_DEFER_SIZE_MS 1000
+
+/**
+ * \ingroup fat_config
+ * Number of bytes of file data after which fat_tick() syncs the filesystem.
+ *
+ * Bounds the amount of data which may be lost on a power failure. Set
+ * to 0 to disable this limit.
+ */
+#define FAT_AUTOSYNC_BYTES 0
+
+/**
+ * \ingroup fat_config
+ * Number of milliseconds after which fat_tick() syncs the filesystem.
+ *
+ * Bounds the age of changes which may be lost on a power failure. Set
+ * to 0 to disable this limit.
+ */
+#define FAT_AUTOSYNC_MS 1000
+
+/**
+ * \ingroup fat_config
+ * Determines the function used for retrieving the time in milliseconds.
+ *
+ * Define this to the function call which shall be used to retrieve
+ * a free running millisecond counter.
+ *
+ * \note Used only when FAT_DEFER_SIZE_MS or FAT_AUTOSYNC_MS is not 0.
+ */
+#define fat_get_millis() \
+    get_millis()
+/* forward declaration for the above */
+uint32_t get_millis(void);
+
+/**
+ * \ingroup fat_config
+ * Tells whether fat_get_millis() is used.
+ *
+ * The application has to provide the millisecond counter if this is set.
+ */
+#define FAT_USE_MILLIS (FAT_DEFER_SIZE_MS || FAT_AUTOSYNC_MS)
+
+/**
+ * \ingroup fat_config
+ * Maximum directory depth of which fat_delete_tree() and fat_recover()
+ * keep track.
+ *
+ * Deeper directory trees are still deleted, but the traversal has to
+ * rescan parent directories which are nested deeper than this limit.
+ * fat_recover() fails on them instead, so the volume stays marked as
+ * not unmounted cleanly. Each level takes up to 16 bytes of stack.
+ * Must be at least 2.
+ */
+#define FAT_DELETE_TREE_DEPTH 8
+
+/**
+ * \ingroup fat_config
+ * Size of the stack buffer through which data is copied on the device.
+ *
+ * fat_copy_file() and the copying of the first FAT to the other FATs
+ * copy the data through the block cache mapped with fat_map_device().
+ * This buffer is only used if the device cannot map its data. It sits
+ * on the stack of fat_tick(), so keep it small.
+ */
+#define FAT_COPY_BUFFER_SIZE 32
+
 /**
  * \ingroup fat_config
  * Maximum number of filesystem handles.
@@ -83,6 +273,14 @@ void get_datetime(uint16_t* year, uint8_t* month, uint8_t* day, uint8_t* hour, u
 /**
  * \ingroup fat_config
  * Maximum number of file handles.
+ *
+ * Handles of the same file share one node holding the file's state,
+ * so a file may be opened more than once. With FAT32 support, each
+ * handle costs about 80 bytes of RAM including its node, and 512 bytes
+ * more with FAT_FILE_BUFFERING. The application in main.c opens one
+ * file at a time. A circular or record log keeps two handles open, so
+ * raise this by two for each log enabled with CIRC_LOG_COUNT or
+ * REC_LOG_COUNT. Building a log with too few handles fails.
  */
 #define FAT_FILE_COUNT 1
 
@@ -92,6 +290,14 @@ void get_datetime(uint16_t* year, uint8_t* month, uint8_t* day, uint8_t* hour, u
  */
 #define FAT_DIR_COUNT 2
 
+/**
+ * \ingroup fat_config
+ * Maximum number of jobs running at the same time.
+ *
+ * \see fat_job_step
+ */
+#define FAT_JOB_COUNT 1
+
 /**
  * @}
  */
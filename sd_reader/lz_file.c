@@ -0,0 +1,637 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#include "byteordering.h"
+#include "lz_file.h"
+#include "lz_file_config.h"
+#include "sd-reader_config.h"
+
+#include <string.h>
+
+#if USE_DYNAMIC_MEMORY
+    #include <stdlib.h>
+#endif
+
+#if DOXYGEN || FAT_WRITE_SUPPORT
+
+/**
+ * \addtogroup lz_file Compressed file support
+ *
+ * Compresses data on its way to a file.
+ *
+ * The data is compressed with a small LZ77 variant. Matches are looked up
+ * by a hash of their first three bytes, checking a single candidate per
+ * byte, which keeps compression fast and the memory footprint small.
+ *
+ * The compressed data is split into blocks of LZ_FILE_BLOCK_SIZE bytes,
+ * each of which can be decompressed on its own. As each block records the
+ * position of its data within the uncompressed stream, a reader can find
+ * any position by a binary search through the blocks.
+ *
+ * @{
+ */
+/**
+ * \file
+ * Compressed file implementation (license: GPLv2 or LGPLv2.1)
+ */
+
+/**
+ * \addtogroup lz_file_config Configuration of compressed file support
+ * Preprocessor defines to configure the compressed file support.
+ */
+
+/**
+ * \addtogroup lz_file_format Compressed file layout
+ *
+ * block:
+ * ======
+ * offset  length  description
+ *      0       2  magic "LZ"
+ *      2       4  uncompressed position of the block's first byte
+ *      6       n  groups of tokens
+ *
+ * The blocks are LZ_FILE_BLOCK_SIZE bytes apart. Each block but the
+ * last ends with an end marker, followed by zeros up to the next block.
+ *
+ * group:
+ * ======
+ * A group starts with a byte of flags, followed by up to eight tokens.
+ * Bit \c i of the flags, counted from the least significant one, is set
+ * if token \c i is a match.
+ *
+ * A literal is a single byte of data. A match is a little-endian 16-bit
+ * word. Its lower 10 bits give the distance back to the data to repeat,
+ * the upper 6 bits the number of bytes to repeat minus three. The data
+ * may overlap the bytes produced by the match itself. A distance of zero
+ * marks the end of the block.
+ *
+ * A block cut short by a power loss lacks its end marker. Its data ends
+ * where the uncompressed position of the next block begins.
+ */
+
+#define LZ_FILE_MAGIC 0x5a4c /* "LZ" */
+#define LZ_FILE_HEADER_SIZE 6
+#define LZ_FILE_MATCH_MIN 3
+#define LZ_FILE_MATCH_MAX 66
+#define LZ_FILE_DISTANCE_MAX (LZ_FILE_WINDOW_SIZE - LZ_FILE_MATCH_MAX)
+#define LZ_FILE_WINDOW_MASK (LZ_FILE_WINDOW_SIZE - 1)
+#define LZ_FILE_HASH_SIZE (1 << LZ_FILE_HASH_BITS)
+
+/* the largest token including a new group's flags, plus an end marker */
+#define LZ_FILE_BLOCK_RESERVE 6
+
+#if LZ_FILE_WINDOW_SIZE < 128 || LZ_FILE_WINDOW_SIZE > 1024 || (LZ_FILE_WINDOW_SIZE & LZ_FILE_WINDOW_MASK)
+    #error "LZ_FILE_WINDOW_SIZE must be a power of two from 128 to 1024"
+#endif
+
+struct lz_file_struct
+{
+    struct fat_file_struct* fd;
+    uint32_t pos;
+    uint32_t block_start;
+    uint32_t block_offset;
+    uint32_t group_offset;
+    uint32_t end;
+    uint16_t block_used;
+    uint8_t lookahead;
+    uint8_t group_len;
+    uint8_t group_count;
+    uint8_t rewrite;
+    uint8_t group[1 + 8 * 2];
+    uint8_t window[LZ_FILE_WINDOW_SIZE];
+    uint16_t head[LZ_FILE_HASH_SIZE];
+};
+
+#if !USE_DYNAMIC_MEMORY
+static struct lz_file_struct lz_file_handles[LZ_FILE_COUNT];
+#endif
+
+static uint8_t lz_file_seek(struct fat_file_struct* fd, uint32_t offset);
+static uint16_t lz_file_hash(const struct lz_file_struct* lz, uint32_t pos);
+static uint8_t lz_file_encode(struct lz_file_struct* lz);
+static uint8_t lz_file_flush(struct lz_file_struct* lz);
+static uint8_t lz_file_put(struct lz_file_struct* lz, uint8_t match, uint16_t token);
+static uint8_t lz_file_write_group(struct lz_file_struct* lz, uint8_t length);
+static uint8_t lz_file_start_block(struct lz_file_struct* lz);
+static uint8_t lz_file_end_block(struct lz_file_struct* lz);
+static uint8_t lz_file_recover(struct lz_file_struct* lz, uint32_t size);
+
+/**
+ * Starts compressing data written to a file.
+ *
+ * The compressed data is appended to the file. If the file is not
+ * empty, it must hold compressed data already. Its last block is
+ * continued, so opening the file for each short session does not
+ * waste the rest of a block.
+ *
+ * The file handle must not be used otherwise until the compressed
+ * file is closed.
+ *
+ * \param[in] fd The handle of the file to which to write.
+ * \returns The compressed file handle, or 0 on failure.
+ * \see lz_file_close
+ */
+struct lz_file_struct* lz_file_open(struct fat_file_struct* fd)
+{
+    if(!fd)
+        return 0;
+
+#if USE_DYNAMIC_MEMORY
+    struct lz_file_struct* lz = malloc(sizeof(*lz));
+    if(!lz)
+        return 0;
+#else
+    struct lz_file_struct* lz = lz_file_handles;
+    uint8_t i;
+    for(i = 0; i < LZ_FILE_COUNT; ++i)
+    {
+        if(!lz->fd)
+            break;
+
+        ++lz;
+    }
+    if(i >= LZ_FILE_COUNT)
+        return 0;
+#endif
+
+    memset(lz, 0, sizeof(*lz));
+    lz->fd = fd;
+
+    int32_t size = 0;
+    if(!fat_seek_file(fd, &size, FAT_SEEK_END) ||
+       !lz_file_recover(lz, size))
+    {
+#if USE_DYNAMIC_MEMORY
+        free(lz);
+#else
+        lz->fd = 0;
+#endif
+        return 0;
+    }
+
+    return lz;
+}
+
+/**
+ * Stops compressing data written to a file.
+ *
+ * The remaining data is compressed and written, and the current block
+ * is ended. The file handle is not closed.
+ *
+ * \param[in] lz The compressed file to close.
+ * \returns 0 on failure, 1 on success.
+ * \see lz_file_open
+ */
+uint8_t lz_file_close(struct lz_file_struct* lz)
+{
+    if(!lz)
+        return 0;
+
+    uint8_t result = lz_file_flush(lz) &&
+                     (!lz->block_used || lz_file_end_block(lz));
+
+#if USE_DYNAMIC_MEMORY
+    free(lz);
+#else
+    lz->fd = 0;
+#endif
+
+    return result;
+}
+
+/**
+ * Compresses data and writes it to a file.
+ *
+ * The last few bytes are kept back to look for matches with the data
+ * following them. They are written with the next call, or when the
+ * compressed file is synced or closed.
+ *
+ * \param[in] lz The compressed file to which to write.
+ * \param[in] buffer The data to write.
+ * \param[in] buffer_len The number of bytes to write.
+ * \returns The number of bytes written, or -1 on failure.
+ * \see lz_file_sync
+ */
+intptr_t lz_file_write(struct lz_file_struct* lz, const uint8_t* buffer, uintptr_t buffer_len)
+{
+    if(!lz || !buffer)
+        return -1;
+
+    for(uintptr_t i = 0; i < buffer_len; ++i)
+    {
+        lz->window[(lz->pos + lz->lookahead) & LZ_FILE_WINDOW_MASK] = buffer[i];
+        if(++lz->lookahead >= LZ_FILE_MATCH_MAX && !lz_file_encode(lz))
+            return -1;
+    }
+
+    return buffer_len;
+}
+
+/**
+ * Writes all data of a compressed file to disk.
+ *
+ * The block is not ended. Instead, an end marker is written behind the
+ * data, which the following data overwrites. Data kept back for looking
+ * for matches gets compressed without them, so syncing too often
+ * worsens compression.
+ *
+ * \param[in] lz The compressed file to sync.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t lz_file_sync(struct lz_file_struct* lz)
+{
+    if(!lz || !lz_file_flush(lz))
+        return 0;
+
+    if(lz->block_used)
+    {
+        uint8_t length = lz->group_len;
+        uint8_t flags = lz->group[0];
+        if(!length)
+        {
+            lz->group_offset = lz->block_offset + lz->block_used;
+            lz->group[0] = 0;
+            length = 1;
+        }
+
+        lz->group[0] |= 1 << lz->group_count;
+        lz->group[length++] = 0;
+        lz->group[length++] = 0;
+        uint8_t result = lz_file_write_group(lz, length);
+        lz->group[0] = flags;
+        if(!result)
+            return 0;
+
+        lz->rewrite = 1;
+    }
+
+    return fat_sync_file(lz->fd);
+}
+
+/**
+ * Moves the position of a file handle.
+ *
+ * \param[in] fd The file handle to move.
+ * \param[in] offset The new file offset.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t lz_file_seek(struct fat_file_struct* fd, uint32_t offset)
+{
+    int32_t pos = (int32_t) offset;
+    return fat_seek_file(fd, &pos, FAT_SEEK_SET);
+}
+
+/**
+ * Calculates the hash of the three bytes at a stream position.
+ *
+ * \param[in] lz The compressed file whose window holds the bytes.
+ * \param[in] pos The stream position of the first byte.
+ * \returns The hash.
+ */
+uint16_t lz_file_hash(const struct lz_file_struct* lz, uint32_t pos)
+{
+    uint16_t hash = ((uint16_t) lz->window[pos & LZ_FILE_WINDOW_MASK] << 6) ^
+                    ((uint16_t) lz->window[(pos + 1) & LZ_FILE_WINDOW_MASK] << 3) ^
+                    lz->window[(pos + 2) & LZ_FILE_WINDOW_MASK];
+
+    return (hash ^ (hash >> LZ_FILE_HASH_BITS)) & (LZ_FILE_HASH_SIZE - 1);
+}
+
+/**
+ * Compresses the data at the start of the lookahead into a single token.
+ *
+ * \param[in] lz The compressed file to encode.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t lz_file_encode(struct lz_file_struct* lz)
+{
+    /* end the block if the token might not fit */
+    if(lz->block_used > LZ_FILE_BLOCK_SIZE - LZ_FILE_BLOCK_RESERVE && !lz_file_end_block(lz))
+        return 0;
+    if(!lz->block_used && !lz_file_start_block(lz))
+        return 0;
+
+    uint8_t length = 0;
+    uint16_t distance = 0;
+    if(lz->lookahead >= LZ_FILE_MATCH_MIN)
+    {
+        /* check the last position with the same hash */
+        uint16_t hash = lz_file_hash(lz, lz->pos);
+        distance = (uint16_t) lz->pos - lz->head[hash];
+        lz->head[hash] = (uint16_t) lz->pos;
+
+        /* matches must not reach back into the previous block */
+        uint32_t distance_max = lz->pos - lz->block_start;
+        if(distance_max > LZ_FILE_DISTANCE_MAX)
+            distance_max = LZ_FILE_DISTANCE_MAX;
+
+        if(distance && distance <= distance_max)
+        {
+            while(length < lz->lookahead &&
+                  lz->window[(lz->pos - distance + length) & LZ_FILE_WINDOW_MASK] == lz->window[(lz->pos + length) & LZ_FILE_WINDOW_MASK])
+                ++length;
+        }
+    }
+
+    if(length >= LZ_FILE_MATCH_MIN)
+    {
+        if(!lz_file_put(lz, 1, distance | ((uint16_t) (length - LZ_FILE_MATCH_MIN) << 10)))
+            return 0;
+
+        /* remember the positions within the match */
+        for(uint8_t i = 1; i < length && i + LZ_FILE_MATCH_MIN <= lz->lookahead; ++i)
+            lz->head[lz_file_hash(lz, lz->pos + i)] = (uint16_t) (lz->pos + i);
+    }
+    else
+    {
+        if(!lz_file_put(lz, 0, lz->window[lz->pos & LZ_FILE_WINDOW_MASK]))
+            return 0;
+
+        length = 1;
+    }
+
+    lz->pos += length;
+    lz->lookahead -= length;
+
+    return 1;
+}
+
+/**
+ * Compresses all of the lookahead.
+ *
+ * \param[in] lz The compressed file to flush.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t lz_file_flush(struct lz_file_struct* lz)
+{
+    while(lz->lookahead)
+    {
+        if(!lz_file_encode(lz))
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Adds a token to the current group, and writes the group when full.
+ *
+ * \param[in] lz The compressed file to which to add the token.
+ * \param[in] match 1 if the token is a match, 0 if it is a literal.
+ * \param[in] token The literal byte or the match word.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t lz_file_put(struct lz_file_struct* lz, uint8_t match, uint16_t token)
+{
+    if(!lz->group_len)
+    {
+        lz->group_offset = lz->block_offset + lz->block_used;
+        lz->group[0] = 0;
+        lz->group_len = 1;
+        ++lz->block_used;
+    }
+
+    lz->group[lz->group_len++] = (uint8_t) token;
+    ++lz->block_used;
+    if(match)
+    {
+        lz->group[0] |= 1 << lz->group_count;
+        lz->group[lz->group_len++] = (uint8_t) (token >> 8);
+        ++lz->block_used;
+    }
+
+    if(++lz->group_count < 8)
+        return 1;
+
+    uint8_t result = lz_file_write_group(lz, lz->group_len);
+    lz->group_len = 0;
+    lz->group_count = 0;
+
+    return result;
+}
+
+/**
+ * Writes the current group to the file.
+ *
+ * \param[in] lz The compressed file whose group to write.
+ * \param[in] length The number of bytes to write.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t lz_file_write_group(struct lz_file_struct* lz, uint8_t length)
+{
+    /* overwrite what the last sync wrote */
+    if(lz->rewrite)
+    {
+        if(!lz_file_seek(lz->fd, lz->group_offset))
+            return 0;
+
+        lz->rewrite = 0;
+    }
+
+    if(fat_write_file(lz->fd, lz->group, length) != length)
+        return 0;
+
+    lz->end = lz->group_offset + length;
+    return 1;
+}
+
+/**
+ * Pads the file up to the next block and writes the block's header.
+ *
+ * \param[in] lz The compressed file in which to start a block.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t lz_file_start_block(struct lz_file_struct* lz)
+{
+    if(!lz_file_seek(lz->fd, lz->end))
+        return 0;
+    lz->rewrite = 0;
+
+    memset(lz->group, 0, sizeof(lz->group));
+    while(lz->end < lz->block_offset)
+    {
+        uint8_t length = sizeof(lz->group);
+        if(length > lz->block_offset - lz->end)
+            length = lz->block_offset - lz->end;
+
+        if(fat_write_file(lz->fd, lz->group, length) != length)
+            return 0;
+
+        lz->end += length;
+    }
+
+    uint16_t magic = HTOL16(LZ_FILE_MAGIC);
+    uint32_t pos = htol32(lz->pos);
+    memcpy(&lz->group[0], &magic, sizeof(magic));
+    memcpy(&lz->group[2], &pos, sizeof(pos));
+    if(fat_write_file(lz->fd, lz->group, LZ_FILE_HEADER_SIZE) != LZ_FILE_HEADER_SIZE)
+        return 0;
+
+    lz->end += LZ_FILE_HEADER_SIZE;
+    lz->block_start = lz->pos;
+    lz->block_used = LZ_FILE_HEADER_SIZE;
+
+    return 1;
+}
+
+/**
+ * Writes an end marker and the current group, and ends the block.
+ *
+ * \param[in] lz The compressed file whose block to end.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t lz_file_end_block(struct lz_file_struct* lz)
+{
+    if(!lz_file_put(lz, 1, 0))
+        return 0;
+
+    if(lz->group_len)
+    {
+        if(!lz_file_write_group(lz, lz->group_len))
+            return 0;
+
+        lz->group_len = 0;
+        lz->group_count = 0;
+    }
+
+    lz->block_offset += LZ_FILE_BLOCK_SIZE;
+    lz->block_used = 0;
+
+    return 1;
+}
+
+/**
+ * Finds the end of the data already in the file to continue its last block.
+ *
+ * Only the tokens of the last block are counted. Its end marker and
+ * anything cut short by a power loss are removed. The group holding the
+ * last tokens is loaded to be completed. Matches do not reach back into
+ * the data written before, as the window does not hold it.
+ *
+ * \param[in] lz The compressed file to recover.
+ * \param[in] size The size of the file in bytes.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t lz_file_recover(struct lz_file_struct* lz, uint32_t size)
+{
+    uint32_t block_offset = 0;
+    while(size > 0)
+    {
+        block_offset = (size - 1) & ~((uint32_t) LZ_FILE_BLOCK_SIZE - 1);
+        if(!lz_file_seek(lz->fd, block_offset))
+            return 0;
+
+        intptr_t read_length = fat_read_file(lz->fd, lz->group, LZ_FILE_HEADER_SIZE);
+        if(read_length < 0)
+            return 0;
+        if(read_length == LZ_FILE_HEADER_SIZE)
+            break;
+
+        if(!fat_resize_file(lz->fd, block_offset))
+            return 0;
+        size = block_offset;
+    }
+
+    lz->end = size;
+    if(!size)
+        return 1;
+
+    uint16_t magic;
+    uint32_t pos;
+    memcpy(&magic, &lz->group[0], sizeof(magic));
+    memcpy(&pos, &lz->group[2], sizeof(pos));
+    if(magic != HTOL16(LZ_FILE_MAGIC))
+        return 0;
+    pos = ltoh32(pos);
+
+    /* count the bytes the tokens of the last block expand to */
+    uint32_t offset = block_offset + LZ_FILE_HEADER_SIZE;
+    uint32_t group_offset = offset;
+    uint32_t data_end = offset;
+    uint8_t group_len = 0;
+    uint8_t count = 8;
+    uint8_t match_byte = 0;
+    uintptr_t chunk_len = 0;
+    uintptr_t chunk_pos = 0;
+    while(1)
+    {
+        if(chunk_pos >= chunk_len)
+        {
+            intptr_t read_length = fat_read_file(lz->fd, lz->window, sizeof(lz->window));
+            if(read_length < 0)
+                return 0;
+            if(read_length == 0)
+                break;
+
+            chunk_len = read_length;
+            chunk_pos = 0;
+        }
+
+        uint8_t b = lz->window[chunk_pos++];
+        ++offset;
+        if(count >= 8)
+        {
+            group_offset = offset - 1;
+            group_len = 0;
+            count = 0;
+        }
+        else if(!(lz->group[0] & (1 << count)))
+        {
+            ++pos;
+            ++count;
+        }
+        else if(!match_byte)
+        {
+            match_byte = 1;
+        }
+        else
+        {
+            uint16_t token = lz->group[group_len - 1] | ((uint16_t) b << 8);
+            if(!(token & 0x3ff))
+                break;
+
+            pos += (token >> 10) + LZ_FILE_MATCH_MIN;
+            match_byte = 0;
+            ++count;
+        }
+
+        lz->group[group_len++] = b;
+        if(!match_byte)
+            data_end = offset;
+    }
+
+    /* continue the block behind its last complete token */
+    if(data_end < size && !fat_resize_file(lz->fd, data_end))
+        return 0;
+
+    if(count < 8)
+    {
+        lz->group[0] &= (1 << count) - 1;
+        lz->group_offset = group_offset;
+        lz->group_len = data_end - group_offset;
+        lz->group_count = count;
+    }
+
+    lz->pos = pos;
+    lz->block_start = pos;
+    lz->block_offset = block_offset;
+    lz->block_used = data_end - block_offset;
+    lz->end = data_end;
+    lz->rewrite = 1;
+
+    return 1;
+}
+
+#endif
+
+/**
+ * @}
+ */
+
@@ -0,0 +1,52 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef LZ_FILE_H
+#define LZ_FILE_H
+
+#include <stdint.h>
+#include "fat.h"
+#include "lz_file_config.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \addtogroup lz_file
+ *
+ * @{
+ */
+/**
+ * \file
+ * Compressed file header (license: GPLv2 or LGPLv2.1)
+ */
+
+/** The size of a compressed block. */
+#define LZ_FILE_BLOCK_SIZE 4096
+
+struct lz_file_struct;
+
+struct lz_file_struct* lz_file_open(struct fat_file_struct* fd);
+uint8_t lz_file_close(struct lz_file_struct* lz);
+intptr_t lz_file_write(struct lz_file_struct* lz, const uint8_t* buffer, uintptr_t buffer_len);
+uint8_t lz_file_sync(struct lz_file_struct* lz);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
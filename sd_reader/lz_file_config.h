@@ -0,0 +1,63 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef LZ_FILE_CONFIG_H
+#define LZ_FILE_CONFIG_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \addtogroup lz_file
+ *
+ * @{
+ */
+/**
+ * \file
+ * Compressed file configuration (license: GPLv2 or LGPLv2.1)
+ */
+
+/**
+ * \ingroup lz_file_config
+ * Maximum number of compressed file handles.
+ */
+#define LZ_FILE_COUNT 1
+
+/**
+ * \ingroup lz_file_config
+ * Size of the compression window in bytes.
+ *
+ * A power of two from 128 to 1024. Matches are searched within the
+ * last LZ_FILE_WINDOW_SIZE - 66 bytes. Each handle holds this many
+ * bytes of RAM.
+ */
+#define LZ_FILE_WINDOW_SIZE 256
+
+/**
+ * \ingroup lz_file_config
+ * Number of bits of the hash used to find matches.
+ *
+ * Each handle holds a table of 2 ^ LZ_FILE_HASH_BITS positions of
+ * two bytes each. A larger table finds more matches.
+ */
+#define LZ_FILE_HASH_BITS 7
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -1,22 +1,64 @@
 
 #include <string.h>
+#include <avr/interrupt.h>
+#include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/power.h>
 #include <avr/sleep.h>
 #include <avr/wdt.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include "crc16.h"
 #include "fat.h"
 #include "fat_config.h"
+#include "lz_file.h"
 #include "partition.h"
 #include "sd_raw.h"
 #include "sd_raw_config.h"
 #include "uart.h"
-#include "RingBuffer.h"
+#include "ring.h"
 
 #define DEBUG 0
 
+/* accept compressed dumps, requested with 'z' instead of 's', see
+ * tools/lz_file_unpack.c. The compressor handle takes 557 bytes of
+ * static RAM, so it is only linked in when enabled here.
+ */
+#define DUMP_COMPRESSION 0
+
+/* receive dumps through the framed protocol, see tools/dump_peer.c */
+#define DUMP_FRAMED 1
+
+/* Flow control on the receive path. The sender is held off before the
+ * receive ring buffer runs full, and released again when it has
+ * drained. With FLOW_CONTROL_RTS, the default, the pin below goes high
+ * to hold off the sender. It has to be wired to the sender's CTS input,
+ * see the Makefile. Without that wire, bytes are still dropped when the
+ * card stalls for long. FLOW_CONTROL_XON_XOFF sends XOFF and XON
+ * instead. It is only suitable for text, as these bytes may be part of
+ * frames and would stall the sender.
+ */
+#define FLOW_CONTROL_NONE 0
+#define FLOW_CONTROL_RTS 1
+#define FLOW_CONTROL_XON_XOFF 2
+#ifndef FLOW_CONTROL
+#define FLOW_CONTROL FLOW_CONTROL_RTS
+#endif
+
+#if FLOW_CONTROL == FLOW_CONTROL_XON_XOFF && DUMP_FRAMED
+#error "XON/XOFF flow control is in-band and conflicts with DUMP_FRAMED, use FLOW_CONTROL_RTS"
+#endif
+
+#define FLOW_RTS_DDR DDRD
+#define FLOW_RTS_PORT PORTD
+#define FLOW_RTS_PIN PD4
+
+/* ring buffer levels at which the sender is held off and released */
+#define FLOW_HIGH_WATER 480
+#define FLOW_LOW_WATER 128
+
 /**
  * \mainpage MMC/SD/SDHC card library
  *
@@ -48,6 +90,12 @@
  * eject button which, when a card is inserted, needs some space beyond the connector
  * itself. As an additional feature the connector has two electrical switches
  * to detect wether a card is inserted and wether this card is write-protected.
+ *
+ * When receiving dumps over the UART, the card holds off the sender by
+ * driving PD4 (pin D4 of the Teensy 2.0) high while it cannot take more
+ * data. Wire PD4 to the CTS input of the sender and enable hardware flow
+ * control there. Set FLOW_CONTROL in the Makefile to choose another kind
+ * of flow control or none.
  * 
  * \section pictures Pictures
  * \image html pic01.jpg "The circuit board used to implement and test this application."
@@ -76,7 +124,8 @@
  * - <tt>mkdir \<directory\></tt>\n
  *   Creates a directory called \<directory\>.
  * - <tt>rm \<file\></tt>\n
- *   Deletes \<file\>.
+ *   Deletes \<file\>. If \<file\> is a directory, it is deleted
+ *   including all of its files and subdirectories.
  * - <tt>sync</tt>\n
  *   Ensures all buffered data is written to the card.
  * - <tt>touch \<file\></tt>\n
@@ -211,14 +260,119 @@ do                          \
 	}                       \
 } while(0)
 
-const char* CRLF = "\r\n";
-char buffer[20];
-static RingBuffer_t Buffer_Rx;
-static uint8_t      Buffer_Rx_Data[256];
+/* The receive ring buffer takes the RAM freed by assembling the dump
+ * sectors within the block cache. At 9600 baud, it holds about half a
+ * second of data while the card is busy.
+ */
+static struct ring_struct Buffer_Rx;
+static uint8_t      Buffer_Rx_Data[512];
+/* number of bytes lost because the ring buffer was full */
+static volatile uint16_t Buffer_Rx_Dropped;
+
+#if FLOW_CONTROL
+/* how often and for how many milliseconds in total the sender has been held off */
+static volatile uint8_t flow_held;
+static volatile uint16_t flow_hold_count;
+static volatile uint32_t flow_hold_ms;
+static uint32_t flow_hold_start;
+#endif
+
+/* number of lines in a dump */
+#define INGEST_LINES 512
+/* time without received data after which a dump is considered finished */
+#define INGEST_TIMEOUT_MS 100
+
+/* Progress of a dump being received. The receive ISR only fills the ring
+ * buffer. The data is taken from there straight into the file's sector
+ * within the block cache, so the ring buffer is the only other buffer and
+ * holds the data arriving while a sector is written to the card. On the
+ * way, line endings are turned into CRLF and the line framing is checked.
+ */
+struct ingest_state
+{
+    uint16_t lines;
+    uint16_t idle;
+    uint8_t errors;
+    uint8_t line_length;
+    uint8_t line_bad;
+    uint8_t cr_stored;
+};
+
+/* size of the buffer holding a dump file name, "dump", up to five digits
+ * and ".lz" for a compressed dump
+ */
+#define DUMP_NAME_SIZE 13
+
+#if DUMP_FRAMED
+/* Framed dump transfer, as implemented by tools/dump_peer.c. Every frame
+ * starts with FRAME_SYNC, followed by its type, its sequence number, the
+ * length of its data, the data itself and a CRC-16 (CCITT, initialized to
+ * 0xffff, little endian) of type, sequence number, length and data.
+ *
+ * The sender opens a session with FRAME_OPEN carrying a 32-bit dump id.
+ * The card answers with FRAME_ACCEPT, carrying the offset to continue
+ * from: 0 for a new dump, or the number of bytes already stored if the
+ * dump with the same id has been cut short before. The sender then sends
+ * the dump data from that offset in FRAME_DATA frames numbered from 0,
+ * and finally FRAME_END with the total dump length. Every frame received
+ * in sequence is acknowledged by FRAME_ACK with the number of the next
+ * frame expected. Any other frame repeats this acknowledgement, asking
+ * the sender to go back to the frame missing. FRAME_FAIL ends a session
+ * which cannot be continued.
+ *
+ * If the final acknowledgement gets lost, the sender opens the dump again.
+ * As it is complete already, it is accepted at its end, and FRAME_END is
+ * acknowledged without storing anything. The state for resuming is kept
+ * in RAM only, so it does not survive a reset or power loss of the card.
+ *
+ * At most FRAME_WINDOW frames may be unacknowledged at any time, which
+ * lets them wait in the receive ring buffer while a sector is written.
+ */
+#define FRAME_SYNC 0xa5
+#define FRAME_OPEN 'O'
+#define FRAME_ACCEPT 'A'
+#define FRAME_DATA 'D'
+#define FRAME_END 'E'
+#define FRAME_ACK 'K'
+#define FRAME_FAIL 'F'
+#define FRAME_DATA_MAX 64
+#define FRAME_WINDOW 3
+/* time without a valid frame after which the link is considered lost */
+#define FRAME_TIMEOUT_MS 2000
+
+/* type, sequence number, length, data and CRC of the frame being received */
+static uint8_t frame[3 + FRAME_DATA_MAX + 2];
+static uint8_t frame_pos;
+
+/* the last dump, to be resumed by the next session after a lost link,
+ * or to repeat its final acknowledgement
+ */
+static uint32_t dump_resume_id;
+static char dump_resume_name[DUMP_NAME_SIZE];
+#endif
 
 void wdt_init(void) __attribute__((naked)) __attribute__((section(".init3")));
 
 static uint8_t read_line(char* buffer, uint8_t buffer_length);
+static uint8_t rx_remove(void);
+static void rx_consume(uint16_t count);
+#if FLOW_CONTROL
+static void flow_hold(void);
+static void flow_release(void);
+#else
+#define flow_hold()
+#define flow_release()
+#endif
+static uint16_t ingest_take(struct ingest_state* in, uint8_t* data, uint16_t length);
+static uint8_t ingest_wait(struct ingest_state* in);
+static uint8_t ingest_dump(struct fat_fs_struct* fs, struct fat_file_struct* fd, uint8_t compress, uint8_t* errors);
+#if DUMP_FRAMED
+static uint8_t frame_parse(uint8_t c);
+static uint8_t frame_receive(uint16_t timeout_ms);
+static void frame_send(uint8_t type, uint8_t seq, const uint8_t* data, uint8_t length);
+static uint8_t dump_framed(struct fat_fs_struct* fs, struct fat_dir_struct* dd);
+#endif
+static uint8_t next_dump_name(struct fat_fs_struct* fs, struct fat_dir_struct* dd, uint8_t compress, char* filename);
 static uint32_t strtolong(const char* str);
 static uint8_t find_file_in_dir(struct fat_fs_struct* fs, struct fat_dir_struct* dd, const char* name, struct fat_dir_entry_struct* dir_entry);
 static struct fat_file_struct* open_file_in_dir(struct fat_fs_struct* fs, struct fat_dir_struct* dd, const char* name); 
@@ -238,6 +392,10 @@ void cmd_test(struct fat_fs_struct* fs, struct fat_dir_struct* dd,char* command)
 //void cmd_cd(struct fat_fs_struct* fs, struct fat_dir_struct* dd,char* command);
 //void cmd_cd(struct fat_fs_struct* fs, struct fat_dir_struct* dd,char* command);
 
+#if FAT_USE_MILLIS || FLOW_CONTROL
+void millis_init(void);
+#endif
+
 void wdt_init(void)
 {
 	MCUSR = 0;
@@ -264,10 +422,19 @@ int main()
     /* we will just use ordinary idle mode */
     set_sleep_mode(SLEEP_MODE_IDLE);
 
-	RingBuffer_InitBuffer(&Buffer_Rx, Buffer_Rx_Data, sizeof(Buffer_Rx_Data));
+	ring_init(&Buffer_Rx, Buffer_Rx_Data, sizeof(Buffer_Rx_Data));
+
+#if FAT_USE_MILLIS || FLOW_CONTROL
+    /* setup millisecond timer */
+    millis_init();
+#endif
 
     /* setup uart */
     uart_init();
+#if FLOW_CONTROL == FLOW_CONTROL_RTS
+    /* let the sender transmit */
+    FLOW_RTS_DDR |= (1 << FLOW_RTS_PIN);
+#endif
 	stdout = &mystdout;
 
     while(1)
@@ -328,6 +495,15 @@ int main()
             continue;
         }
 
+        /* cut back files whose sizes were deferred when power was lost,
+         * which only scans the volume if the card has not been closed
+         * cleanly
+         */
+        fat_recover(fs);
+
+        /* grow the root directory now instead of within a transfer */
+        fat_reserve_dir(dd, 32);
+
         /* print some card information as a boot message */
         //print_disk_info(fs);
 
@@ -337,31 +513,27 @@ int main()
         while(1)
         {
 			char success = 0;
-			char filename_available = 0;
-			volatile uint8_t  errors = 0;
-			RingBuffer_Flush(&Buffer_Rx);
+			uint8_t errors = 0;
+			ring_flush(&Buffer_Rx);
+			flow_release();
 
 			uart_putc('t');
 			
-			if(wait_for_answer() == 's')
+			char answer = wait_for_answer();
+			uint8_t compress = DUMP_COMPRESSION && answer == 'z';
+#if DUMP_FRAMED
+			if((uint8_t) answer == FRAME_SYNC)
 			{
-				char filename[10];
-				char filenum[4];
-				
-				for(char i=0; i<100; i++)
-				{
-					strcpy(filename, "dump");
-					strcat(filename, itoa(i, filenum, 10));
-					struct fat_dir_entry_struct subdir_entry;
-					if(!find_file_in_dir(fs, dd, filename, &subdir_entry))
-					{
-						filename_available = 1;
-						break;
-					}
-				}
-				if(filename_available)
+				/* the sender speaks the framed protocol, see tools/dump_peer.c */
+				success = dump_framed(fs, dd);
+			}
+			else
+#endif
+			if(answer == 's' || compress)
+			{
+				char filename[DUMP_NAME_SIZE];
+				if(next_dump_name(fs, dd, compress, filename))
 				{
-					filename_available = 0;
 					// Create the file
 					if(!make_file(fs, dd, filename))
 						continue;
@@ -374,39 +546,13 @@ int main()
 						struct fat_file_struct* fd = open_file_in_dir(fs, dd, filename);
 						if(fd)
 						{
+							/* write the file size only every few clusters */
+							fat_set_file_options(fd, FAT_FILE_DEFER_SIZE);
 							uart_putc('m');
 							if(wait_for_answer() == 'a')
 							{
-								uint8_t data_len;
-								volatile int i;
-								//max=0;
-								for(i=0; i<512; i++)
-								{	x=i;
-									//printf("L%d\n", i);
-									//uart_putc(i/100 + 48);						
-									data_len = read_line(buffer, sizeof(buffer)-3);
-									if(!data_len)
-									{
-										errors++;
-										continue;
-									}
-									//buffer[16] = 13;
-									//buffer[17] = 10;
-									//buffer[18] = 0;
-									//buffer[19] = 0;
-									strcat(buffer, CRLF);
-									data_len += 2;
-									/* write text to file */
-									if(fat_write_file(fd, (uint8_t*) buffer, data_len) != data_len)
-									{
-										break;
-									}
-									
-									//fat_write_file(fd, CRLF, 2);
-								}
+								success = ingest_dump(fs, fd, compress, &errors);
 								fat_close_file(fd);
-								if(i == 512)
-									success = 1;
 							}
 						}
 					}
@@ -429,6 +575,13 @@ int main()
 			}
 		if(success)
 			uart_puts("Success\n");
+#if DEBUG
+		uart_puts_p(PSTR("dropped: ")); uart_putw_dec(Buffer_Rx_Dropped); uart_putc('\n');
+#if FLOW_CONTROL
+		uart_puts_p(PSTR("held:    ")); uart_putw_dec(flow_hold_count);
+		uart_puts_p(PSTR(" times, ")); uart_putdw_dec(flow_hold_ms); uart_puts_p(PSTR("ms\n"));
+#endif
+#endif
 		//else
 			//uart_puts("Errors\n");
 
@@ -451,8 +604,8 @@ char wait_for_answer()
 	for(char i=0; i<100; i++)
 	{
 		_delay_ms(100);
-		if(!RingBuffer_IsEmpty(&Buffer_Rx))
-			return RingBuffer_Remove(&Buffer_Rx);
+		if(ring_count(&Buffer_Rx))
+			return rx_remove();
 	}
 	return 0;
 }
@@ -504,13 +657,11 @@ char exec_cmd(struct fat_fs_struct* fs, struct fat_dir_struct* dd,char* command)
     {
         cmd_mkdir(fs, dd, command);
     }
-#if SD_RAW_WRITE_BUFFERING
     else if(strcmp_P(command, PSTR("sync")) == 0)
     {
-        if(!sd_raw_sync())
+        if(!fat_sync(fs))
             uart_puts_p(PSTR("error syncing disk\n"));
     }
-#endif
 	else if(strcmp_P(command, PSTR("test")) == 0)
 	{									
 		cmd_test(fs, dd, command);
@@ -622,7 +773,8 @@ void cmd_rm(struct fat_fs_struct* fs, struct fat_dir_struct* dd,char* command)
 	struct fat_dir_entry_struct file_entry;
 	if(find_file_in_dir(fs, dd, command, &file_entry))
 	{
-		if(fat_delete_file(fs, &file_entry))
+		/* directories are deleted including their content */
+		if(fat_delete_tree(fs, &file_entry, 1))
 			return;
 	}
 
@@ -683,6 +835,7 @@ void cmd_write(struct fat_fs_struct* fs, struct fat_dir_struct* dd,char* command
 	}
 
 	/* read text from the shell and write it to the file */
+	char buffer[20];
 	uint8_t data_len;
 	while(1)
 	{
@@ -737,6 +890,7 @@ void cmd_test(struct fat_fs_struct* fs, struct fat_dir_struct* dd,char* command)
 		else
 		uart_puts_p(PSTR("ok\n"));
 		/* read text from the shell and write it to the file */
+		char buffer[20];
 		uint8_t data_len, lf_times=0;
 		while(1)
 		{
@@ -788,10 +942,10 @@ uint8_t read_line(char* buffer, uint8_t buffer_length)
 		uint8_t c;
 		uint16_t i=0; 
 		// If nothing is received for a while report failure
-		while(RingBuffer_IsEmpty(&Buffer_Rx))
+		while(!ring_count(&Buffer_Rx))
 			if(i++>1000)
 				return 0;
-		c = RingBuffer_Remove(&Buffer_Rx);
+		c = rx_remove();
 
         //if(c == 0x08 || c == 0x7f)
         //{
@@ -817,6 +971,498 @@ uint8_t read_line(char* buffer, uint8_t buffer_length)
     return read_length;
 }
 
+/* Takes received dump data from the ring buffer and stores it with CRLF
+ * line endings, up to the end of the dump. Empty lines and lines with
+ * non-printable characters are counted as errors. Returns the number of
+ * bytes stored, 0 if there is no data waiting.
+ */
+uint16_t ingest_take(struct ingest_state* in, uint8_t* data, uint16_t length)
+{
+    uint16_t used = 0;
+    while(used < length && in->lines < INGEST_LINES)
+    {
+        const uint8_t* span;
+        uint16_t span_length = ring_peek_span(&Buffer_Rx, &span);
+        if(!span_length)
+            break;
+
+        uint16_t i = 0;
+        while(i < span_length && used < length)
+        {
+            uint8_t c = span[i];
+            if(c == '\n')
+            {
+                if(!in->cr_stored)
+                {
+                    data[used++] = '\r';
+                    in->cr_stored = 1;
+                    continue;
+                }
+
+                if(!in->line_length || in->line_bad)
+                    ++in->errors;
+
+                in->cr_stored = 0;
+                in->line_length = 0;
+                in->line_bad = 0;
+                data[used++] = c;
+                ++i;
+                if(++in->lines >= INGEST_LINES)
+                    break;
+                continue;
+            }
+
+            if(c != '\r')
+            {
+                if(c < ' ' || c > '~')
+                    in->line_bad = 1;
+                if(in->line_length < UINT8_MAX)
+                    ++in->line_length;
+            }
+            data[used++] = c;
+            ++i;
+        }
+        rx_consume(i);
+    }
+
+    if(used)
+        in->idle = 0;
+    return used;
+}
+
+/* Waits a millisecond for more dump data. Returns 0 once no data has
+ * arrived for INGEST_TIMEOUT_MS, 1 otherwise.
+ */
+uint8_t ingest_wait(struct ingest_state* in)
+{
+    if(in->idle >= INGEST_TIMEOUT_MS)
+        return 0;
+
+    _delay_ms(1);
+    ++in->idle;
+    return 1;
+}
+
+/* Receives a dump of INGEST_LINES lines into a file. Each sector of the
+ * file is mapped into the block cache and filled from the receive ring
+ * buffer, and the next data waits in the ring buffer while the sector is
+ * written. With compress set, the data goes through lz_file instead. The
+ * dump ends after the last line or when no data arrives for
+ * INGEST_TIMEOUT_MS. Returns 1 if the whole dump has been received and
+ * written, 0 otherwise. The number of malformed lines is returned
+ * through errors.
+ */
+uint8_t ingest_dump(struct fat_fs_struct* fs, struct fat_file_struct* fd, uint8_t compress, uint8_t* errors)
+{
+    struct ingest_state in;
+    memset(&in, 0, sizeof(in));
+
+    uint8_t result = 1;
+    uint16_t dropped;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        dropped = Buffer_Rx_Dropped;
+    }
+
+#if DUMP_COMPRESSION
+    if(compress)
+    {
+        /* compress the text on its way to the card, in small chunks */
+        struct lz_file_struct* lz = lz_file_open(fd);
+        if(!lz)
+            return 0;
+
+        while(in.lines < INGEST_LINES)
+        {
+            uint8_t chunk[32];
+            uint16_t length = ingest_take(&in, chunk, sizeof(chunk));
+            if(!length)
+            {
+                /* sync pending changes which got too old */
+                fat_tick(fs);
+                if(!ingest_wait(&in))
+                    break;
+                continue;
+            }
+
+            if(lz_file_write(lz, chunk, length) != length)
+            {
+                result = 0;
+                break;
+            }
+        }
+
+        if(!lz_file_close(lz))
+            result = 0;
+    }
+    else
+#endif
+    {
+        while(in.lines < INGEST_LINES)
+        {
+            /* the sector following the end of the file */
+            uint8_t* sector;
+            uint16_t sector_left;
+            if(!fat_map_append(fd, &sector, &sector_left))
+            {
+                result = 0;
+                break;
+            }
+
+            uint16_t sector_used = 0;
+            while(sector_used < sector_left && in.lines < INGEST_LINES)
+            {
+                uint16_t length = ingest_take(&in, sector + sector_used, sector_left - sector_used);
+                if(!length && !ingest_wait(&in))
+                    break;
+                sector_used += length;
+            }
+
+            /* this also syncs pending changes which got too old */
+            if(!fat_unmap_append(fd, sector_used))
+            {
+                result = 0;
+                break;
+            }
+            if(sector_used < sector_left && in.lines < INGEST_LINES)
+                break;
+        }
+    }
+    flow_release();
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if(dropped != Buffer_Rx_Dropped)
+            result = 0;
+    }
+
+    *errors = in.errors;
+    return result && in.lines == INGEST_LINES;
+}
+
+#if DUMP_FRAMED
+/* Feeds a received byte to the frame parser. Returns 1 when it completes
+ * a frame with a valid checksum, 0 otherwise.
+ */
+uint8_t frame_parse(uint8_t c)
+{
+    if(!frame_pos)
+    {
+        /* hunt for the start of a frame */
+        if(c == FRAME_SYNC)
+            frame_pos = 1;
+        return 0;
+    }
+
+    frame[frame_pos++ - 1] = c;
+    if(frame_pos == 4 && frame[2] > FRAME_DATA_MAX)
+    {
+        frame_pos = 0;
+        return 0;
+    }
+    if(frame_pos < 4 || frame_pos < 1 + 3 + frame[2] + 2)
+        return 0;
+
+    frame_pos = 0;
+
+    uint8_t length = 3 + frame[2];
+    uint16_t crc = 0xffff;
+    for(uint8_t i = 0; i < length; ++i)
+        crc = crc16_update(crc, frame[i]);
+
+    return crc == (frame[length] | ((uint16_t) frame[length + 1] << 8));
+}
+
+/* Waits for a valid frame. Returns 0 if there has been no data for
+ * timeout_ms milliseconds, 1 otherwise.
+ */
+uint8_t frame_receive(uint16_t timeout_ms)
+{
+    uint16_t idle = 0;
+    while(1)
+    {
+        const uint8_t* data;
+        uint16_t length = ring_peek_span(&Buffer_Rx, &data);
+        if(!length)
+        {
+            if(idle++ >= timeout_ms)
+                return 0;
+            _delay_ms(1);
+            continue;
+        }
+
+        idle = 0;
+        for(uint16_t i = 0; i < length; ++i)
+        {
+            if(frame_parse(data[i]))
+            {
+                rx_consume(i + 1);
+                return 1;
+            }
+        }
+        rx_consume(length);
+    }
+}
+
+void frame_send(uint8_t type, uint8_t seq, const uint8_t* data, uint8_t length)
+{
+    uint8_t header[3] = { type, seq, length };
+    uint16_t crc = 0xffff;
+
+    uart_putc(FRAME_SYNC);
+    for(uint8_t i = 0; i < sizeof(header); ++i)
+    {
+        crc = crc16_update(crc, header[i]);
+        uart_putc(header[i]);
+    }
+    for(uint8_t i = 0; i < length; ++i)
+    {
+        crc = crc16_update(crc, data[i]);
+        uart_putc(data[i]);
+    }
+    uart_putc(crc & 0xff);
+    uart_putc(crc >> 8);
+}
+
+/* Receives a dump through the framed protocol, after the FRAME_SYNC byte
+ * starting its first frame has been received. The data is collected in
+ * the file's sector within the block cache and written to the card
+ * sector by sector. If the link is lost, the dump is kept for the next
+ * session to resume it. Returns 1 if the whole dump has been received
+ * and written, 0 otherwise.
+ */
+uint8_t dump_framed(struct fat_fs_struct* fs, struct fat_dir_struct* dd)
+{
+    /* drop what is left of an earlier session's frame */
+    frame_pos = 0;
+    frame_parse(FRAME_SYNC);
+
+    if(!frame_receive(FRAME_TIMEOUT_MS) || frame[0] != FRAME_OPEN || frame[2] != 4)
+        return 0;
+
+    uint32_t id = frame[3] | ((uint32_t) frame[4] << 8) | ((uint32_t) frame[5] << 16) | ((uint32_t) frame[6] << 24);
+    if(!dump_resume_name[0] || id != dump_resume_id)
+    {
+        /* start a new dump */
+        if(!next_dump_name(fs, dd, 0, dump_resume_name) || !make_file(fs, dd, dump_resume_name))
+        {
+            dump_resume_name[0] = '\0';
+            frame_send(FRAME_FAIL, 0, 0, 0);
+            return 0;
+        }
+        dump_resume_id = id;
+    }
+
+    struct fat_file_struct* fd = open_file_in_dir(fs, dd, dump_resume_name);
+    int32_t offset = 0;
+    if(!fd || !fat_seek_file(fd, &offset, FAT_SEEK_END))
+    {
+        fat_close_file(fd);
+        dump_resume_name[0] = '\0';
+        frame_send(FRAME_FAIL, 0, 0, 0);
+        return 0;
+    }
+    /* write the file size only every few clusters */
+    fat_set_file_options(fd, FAT_FILE_DEFER_SIZE);
+
+    uint32_t position = offset;
+    uint8_t accept[4] = { position, position >> 8, position >> 16, position >> 24 };
+    frame_send(FRAME_ACCEPT, 0, accept, sizeof(accept));
+
+    /* the sector following the end of the file, mapped when data arrives */
+    uint8_t* sector = 0;
+    uint16_t sector_left = 0;
+    uint16_t sector_used = 0;
+    uint8_t seq = 0;
+    uint8_t result = 0;
+    uint8_t done = 0;
+
+    while(!done)
+    {
+        if(!frame_receive(FRAME_TIMEOUT_MS))
+        {
+            /* the link is lost, so store what has been received and keep the dump for resuming */
+            if(sector && !fat_unmap_append(fd, sector_used))
+                dump_resume_name[0] = '\0';
+            sector = 0;
+            break;
+        }
+
+        uint8_t type = frame[0];
+        if(type == FRAME_OPEN && seq == 0)
+        {
+            /* the acceptance got lost */
+            frame_send(FRAME_ACCEPT, 0, accept, sizeof(accept));
+            continue;
+        }
+        if((type != FRAME_DATA && type != FRAME_END) || frame[1] != seq)
+        {
+            /* ask for the frame expected */
+            frame_send(FRAME_ACK, seq, 0, 0);
+            continue;
+        }
+
+        uint8_t length = frame[2];
+        const uint8_t* data = frame + 3;
+        if(type == FRAME_END)
+        {
+            uint32_t total = length != 4 ? 0 :
+                             data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+            length = 0;
+            done = 1;
+            result = total == position + sector_used;
+        }
+
+        while(length > 0 || (done && sector))
+        {
+            if(sector_used == sector_left || done)
+            {
+                /* append the sector, which also syncs pending changes
+                 * which got too old, and continue in the next one
+                 */
+                if(sector && !fat_unmap_append(fd, sector_used))
+                {
+                    sector = 0;
+                    result = 0;
+                    done = 1;
+                    break;
+                }
+                position += sector_used;
+                sector = 0;
+                sector_left = sector_used = 0;
+
+                if(done)
+                    break;
+                if(!fat_map_append(fd, &sector, &sector_left))
+                {
+                    result = 0;
+                    done = 1;
+                    break;
+                }
+            }
+
+            uint16_t copy = sector_left - sector_used;
+            if(copy > length)
+                copy = length;
+            memcpy(sector + sector_used, data, copy);
+            sector_used += copy;
+            data += copy;
+            length -= copy;
+        }
+
+        if(done && !result)
+        {
+            /* the dump failed, so there is nothing to resume */
+            dump_resume_name[0] = '\0';
+            break;
+        }
+
+        frame_send(FRAME_ACK, ++seq, 0, 0);
+    }
+
+    fat_close_file(fd);
+    if(done && !result)
+        frame_send(FRAME_FAIL, seq, 0, 0);
+
+    return result;
+}
+
+#endif
+
+/* Finds a name for a new dump file, numbered one above the highest
+ * dump in the directory, in a single pass through it. Returns 1 on
+ * success, 0 if the numbers are exhausted.
+ */
+uint8_t next_dump_name(struct fat_fs_struct* fs, struct fat_dir_struct* dd, uint8_t compress, char* filename)
+{
+    uint32_t next = 0;
+    struct fat_dir_entry_struct dir_entry;
+    while(fat_read_dir(dd, &dir_entry))
+    {
+        if(strncasecmp_P(dir_entry.long_name, PSTR("dump"), 4) != 0)
+            continue;
+
+        /* parse the number, ignoring names with anything else in them */
+        const char* digit = dir_entry.long_name + 4;
+        uint32_t number = 0;
+        while(*digit >= '0' && *digit <= '9' && number <= UINT16_MAX)
+            number = number * 10 + (*digit++ - '0');
+
+        if(strcasecmp_P(digit, PSTR(".lz")) == 0)
+            digit += 3;
+
+        if(digit > dir_entry.long_name + 4 && !*digit && number <= UINT16_MAX && number >= next)
+            next = number + 1;
+    }
+
+    if(next > UINT16_MAX)
+        return 0;
+
+    strcpy_P(filename, PSTR("dump"));
+    utoa((uint16_t) next, filename + 4, 10);
+    if(compress)
+        strcat_P(filename, PSTR(".lz"));
+    return 1;
+}
+
+/* Takes a byte from the receive ring buffer, which must not be empty. */
+uint8_t rx_remove(void)
+{
+    const uint8_t* data;
+    ring_peek_span(&Buffer_Rx, &data);
+    uint8_t c = *data;
+    rx_consume(1);
+    return c;
+}
+
+/* Releases bytes taken from the receive ring buffer, and the sender when
+ * the buffer has drained.
+ */
+void rx_consume(uint16_t count)
+{
+    ring_consume(&Buffer_Rx, count);
+#if FLOW_CONTROL
+    if(flow_held && ring_count(&Buffer_Rx) <= FLOW_LOW_WATER)
+        flow_release();
+#endif
+}
+
+#if FLOW_CONTROL
+/* Holds off the sender. Called from the receive ISR. */
+void flow_hold(void)
+{
+    if(flow_held)
+        return;
+
+    flow_held = 1;
+    ++flow_hold_count;
+    flow_hold_start = get_millis();
+#if FLOW_CONTROL == FLOW_CONTROL_RTS
+    FLOW_RTS_PORT |= (1 << FLOW_RTS_PIN);
+#else
+    uart_putc(0x13);
+#endif
+}
+
+/* Lets the sender continue. */
+void flow_release(void)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if(flow_held)
+        {
+            flow_held = 0;
+            flow_hold_ms += get_millis() - flow_hold_start;
+#if FLOW_CONTROL == FLOW_CONTROL_RTS
+            FLOW_RTS_PORT &= ~(1 << FLOW_RTS_PIN);
+#else
+            uart_putc(0x11);
+#endif
+        }
+    }
+}
+#endif
+
 uint32_t strtolong(const char* str)
 {
     uint32_t l = 0;
@@ -888,6 +1534,34 @@ void get_datetime(uint16_t* year, uint8_t* month, uint8_t* day, uint8_t* hour, u
 }
 #endif
 
+#if FAT_USE_MILLIS || FLOW_CONTROL
+static volatile uint32_t millis;
+
+void millis_init(void)
+{
+	/* CTC mode, prescaler 64, one compare match per millisecond */
+	TCCR0A = (1 << WGM01);
+	TCCR0B = (1 << CS01) | (1 << CS00);
+	OCR0A = F_CPU / 64 / 1000 - 1;
+	TIMSK0 = (1 << OCIE0A);
+}
+
+uint32_t get_millis(void)
+{
+	uint32_t ms;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		ms = millis;
+	}
+	return ms;
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+	++millis;
+}
+#endif
+
 /** ISR to manage the reception of data from the serial port, placing received bytes into a circular buffer
  *  for later transmission to the host.
  */
@@ -895,10 +1569,11 @@ ISR(USART1_RX_vect, ISR_BLOCK)
 {
 	uint8_t ReceivedByte = UDR1;
 
-	if ( !RingBuffer_IsFull(&Buffer_Rx))
-	  RingBuffer_Insert(&Buffer_Rx, ReceivedByte);
-	//else if ( RingBuffer_IsFull(&Buffer_Rx))
-	  //RingBuffer_Insert(&Buffer_Rx, ReceivedByte);
-	//if(max<Buffer_Rx.Count)
-		//max = Buffer_Rx.Count;
+	if(ring_put(&Buffer_Rx, ReceivedByte))
+	{
+	  if(ring_count(&Buffer_Rx) >= FLOW_HIGH_WATER)
+	    flow_hold();
+	}
+	else
+	  ++Buffer_Rx_Dropped;
 }
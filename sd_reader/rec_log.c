@@ -0,0 +1,740 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#include "byteordering.h"
+#include "crc16.h"
+#include "rec_log.h"
+#include "rec_log_config.h"
+#include "sd-reader_config.h"
+
+#include <string.h>
+
+#if USE_DYNAMIC_MEMORY
+    #include <stdlib.h>
+#endif
+
+#if FAT_WRITE_SUPPORT && REC_LOG_COUNT && !USE_DYNAMIC_MEMORY && 2 * REC_LOG_COUNT > FAT_FILE_COUNT
+    #error "each record log needs two file handles, raise FAT_FILE_COUNT"
+#endif
+
+#if DOXYGEN || (FAT_WRITE_SUPPORT && REC_LOG_COUNT)
+
+/**
+ * \addtogroup rec_log Record log support
+ *
+ * A log of records which can be looked up by their number or key.
+ *
+ * The records are appended to a data file. For every few records, an
+ * entry is appended to a separate index file. A record is found by a
+ * binary search through the index, followed by a short scan through
+ * the data file. Keys are usually timestamps and must not decrease
+ * from one record to the next.
+ *
+ * @{
+ */
+/**
+ * \file
+ * Record log implementation (license: GPLv2 or LGPLv2.1)
+ */
+
+/**
+ * \addtogroup rec_log_config Configuration of record log support
+ * Preprocessor defines to configure the record log support.
+ */
+
+/**
+ * \addtogroup rec_log_file Record log file layout
+ *
+ * data file record:
+ * =================
+ * offset  length  description
+ *      0       1  length n of the record data, at least 1
+ *      1       4  key
+ *      5       n  record data
+ *    5+n       2  checksum of the bytes 0 to 4+n
+ *
+ * index file header:
+ * ==================
+ * offset  length  description
+ *      0       4  magic "RIDX"
+ *      4       4  number of records per index entry
+ *
+ * index file entry:
+ * =================
+ * offset  length  description
+ *      0       4  data file offset of the first record
+ *      4       4  key of the first record
+ *
+ * Index entry \c i describes record number \c i times the number of
+ * records per index entry. The checksum is the CRC-16-CCITT in its
+ * bit-reversed form with an initial value of 0xffff, see crc16.h.
+ *
+ * A zero byte where a record would start is padding and is skipped.
+ *
+ * When the log is opened, the records behind the last index entry are
+ * checked. Missing index entries are added. A damaged record followed
+ * by intact ones is overwritten with padding, up to the next record with
+ * a matching checksum and a key not smaller than the previous one. Only
+ * damaged data at the end of the data file is cut off.
+ */
+
+#define REC_LOG_MAGIC 0x58444952 /* "RIDX" */
+#define REC_LOG_HEADER_SIZE 8
+#define REC_LOG_ENTRY_SIZE 8
+#define REC_LOG_RECORD_OVERHEAD 7
+
+struct rec_log_struct
+{
+    struct fat_file_struct* fd;
+    struct fat_file_struct* fd_index;
+    uint32_t interval;
+    uint32_t count;
+    uint32_t size;
+    uint32_t read_number;
+    uint32_t read_offset;
+};
+
+#if !USE_DYNAMIC_MEMORY
+static struct rec_log_struct rec_log_handles[REC_LOG_COUNT];
+#endif
+
+static uint8_t rec_log_seek(struct fat_file_struct* fd, uint32_t offset);
+static uint8_t rec_log_skip_padding(struct rec_log_struct* log, uint32_t* offset);
+static uint8_t rec_log_write_padding(struct rec_log_struct* log, uint32_t offset, uint32_t offset_end);
+static uint8_t rec_log_read_index(struct rec_log_struct* log, uint32_t entry, uint32_t* offset, uint32_t* key);
+static uint8_t rec_log_write_index(struct rec_log_struct* log, uint32_t entry, uint32_t offset, uint32_t key);
+static uint8_t rec_log_read_header(struct rec_log_struct* log, uint32_t* offset, uint8_t* header);
+static int8_t rec_log_read_record(struct rec_log_struct* log, uint32_t* offset, uint8_t* header, uint8_t* buffer, uintptr_t buffer_len);
+static uint8_t rec_log_recover(struct rec_log_struct* log, uint32_t data_size, uint32_t index_size);
+
+/**
+ * Opens a record log.
+ *
+ * If the index file is empty, a new index is written, using
+ * REC_LOG_INDEX_INTERVAL records per entry. Both files are
+ * checked for entries and records left incomplete.
+ *
+ * The log keeps one handle of each file open. The size of the data
+ * file is written to its directory entry when the log is synced.
+ *
+ * \param[in] fs The filesystem on which the log files lie.
+ * \param[in] data_entry The directory entry of the data file.
+ * \param[in] index_entry The directory entry of the index file.
+ * \returns The log handle, or 0 on failure.
+ * \see rec_log_close
+ */
+struct rec_log_struct* rec_log_open(struct fat_fs_struct* fs, const struct fat_dir_entry_struct* data_entry, const struct fat_dir_entry_struct* index_entry)
+{
+    if(!fs || !data_entry || !index_entry)
+        return 0;
+
+#if USE_DYNAMIC_MEMORY
+    struct rec_log_struct* log = malloc(sizeof(*log));
+    if(!log)
+        return 0;
+#else
+    struct rec_log_struct* log = rec_log_handles;
+    uint8_t i;
+    for(i = 0; i < REC_LOG_COUNT; ++i)
+    {
+        if(!log->fd)
+            break;
+
+        ++log;
+    }
+    if(i >= REC_LOG_COUNT)
+        return 0;
+#endif
+
+    memset(log, 0, sizeof(*log));
+
+    do
+    {
+        log->fd = fat_open_file(fs, data_entry);
+        if(!log->fd)
+            break;
+        log->fd_index = fat_open_file(fs, index_entry);
+        if(!log->fd_index)
+            break;
+
+        if(!fat_set_file_options(log->fd, FAT_FILE_DEFER_SIZE))
+            break;
+
+        int32_t data_size = 0;
+        int32_t index_size = 0;
+        if(!fat_seek_file(log->fd, &data_size, FAT_SEEK_END) ||
+           !fat_seek_file(log->fd_index, &index_size, FAT_SEEK_END) ||
+           !rec_log_recover(log, data_size, index_size))
+            break;
+
+        return log;
+
+    } while(0);
+
+    if(log->fd_index)
+        fat_close_file(log->fd_index);
+    if(log->fd)
+        fat_close_file(log->fd);
+#if USE_DYNAMIC_MEMORY
+    free(log);
+#else
+    log->fd = 0;
+#endif
+    return 0;
+}
+
+/**
+ * Closes a record log.
+ *
+ * The log is synced and its file handles are closed.
+ *
+ * \param[in] log The log to close.
+ * \see rec_log_open
+ */
+void rec_log_close(struct rec_log_struct* log)
+{
+    if(!log)
+        return;
+
+    rec_log_sync(log);
+    fat_close_file(log->fd_index);
+    fat_close_file(log->fd);
+
+#if USE_DYNAMIC_MEMORY
+    free(log);
+#else
+    log->fd = 0;
+#endif
+}
+
+/**
+ * Appends a record to a record log.
+ *
+ * The key must not be smaller than the key of the previous record.
+ *
+ * \param[in] log The log to which to append.
+ * \param[in] key The key of the record, usually a timestamp.
+ * \param[in] data The data of the record.
+ * \param[in] length The length of the record data, at least 1.
+ * \returns 0 on failure, 1 on success.
+ * \see rec_log_read
+ */
+uint8_t rec_log_append(struct rec_log_struct* log, uint32_t key, const uint8_t* data, uint8_t length)
+{
+    if(!log || !data || !length)
+        return 0;
+
+    /* index the first record of each interval */
+    if(log->count % log->interval == 0 &&
+       !rec_log_write_index(log, log->count / log->interval, log->size, key))
+        return 0;
+
+    uint8_t header[5];
+    header[0] = length;
+    key = htol32(key);
+    memcpy(&header[1], &key, sizeof(key));
+
+    uint16_t crc = crc16_block(0xffff, header, sizeof(header));
+    crc = htol16(crc16_block(crc, data, length));
+
+    struct fat_iovec iov[3];
+    iov[0].buffer = header;
+    iov[0].buffer_len = sizeof(header);
+    iov[1].buffer = (uint8_t*) data;
+    iov[1].buffer_len = length;
+    iov[2].buffer = (uint8_t*) &crc;
+    iov[2].buffer_len = sizeof(crc);
+
+    if(!rec_log_seek(log->fd, log->size) ||
+       fat_writev(log->fd, iov, 3) != (intptr_t) (REC_LOG_RECORD_OVERHEAD + length))
+        return 0;
+
+    log->size += REC_LOG_RECORD_OVERHEAD + length;
+    ++log->count;
+
+    return 1;
+}
+
+/**
+ * Writes all records and index entries of a record log to disk.
+ *
+ * \param[in] log The log to sync.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t rec_log_sync(struct rec_log_struct* log)
+{
+    if(!log)
+        return 0;
+
+    return fat_sync_file(log->fd) &&
+           fat_sync_file(log->fd_index);
+}
+
+/**
+ * Returns the number of records in a record log.
+ *
+ * \param[in] log The log of which to count the records.
+ * \returns The number of records.
+ */
+uint32_t rec_log_count(const struct rec_log_struct* log)
+{
+    return log ? log->count : 0;
+}
+
+/**
+ * Lets the next read of a record log start at the given record.
+ *
+ * \param[in] log The log in which to seek.
+ * \param[in] number The number of the record, starting with 0.
+ * \returns 0 on failure, 1 on success.
+ * \see rec_log_seek_key, rec_log_read
+ */
+uint8_t rec_log_seek_record(struct rec_log_struct* log, uint32_t number)
+{
+    if(!log || number > log->count)
+        return 0;
+
+    uint32_t offset = log->size;
+    if(number < log->count)
+    {
+        uint32_t key;
+        if(!rec_log_read_index(log, number / log->interval, &offset, &key))
+            return 0;
+
+        /* skip the records in front of it */
+        for(uint32_t n = number % log->interval; n > 0; --n)
+        {
+            uint8_t header[5];
+            if(!rec_log_read_header(log, &offset, header))
+                return 0;
+
+            offset += REC_LOG_RECORD_OVERHEAD + header[0];
+        }
+    }
+
+    log->read_number = number;
+    log->read_offset = offset;
+
+    return 1;
+}
+
+/**
+ * Lets the next read of a record log start at the first record
+ * with at least the given key.
+ *
+ * If all records have a smaller key, the next read returns the end
+ * of the log.
+ *
+ * \param[in] log The log in which to seek.
+ * \param[in] key The key to look for.
+ * \returns 0 on failure, 1 on success.
+ * \see rec_log_seek_record, rec_log_read
+ */
+uint8_t rec_log_seek_key(struct rec_log_struct* log, uint32_t key)
+{
+    if(!log)
+        return 0;
+
+    /* find the first index entry with at least the given key */
+    uint32_t entry_first = 0;
+    uint32_t entry_end = (log->count + log->interval - 1) / log->interval;
+    while(entry_first < entry_end)
+    {
+        uint32_t entry = entry_first + (entry_end - entry_first) / 2;
+        uint32_t entry_offset;
+        uint32_t entry_key;
+        if(!rec_log_read_index(log, entry, &entry_offset, &entry_key))
+            return 0;
+
+        if(entry_key < key)
+            entry_first = entry + 1;
+        else
+            entry_end = entry;
+    }
+
+    /* the record may be among those of the previous entry */
+    if(entry_first > 0)
+        --entry_first;
+
+    uint32_t number = entry_first * log->interval;
+    uint32_t offset = 0;
+    if(number < log->count)
+    {
+        uint32_t entry_key;
+        if(!rec_log_read_index(log, entry_first, &offset, &entry_key))
+            return 0;
+    }
+
+    /* scan the records for the key */
+    for(; number < log->count; ++number)
+    {
+        uint8_t header[5];
+        if(!rec_log_read_header(log, &offset, header))
+            return 0;
+
+        uint32_t record_key;
+        memcpy(&record_key, &header[1], sizeof(record_key));
+        if(ltoh32(record_key) >= key)
+            break;
+
+        offset += REC_LOG_RECORD_OVERHEAD + header[0];
+    }
+    if(number >= log->count)
+        offset = log->size;
+
+    log->read_number = number;
+    log->read_offset = offset;
+
+    return 1;
+}
+
+/**
+ * Reads the next record of a record log.
+ *
+ * If the record is longer than the buffer, only its beginning is
+ * returned. The checksum of the whole record is checked nevertheless.
+ *
+ * \param[in] log The log from which to read.
+ * \param[out] key Receives the key of the record. May be zero.
+ * \param[out] buffer The buffer which receives the record data.
+ * \param[in] buffer_len The size of the buffer, at least 1.
+ * \returns The number of bytes read, 0 behind the last record, or -1 on failure or a checksum mismatch.
+ * \see rec_log_seek_record, rec_log_seek_key, rec_log_append
+ */
+intptr_t rec_log_read(struct rec_log_struct* log, uint32_t* key, uint8_t* buffer, uintptr_t buffer_len)
+{
+    if(!log || !buffer || !buffer_len)
+        return -1;
+
+    if(log->read_number >= log->count)
+        return 0;
+
+    uint8_t header[5];
+    if(rec_log_read_record(log, &log->read_offset, header, buffer, buffer_len) < 1)
+        return -1;
+
+    if(key)
+    {
+        memcpy(key, &header[1], sizeof(*key));
+        *key = ltoh32(*key);
+    }
+
+    ++log->read_number;
+    log->read_offset += REC_LOG_RECORD_OVERHEAD + header[0];
+
+    return buffer_len < header[0] ? buffer_len : header[0];
+}
+
+/**
+ * Moves the position of a file handle.
+ *
+ * \param[in] fd The file handle to move.
+ * \param[in] offset The new file offset.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t rec_log_seek(struct fat_file_struct* fd, uint32_t offset)
+{
+    int32_t pos = (int32_t) offset;
+    return fat_seek_file(fd, &pos, FAT_SEEK_SET);
+}
+
+/**
+ * Moves a data file offset past the padding in front of a record.
+ *
+ * \param[in] log The log to which the data file belongs.
+ * \param[in,out] offset The data file offset to move.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t rec_log_skip_padding(struct rec_log_struct* log, uint32_t* offset)
+{
+    if(!rec_log_seek(log->fd, *offset))
+        return 0;
+
+    while(*offset < log->size)
+    {
+        uint8_t chunk[16];
+        intptr_t read_length = fat_read_file(log->fd, chunk, sizeof(chunk));
+        if(read_length < 0)
+            return 0;
+        if(read_length == 0)
+            break;
+
+        for(uint8_t i = 0; i < read_length; ++i)
+        {
+            if(chunk[i])
+                return 1;
+            ++*offset;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Overwrites a range of the data file with padding.
+ *
+ * \param[in] log The log to which the data file belongs.
+ * \param[in] offset The data file offset where the range starts.
+ * \param[in] offset_end The data file offset where the range ends.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t rec_log_write_padding(struct rec_log_struct* log, uint32_t offset, uint32_t offset_end)
+{
+    if(!rec_log_seek(log->fd, offset))
+        return 0;
+
+    uint8_t zero[16];
+    memset(zero, 0, sizeof(zero));
+    while(offset < offset_end)
+    {
+        uint8_t length = offset_end - offset < sizeof(zero) ? offset_end - offset : sizeof(zero);
+        if(fat_write_file(log->fd, zero, length) != length)
+            return 0;
+        offset += length;
+    }
+
+    return 1;
+}
+
+/**
+ * Reads an entry of the index file.
+ *
+ * \param[in] log The log to which the index belongs.
+ * \param[in] entry The number of the entry.
+ * \param[out] offset Receives the data file offset of the entry's first record.
+ * \param[out] key Receives the key of the entry's first record.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t rec_log_read_index(struct rec_log_struct* log, uint32_t entry, uint32_t* offset, uint32_t* key)
+{
+    uint32_t buffer[2];
+    if(!rec_log_seek(log->fd_index, REC_LOG_HEADER_SIZE + entry * REC_LOG_ENTRY_SIZE) ||
+       fat_read_file(log->fd_index, (uint8_t*) buffer, sizeof(buffer)) != sizeof(buffer))
+        return 0;
+
+    *offset = ltoh32(buffer[0]);
+    *key = ltoh32(buffer[1]);
+    return 1;
+}
+
+/**
+ * Writes an entry of the index file.
+ *
+ * \param[in] log The log to which the index belongs.
+ * \param[in] entry The number of the entry.
+ * \param[in] offset The data file offset of the entry's first record.
+ * \param[in] key The key of the entry's first record.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t rec_log_write_index(struct rec_log_struct* log, uint32_t entry, uint32_t offset, uint32_t key)
+{
+    uint32_t buffer[2];
+    buffer[0] = htol32(offset);
+    buffer[1] = htol32(key);
+
+    return rec_log_seek(log->fd_index, REC_LOG_HEADER_SIZE + entry * REC_LOG_ENTRY_SIZE) &&
+           fat_write_file(log->fd_index, (const uint8_t*) buffer, sizeof(buffer)) == sizeof(buffer);
+}
+
+/**
+ * Reads the length and key of a record without checking it.
+ *
+ * \param[in] log The log from which to read.
+ * \param[in,out] offset The data file offset of the record, moved past any padding in front of it.
+ * \param[out] header Receives the first five bytes of the record.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t rec_log_read_header(struct rec_log_struct* log, uint32_t* offset, uint8_t* header)
+{
+    return rec_log_skip_padding(log, offset) &&
+           rec_log_seek(log->fd, *offset) &&
+           fat_read_file(log->fd, header, 5) == 5;
+}
+
+/**
+ * Reads a record and checks it.
+ *
+ * \param[in] log The log from which to read.
+ * \param[in,out] offset The data file offset of the record, moved past any padding in front of it.
+ * \param[out] header Receives the first five bytes of the record.
+ * \param[out] buffer The buffer which receives the record data. May be zero.
+ * \param[in] buffer_len The size of the buffer.
+ * \returns -1 on failure, 0 if no complete record with a matching checksum is found, 1 otherwise.
+ */
+int8_t rec_log_read_record(struct rec_log_struct* log, uint32_t* offset, uint8_t* header, uint8_t* buffer, uintptr_t buffer_len)
+{
+    if(!rec_log_skip_padding(log, offset) ||
+       !rec_log_seek(log->fd, *offset))
+        return -1;
+
+    intptr_t read_length = fat_read_file(log->fd, header, 5);
+    if(read_length < 0)
+        return -1;
+    if(read_length < 5 || !header[0])
+        return 0;
+
+    uint16_t crc = crc16_block(0xffff, header, 5);
+    uint8_t length = header[0];
+    if(!buffer)
+        buffer_len = 0;
+    if(buffer_len > length)
+        buffer_len = length;
+    length -= buffer_len;
+
+    /* read the record data, and whatever does not fit in small chunks */
+    while(buffer_len > 0 || length > 0)
+    {
+        uint8_t chunk[16];
+        uint8_t* chunk_buffer = buffer;
+        uint8_t chunk_len = buffer_len;
+        if(!buffer_len)
+        {
+            chunk_buffer = chunk;
+            chunk_len = length < sizeof(chunk) ? length : sizeof(chunk);
+            length -= chunk_len;
+        }
+        buffer_len = 0;
+
+        read_length = fat_read_file(log->fd, chunk_buffer, chunk_len);
+        if(read_length < 0)
+            return -1;
+        if(read_length < chunk_len)
+            return 0;
+
+        crc = crc16_block(crc, chunk_buffer, chunk_len);
+    }
+
+    uint16_t crc_stored;
+    read_length = fat_read_file(log->fd, (uint8_t*) &crc_stored, sizeof(crc_stored));
+    if(read_length < 0)
+        return -1;
+
+    return read_length == sizeof(crc_stored) && ltoh16(crc_stored) == crc;
+}
+
+/**
+ * Reads the index header and completes the index.
+ *
+ * \param[in] log The log to recover.
+ * \param[in] data_size The size of the data file in bytes.
+ * \param[in] index_size The size of the index file in bytes.
+ * \returns 0 on failure, 1 on success.
+ */
+uint8_t rec_log_recover(struct rec_log_struct* log, uint32_t data_size, uint32_t index_size)
+{
+    uint32_t header[2];
+    uint32_t entry_count = 0;
+    if(index_size < sizeof(header))
+    {
+        /* start a new index */
+        log->interval = REC_LOG_INDEX_INTERVAL;
+        header[0] = HTOL32(REC_LOG_MAGIC);
+        header[1] = htol32(log->interval);
+        if(!rec_log_seek(log->fd_index, 0) ||
+           fat_write_file(log->fd_index, (const uint8_t*) header, sizeof(header)) != sizeof(header))
+            return 0;
+    }
+    else
+    {
+        if(!rec_log_seek(log->fd_index, 0) ||
+           fat_read_file(log->fd_index, (uint8_t*) header, sizeof(header)) != sizeof(header))
+            return 0;
+
+        log->interval = ltoh32(header[1]);
+        if(header[0] != HTOL32(REC_LOG_MAGIC) || !log->interval)
+            return 0;
+
+        entry_count = (index_size - REC_LOG_HEADER_SIZE) / REC_LOG_ENTRY_SIZE;
+    }
+
+    /* find the last index entry which points into the data file */
+    uint32_t entry = entry_count;
+    uint32_t offset = 0;
+    uint32_t key = 0;
+    while(entry > 0)
+    {
+        --entry;
+        if(!rec_log_read_index(log, entry, &offset, &key))
+            return 0;
+        if(offset <= data_size)
+            break;
+
+        offset = 0;
+        key = 0;
+    }
+
+    /* drop the entries behind it, it is written again below */
+    if(index_size > REC_LOG_HEADER_SIZE + entry * REC_LOG_ENTRY_SIZE &&
+       !fat_resize_file(log->fd_index, REC_LOG_HEADER_SIZE + entry * REC_LOG_ENTRY_SIZE))
+        return 0;
+
+    /* check the records behind it and index them */
+    uint32_t number = entry * log->interval;
+    uint32_t key_min = key;
+    log->size = data_size;
+    while(offset < data_size)
+    {
+        uint8_t record_header[5];
+        uint32_t record_offset = offset;
+        int8_t valid = rec_log_read_record(log, &record_offset, record_header, 0, 0);
+        if(valid < 0)
+            return 0;
+        if(record_offset >= data_size)
+            break;
+
+        memcpy(&key, &record_header[1], sizeof(key));
+        key = ltoh32(key);
+        if(!valid || key < key_min)
+        {
+            /* resynchronise on the next intact record, if any */
+            uint32_t next = record_offset;
+            do
+            {
+                record_offset = ++next;
+                valid = rec_log_read_record(log, &record_offset, record_header, 0, 0);
+                if(valid < 0)
+                    return 0;
+                next = record_offset;
+
+                memcpy(&key, &record_header[1], sizeof(key));
+                key = ltoh32(key);
+            } while(record_offset < data_size && (!valid || key < key_min));
+
+            if(record_offset >= data_size)
+                break;
+            if(!rec_log_write_padding(log, offset, record_offset))
+                return 0;
+        }
+
+        if(number % log->interval == 0 &&
+           !rec_log_write_index(log, number / log->interval, record_offset, key))
+            return 0;
+
+        key_min = key;
+        offset = record_offset + REC_LOG_RECORD_OVERHEAD + record_header[0];
+        ++number;
+    }
+
+    /* cut off an incomplete record and damaged data at the end */
+    if(offset < data_size && !fat_resize_file(log->fd, offset))
+        return 0;
+
+    log->count = number;
+    log->size = offset;
+
+    return fat_sync_file(log->fd_index);
+}
+
+#endif
+
+/**
+ * @}
+ */
+
@@ -0,0 +1,53 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef REC_LOG_H
+#define REC_LOG_H
+
+#include <stdint.h>
+#include "fat.h"
+#include "rec_log_config.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \addtogroup rec_log
+ *
+ * @{
+ */
+/**
+ * \file
+ * Record log header (license: GPLv2 or LGPLv2.1)
+ */
+
+struct rec_log_struct;
+
+struct rec_log_struct* rec_log_open(struct fat_fs_struct* fs, const struct fat_dir_entry_struct* data_entry, const struct fat_dir_entry_struct* index_entry);
+void rec_log_close(struct rec_log_struct* log);
+uint8_t rec_log_append(struct rec_log_struct* log, uint32_t key, const uint8_t* data, uint8_t length);
+uint8_t rec_log_sync(struct rec_log_struct* log);
+uint32_t rec_log_count(const struct rec_log_struct* log);
+uint8_t rec_log_seek_record(struct rec_log_struct* log, uint32_t number);
+uint8_t rec_log_seek_key(struct rec_log_struct* log, uint32_t key);
+intptr_t rec_log_read(struct rec_log_struct* log, uint32_t* key, uint8_t* buffer, uintptr_t buffer_len);
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
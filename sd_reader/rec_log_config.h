@@ -0,0 +1,58 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef REC_LOG_CONFIG_H
+#define REC_LOG_CONFIG_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \addtogroup rec_log
+ *
+ * @{
+ */
+/**
+ * \file
+ * Record log configuration (license: GPLv2 or LGPLv2.1)
+ */
+
+/**
+ * \ingroup rec_log_config
+ * Maximum number of record log handles.
+ *
+ * Each log keeps two file handles open, which FAT_FILE_COUNT has to
+ * provide in addition to those used otherwise. 0 leaves record log
+ * support out.
+ */
+#define REC_LOG_COUNT 0
+
+/**
+ * \ingroup rec_log_config
+ * Number of records per index entry of a new record log.
+ *
+ * Looking up a record reads up to this many record headers after
+ * the binary search through the index. Each index entry takes
+ * eight bytes of the index file.
+ */
+#define REC_LOG_INDEX_INTERVAL 32
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/**
+ * \addtogroup ring Single-producer/single-consumer ring buffer
+ *
+ * A byte ring buffer shared by exactly one producer and one consumer,
+ * typically an ISR and the main loop.
+ *
+ * The producer only ever writes the head index, the consumer only ever
+ * writes the tail index. Both indices run freely and are masked only
+ * when addressing the storage, so their difference is the number of
+ * bytes buffered and all of the storage can be used. The buffer size
+ * must be a power of two of at most 32768 bytes.
+ *
+ * The indices take 16 bits, which the AVR cannot access in one go, yet
+ * no interrupt masking is needed: each side reads the other side's
+ * index until two reads agree, and writes its own one low byte first.
+ * A reader interrupting such a write sees at worst an index which lags
+ * behind, i.e. less free space or fewer bytes than there really are.
+ *
+ * Besides byte-wise access, the consumer may look at the contiguous
+ * bytes available with ring_peek_span() and release them with
+ * ring_consume() once it has dealt with them.
+ *
+ * @{
+ */
+/**
+ * \file
+ * Ring buffer header (license: GPLv2 or LGPLv2.1)
+ */
+
+/** Keeps the compiler from moving memory accesses across this point. */
+#define ring_barrier() __asm__ __volatile__("" ::: "memory")
+
+struct ring_struct
+{
+    uint8_t* buffer;
+    uint16_t mask;
+    volatile uint16_t head;
+    volatile uint16_t tail;
+};
+
+/**
+ * Reads an index written by the other side.
+ */
+static inline uint16_t ring_load(const volatile uint16_t* index)
+{
+    uint16_t value;
+    do
+        value = *index;
+    while(value != *index);
+    return value;
+}
+
+/**
+ * Writes the own index, the low byte first.
+ */
+static inline void ring_store(volatile uint16_t* index, uint16_t value)
+{
+#ifdef __AVR__
+    volatile uint8_t* bytes = (volatile uint8_t*) index;
+    bytes[0] = (uint8_t) value;
+    bytes[1] = (uint8_t) (value >> 8);
+#else
+    *index = value;
+#endif
+}
+
+/**
+ * Initializes a ring buffer.
+ *
+ * \param[out] ring The ring buffer to initialize.
+ * \param[in] buffer The storage of the ring buffer.
+ * \param[in] size The size of the storage, a power of two up to 32768.
+ */
+static inline void ring_init(struct ring_struct* ring, uint8_t* buffer, uint16_t size)
+{
+    ring->buffer = buffer;
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->tail = 0;
+}
+
+/**
+ * Returns the number of bytes in a ring buffer.
+ *
+ * When called while the other side is interrupted writing its index,
+ * the result may exceed the size of the storage.
+ */
+static inline uint16_t ring_count(const struct ring_struct* ring)
+{
+    uint16_t head = ring_load(&ring->head);
+    uint16_t tail = ring_load(&ring->tail);
+    return head - tail;
+}
+
+/**
+ * Returns the number of bytes which still fit into a ring buffer.
+ */
+static inline uint16_t ring_free(const struct ring_struct* ring)
+{
+    uint16_t count = ring_count(ring);
+    if(count > ring->mask)
+        return 0;
+    return ring->mask + 1 - count;
+}
+
+/**
+ * Appends a byte to a ring buffer. Producer only.
+ *
+ * \returns 0 if the ring buffer is full, 1 otherwise.
+ */
+static inline uint8_t ring_put(struct ring_struct* ring, uint8_t c)
+{
+    uint16_t head = ring->head;
+    if((uint16_t) (head - ring_load(&ring->tail)) > ring->mask)
+        return 0;
+
+    ring->buffer[head & ring->mask] = c;
+    ring_barrier();
+    ring_store(&ring->head, head + 1);
+    return 1;
+}
+
+/**
+ * Takes a byte from a ring buffer, which must not be empty. Consumer only.
+ */
+static inline uint8_t ring_get(struct ring_struct* ring)
+{
+    uint16_t tail = ring->tail;
+    uint8_t c = ring->buffer[tail & ring->mask];
+    ring_barrier();
+    ring_store(&ring->tail, tail + 1);
+    return c;
+}
+
+/**
+ * Gives access to the bytes at the front of a ring buffer which are
+ * stored contiguously. Consumer only.
+ *
+ * Further bytes may follow at the start of the storage, available
+ * through another call after the bytes given have been consumed.
+ *
+ * \param[in] ring The ring buffer.
+ * \param[out] data Pointer to the first byte.
+ * \returns The number of contiguous bytes, 0 if the ring buffer is empty.
+ */
+static inline uint16_t ring_peek_span(const struct ring_struct* ring, const uint8_t** data)
+{
+    uint16_t tail = ring->tail;
+    uint16_t count = ring_load(&ring->head) - tail;
+    uint16_t offset = tail & ring->mask;
+    ring_barrier();
+
+    *data = ring->buffer + offset;
+    if(count > ring->mask + 1 - offset)
+        return ring->mask + 1 - offset;
+    return count;
+}
+
+/**
+ * Releases bytes at the front of a ring buffer. Consumer only.
+ *
+ * \param[in] ring The ring buffer.
+ * \param[in] count The number of bytes, at most ring_count().
+ */
+static inline void ring_consume(struct ring_struct* ring, uint16_t count)
+{
+    uint16_t tail = ring->tail + count;
+    ring_barrier();
+    ring_store(&ring->tail, tail);
+}
+
+/**
+ * Discards the contents of a ring buffer. Consumer only.
+ */
+static inline void ring_flush(struct ring_struct* ring)
+{
+    uint16_t head = ring_load(&ring->head);
+    ring_barrier();
+    ring_store(&ring->tail, head);
+}
+
+/**
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
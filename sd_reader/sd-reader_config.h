@@ -28,8 +28,9 @@ extern "C"
  *
  * \note This file contains only configuration items relevant to
  * all sd-reader implementation files. For module specific configuration
- * options, please see the files fat_config.h, partition_config.h
- * and sd_raw_config.h.
+ * options, please see the files circ_log_config.h, fat_config.h,
+ * lz_file_config.h, partition_config.h, rec_log_config.h and
+ * sd_raw_config.h.
  */
 
 /**
@@ -153,6 +153,10 @@ static offset_t raw_block_address;
 /* flag to remember if raw_block was written to the card */
 static uint8_t raw_block_written;
 #endif
+/* which accesses do not replace the content of raw_block */
+static uint8_t raw_block_bypass;
+/* flag to remember if raw_block is mapped by sd_raw_map() */
+static uint8_t raw_block_mapped;
 #endif
 
 /* card type state */
@@ -320,6 +324,7 @@ uint8_t sd_raw_init()
 #if !SD_RAW_SAVE_RAM
     /* the first block is likely to be accessed first, so precache it here */
     raw_block_address = (offset_t) -1;
+    raw_block_mapped = 0;
 #if SD_RAW_WRITE_BUFFERING
     raw_block_written = 1;
 #endif
@@ -458,8 +463,14 @@ uint8_t sd_raw_read(offset_t offset, uint8_t* buffer, uintptr_t length)
         if(block_address != raw_block_address)
 #endif
         {
+#if !SD_RAW_SAVE_RAM
+            /* check if the block shall be read without caching it */
+            uint8_t bypass = (raw_block_mapped ||
+                              raw_block_bypass == SD_RAW_BYPASS_READS ||
+                              (raw_block_bypass == SD_RAW_BYPASS_BLOCKS && read_length == 512));
+#endif
 #if SD_RAW_WRITE_BUFFERING
-            if(!sd_raw_sync())
+            if(!bypass && !sd_raw_sync())
                 return 0;
 #endif
 
@@ -480,25 +491,30 @@ uint8_t sd_raw_read(offset_t offset, uint8_t* buffer, uintptr_t length)
             /* wait for data block (start byte 0xfe) */
             while(sd_raw_rec_byte() != 0xfe);
 
-#if SD_RAW_SAVE_RAM
-            /* read byte block */
-            uint16_t read_to = block_offset + read_length;
-            for(uint16_t i = 0; i < 512; ++i)
+#if !SD_RAW_SAVE_RAM
+            if(!bypass)
             {
-                uint8_t b = sd_raw_rec_byte();
-                if(i >= block_offset && i < read_to)
-                    *buffer++ = b;
+                /* read byte block */
+                uint8_t* cache = raw_block;
+                for(uint16_t i = 0; i < 512; ++i)
+                    *cache++ = sd_raw_rec_byte();
+                raw_block_address = block_address;
+
+                memcpy(buffer, raw_block + block_offset, read_length);
+                buffer += read_length;
             }
-#else
-            /* read byte block */
-            uint8_t* cache = raw_block;
-            for(uint16_t i = 0; i < 512; ++i)
-                *cache++ = sd_raw_rec_byte();
-            raw_block_address = block_address;
-
-            memcpy(buffer, raw_block + block_offset, read_length);
-            buffer += read_length;
+            else
 #endif
+            {
+                /* read byte block */
+                uint16_t read_to = block_offset + read_length;
+                for(uint16_t i = 0; i < 512; ++i)
+                {
+                    uint8_t b = sd_raw_rec_byte();
+                    if(i >= block_offset && i < read_to)
+                        *buffer++ = b;
+                }
+            }
             
             /* read crc16 */
             sd_raw_rec_byte();
@@ -683,22 +699,36 @@ uint8_t sd_raw_write(offset_t offset, const uint8_t* buffer, uintptr_t length)
         /* Merge the data to write with the content of the block.
          * Use the cached block if available.
          */
+        const uint8_t* block = raw_block;
         if(block_address != raw_block_address)
         {
-#if SD_RAW_WRITE_BUFFERING
-            if(!sd_raw_sync())
+            if((raw_block_bypass || raw_block_mapped) && write_length == 512)
+            {
+                /* write the whole block directly, keeping the cache */
+                block = buffer;
+            }
+            else if(raw_block_mapped)
+            {
+                /* the mapped block must not be replaced */
                 return 0;
-#endif
-
-            if(block_offset || write_length < 512)
+            }
+            else
             {
-                if(!sd_raw_read(block_address, raw_block, sizeof(raw_block)))
+#if SD_RAW_WRITE_BUFFERING
+                if(!sd_raw_sync())
                     return 0;
+#endif
+
+                if(block_offset || write_length < 512)
+                {
+                    if(!sd_raw_read(block_address, raw_block, sizeof(raw_block)))
+                        return 0;
+                }
+                raw_block_address = block_address;
             }
-            raw_block_address = block_address;
         }
 
-        if(buffer != raw_block)
+        if(block == raw_block && buffer != raw_block)
         {
             memcpy(raw_block + block_offset, buffer, write_length);
 
@@ -728,9 +758,9 @@ uint8_t sd_raw_write(offset_t offset, const uint8_t* buffer, uintptr_t length)
         sd_raw_send_byte(0xfe);
 
         /* write byte block */
-        uint8_t* cache = raw_block;
+        const uint8_t* data = block;
         for(uint16_t i = 0; i < 512; ++i)
-            sd_raw_send_byte(*cache++);
+            sd_raw_send_byte(*data++);
 
         /* write dummy crc16 */
         sd_raw_send_byte(0xff);
@@ -743,13 +773,14 @@ uint8_t sd_raw_write(offset_t offset, const uint8_t* buffer, uintptr_t length)
         /* deaddress card */
         unselect_card();
 
+#if SD_RAW_WRITE_BUFFERING
+        if(block == raw_block)
+            raw_block_written = 1;
+#endif
+
         buffer += write_length;
         offset += write_length;
         length -= write_length;
-
-#if SD_RAW_WRITE_BUFFERING
-        raw_block_written = 1;
-#endif
     }
 
     return 1;
@@ -833,6 +864,347 @@ uint8_t sd_raw_sync()
 }
 #endif
 
+/**
+ * \ingroup sd_raw
+ * Selects which accesses bypass the block cache.
+ *
+ * Data which is streamed through once should not replace the cached
+ * block, as this is usually a sector of filesystem metadata which is
+ * needed again soon. With \c SD_RAW_BYPASS_BLOCKS, reads and writes of
+ * whole blocks which are not cached are transferred directly between
+ * the card and the caller's buffer. \c SD_RAW_BYPASS_READS additionally
+ * reads parts of blocks directly. Partial writes always use the cache.
+ *
+ * \param[in] mode One of \c SD_RAW_BYPASS_NONE, \c SD_RAW_BYPASS_BLOCKS and \c SD_RAW_BYPASS_READS.
+ */
+void sd_raw_set_bypass(uint8_t mode)
+{
+#if !SD_RAW_SAVE_RAM
+    raw_block_bypass = mode;
+#endif
+}
+
+/**
+ * \ingroup sd_raw
+ * Maps a block into memory by pinning it in the block cache.
+ *
+ * Returns a pointer into the cached copy of the block containing
+ * \c offset, which stays valid until sd_raw_unmap() is called. Meanwhile,
+ * the block is not replaced: reads of other blocks bypass the cache,
+ * writes of whole other blocks are done directly and partial writes to
+ * other blocks fail.
+ *
+ * With \c discard set, the caller is going to overwrite the data from
+ * \c offset up to the end of the block. If \c offset is the start of a
+ * block which is not cached, the block is then not read from the card,
+ * and the mapped data is undefined until written.
+ *
+ * Only one block can be mapped at a time.
+ *
+ * \param[in] offset The offset of the data to map.
+ * \param[out] length The number of bytes accessible up to the end of the block.
+ * \param[in] discard Whether the mapped data need not be read.
+ * \returns A pointer to the data at \c offset, or 0 on failure.
+ * \see sd_raw_unmap, sd_raw_borrow
+ */
+uint8_t* sd_raw_map(offset_t offset, uint16_t* length, uint8_t discard)
+{
+#if SD_RAW_SAVE_RAM
+    return 0;
+#else
+    if(raw_block_mapped || !length)
+        return 0;
+
+    uint16_t block_offset = offset & 0x01ff;
+    offset_t block_address = offset - block_offset;
+    if(block_address != raw_block_address)
+    {
+        if(discard && !block_offset)
+        {
+            /* take over the cache without reading the block */
+#if SD_RAW_WRITE_BUFFERING
+            if(!sd_raw_sync())
+                return 0;
+#endif
+            raw_block_address = block_address;
+        }
+        else
+        {
+            /* load the block into the cache by reading a single byte */
+            uint8_t bypass = raw_block_bypass;
+            uint8_t b;
+            raw_block_bypass = SD_RAW_BYPASS_NONE;
+            uint8_t result = sd_raw_read(offset, &b, 1);
+            raw_block_bypass = bypass;
+            if(!result)
+                return 0;
+        }
+    }
+
+    raw_block_mapped = 1;
+
+    *length = 512 - block_offset;
+    return raw_block + block_offset;
+#endif
+}
+
+/**
+ * \ingroup sd_raw
+ * Lends the block cache to the caller as scratch memory.
+ *
+ * Changes still buffered in the cache are written to the card first,
+ * then the cache is dropped. The returned 512 bytes belong to the
+ * caller until it calls sd_raw_unmap() with \c dirty cleared. Meanwhile,
+ * card accesses behave like while a block is mapped with sd_raw_map().
+ * Return the buffer before the next filesystem operation, as these
+ * mostly need the cache.
+ *
+ * \returns A pointer to the 512 byte cache, or 0 on failure.
+ * \see sd_raw_unmap
+ */
+uint8_t* sd_raw_borrow()
+{
+#if SD_RAW_SAVE_RAM
+    return 0;
+#else
+    if(raw_block_mapped)
+        return 0;
+
+#if SD_RAW_WRITE_BUFFERING
+    if(!sd_raw_sync())
+        return 0;
+#endif
+
+    raw_block_address = (offset_t) -1;
+    raw_block_mapped = 1;
+
+    return raw_block;
+#endif
+}
+
+/**
+ * \ingroup sd_raw
+ * Unpins the block mapped by sd_raw_map() or lent by sd_raw_borrow().
+ *
+ * If the mapped data has been changed, the block is written to the
+ * card, or just marked as changed when write buffering is enabled.
+ * A buffer lent by sd_raw_borrow() is never written.
+ *
+ * \param[in] dirty Whether the mapped data has been changed.
+ * \returns 0 on failure, 1 on success.
+ * \see sd_raw_map
+ */
+uint8_t sd_raw_unmap(uint8_t dirty)
+{
+#if !SD_RAW_SAVE_RAM
+    if(!raw_block_mapped)
+        return 0;
+    raw_block_mapped = 0;
+
+    if(raw_block_address == (offset_t) -1)
+        return !dirty;
+
+    if(dirty)
+    {
+#if SD_RAW_WRITE_BUFFERING
+        raw_block_written = 0;
+#elif SD_RAW_WRITE_SUPPORT
+        return sd_raw_write(raw_block_address, raw_block, sizeof(raw_block));
+#else
+        return 0;
+#endif
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+#if DOXYGEN || SD_RAW_WRITE_SUPPORT
+/**
+ * \ingroup sd_raw
+ * Erases a range of blocks on the card.
+ *
+ * Tells the card that the data within the given range is no longer
+ * needed. Only blocks which completely lie within the range are
+ * erased, partial blocks at the borders are left untouched.
+ *
+ * Depending on the card, erased blocks read back as all zeros or
+ * all ones afterwards.
+ *
+ * \note MMC cards erase whole erase groups, which might be larger
+ *       than the requested range. Therefore this function does
+ *       nothing for MMC cards and just returns success.
+ *
+ * \param[in] offset The offset where the range to erase starts.
+ * \param[in] length The number of bytes to erase.
+ * \returns 0 on failure, 1 on success.
+ * \see sd_raw_write
+ */
+uint8_t sd_raw_erase(offset_t offset, offset_t length)
+{
+    if(sd_raw_locked())
+        return 0;
+
+    /* restrict the range to whole blocks */
+    offset_t block_first = (offset + 511) & ~((offset_t) 0x01ff);
+    offset_t block_end = (offset + length) & ~((offset_t) 0x01ff);
+    if(block_first >= block_end)
+        return 1;
+
+    if(!(sd_raw_card_type & ((1 << SD_RAW_SPEC_1) | (1 << SD_RAW_SPEC_2))))
+        return 1;
+
+#if SD_RAW_WRITE_BUFFERING
+    if(!sd_raw_sync())
+        return 0;
+#endif
+
+    /* drop the cached block if it gets erased */
+    if(raw_block_address >= block_first && raw_block_address < block_end)
+    {
+        if(raw_block_mapped)
+            return 0;
+        raw_block_address = (offset_t) -1;
+    }
+
+    /* address card */
+    select_card();
+
+    /* tag the first and the last block and erase them */
+#if SD_RAW_SDHC
+    if(sd_raw_card_type & (1 << SD_RAW_SPEC_SDHC))
+    {
+        block_first /= 512;
+        block_end /= 512;
+        block_end -= 1;
+    }
+    else
+#endif
+    {
+        block_end -= 512;
+    }
+
+    if(sd_raw_send_command(CMD_TAG_SECTOR_START, block_first) ||
+       sd_raw_send_command(CMD_TAG_SECTOR_END, block_end) ||
+       sd_raw_send_command(CMD_ERASE, 0))
+    {
+        unselect_card();
+        return 0;
+    }
+
+    /* wait while card is busy */
+    while(sd_raw_rec_byte() != 0xff);
+
+    /* deaddress card */
+    unselect_card();
+
+    return 1;
+}
+#endif
+
+#if DOXYGEN || SD_RAW_WRITE_SUPPORT
+/**
+ * \ingroup sd_raw
+ * Streams consecutive blocks obtained from a callback function to the card.
+ *
+ * All blocks are written with a single multiple block write command,
+ * which avoids the per-block command overhead and lets the card
+ * program the data at its full sequential rate.
+ *
+ * For each block, the callback is handed the 512 byte block cache to
+ * fill and the offset the block is written to. It returns a nonzero
+ * value to write the block, or zero to stop writing. The cache is dropped
+ * before the first block is requested, so this fails while a block is
+ * mapped with sd_raw_map().
+ *
+ * \note The blocks are written as they are, bypassing any filesystem.
+ *       Only write to blocks which are reserved for this purpose, e.g.
+ *       the extents of a preallocated file as returned by fat_get_extents().
+ *
+ * \param[in] offset The offset where to start writing, a multiple of 512.
+ * \param[in] count The maximum number of blocks to write.
+ * \param[in] callback The function used to obtain the blocks to write.
+ * \param[in] p An opaque pointer directly passed to the callback function.
+ * \returns 0 on failure, 1 on success.
+ * \see sd_raw_write_interval
+ */
+uint8_t sd_raw_write_blocks(offset_t offset, uint32_t count, sd_raw_write_interval_handler_t callback, void* p)
+{
+    if(sd_raw_locked() || !callback || (offset & 0x01ff) || raw_block_mapped)
+        return 0;
+    if(count == 0)
+        return 1;
+
+#if SD_RAW_WRITE_BUFFERING
+    if(!sd_raw_sync())
+        return 0;
+#endif
+
+    /* the cache is used for the data to write */
+    raw_block_address = (offset_t) -1;
+
+    /* address card */
+    select_card();
+
+    /* send multiple block request */
+#if SD_RAW_SDHC
+    if(sd_raw_send_command(CMD_WRITE_MULTIPLE_BLOCK, (sd_raw_card_type & (1 << SD_RAW_SPEC_SDHC) ? offset / 512 : offset)))
+#else
+    if(sd_raw_send_command(CMD_WRITE_MULTIPLE_BLOCK, offset))
+#endif
+    {
+        unselect_card();
+        return 0;
+    }
+
+    uint8_t result = 1;
+    for(; count > 0; --count, offset += 512)
+    {
+        if(!callback(raw_block, offset, p))
+            break;
+
+        /* send start byte */
+        sd_raw_send_byte(0xfc);
+
+        /* write byte block */
+        uint8_t* cache = raw_block;
+        for(uint16_t i = 0; i < 512; ++i)
+            sd_raw_send_byte(*cache++);
+
+        /* write dummy crc16 */
+        sd_raw_send_byte(0xff);
+        sd_raw_send_byte(0xff);
+
+        /* check the data response */
+        if((sd_raw_rec_byte() & 0x1f) != 0x05)
+            result = 0;
+
+        /* wait while card is busy */
+        while(sd_raw_rec_byte() != 0xff);
+
+        if(!result)
+            break;
+    }
+
+    /* send stop byte */
+    sd_raw_send_byte(0xfd);
+    sd_raw_rec_byte();
+
+    /* wait while card is busy */
+    while(sd_raw_rec_byte() != 0xff);
+
+    /* deaddress card */
+    unselect_card();
+
+    /* let card some time to finish */
+    sd_raw_rec_byte();
+
+    return result;
+}
+#endif
+
 /**
  * \ingroup sd_raw
  * Reads informational data from the card.
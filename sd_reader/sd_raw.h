@@ -49,6 +49,19 @@ extern "C"
  */
 #define SD_RAW_FORMAT_UNKNOWN 3
 
+/**
+ * All accesses use the block cache.
+ */
+#define SD_RAW_BYPASS_NONE 0
+/**
+ * Accesses of whole blocks bypass the block cache.
+ */
+#define SD_RAW_BYPASS_BLOCKS 1
+/**
+ * Accesses of whole blocks and partial reads bypass the block cache.
+ */
+#define SD_RAW_BYPASS_READS 2
+
 /**
  * This struct is used by sd_raw_get_info() to return
  * manufacturing and status information of the card.
@@ -133,6 +146,12 @@ uint8_t sd_raw_read_interval(offset_t offset, uint8_t* buffer, uintptr_t interva
 uint8_t sd_raw_write(offset_t offset, const uint8_t* buffer, uintptr_t length);
 uint8_t sd_raw_write_interval(offset_t offset, uint8_t* buffer, uintptr_t length, sd_raw_write_interval_handler_t callback, void* p);
 uint8_t sd_raw_sync();
+void sd_raw_set_bypass(uint8_t mode);
+uint8_t* sd_raw_map(offset_t offset, uint16_t* length, uint8_t discard);
+uint8_t* sd_raw_borrow();
+uint8_t sd_raw_unmap(uint8_t dirty);
+uint8_t sd_raw_erase(offset_t offset, offset_t length);
+uint8_t sd_raw_write_blocks(offset_t offset, uint32_t count, sd_raw_write_interval_handler_t callback, void* p);
 
 uint8_t sd_raw_get_info(struct sd_raw_info* info);
 
@@ -0,0 +1,390 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Sends a dump to the card through the framed transfer protocol.
+ *
+ * Build on the host with:
+ *     cc -std=gnu99 -O2 -o dump_peer dump_peer.c
+ *
+ * Usage:
+ *     dump_peer <serial device> <dump file> [-b baud] [-i id]
+ *
+ * The serial device may be a real port or a pty. After the card's 't'
+ * prompt, the dump is sent with up to FRAME_WINDOW unacknowledged frames
+ * in flight. Frames not acknowledged in time are sent again. If the link
+ * is lost, running the tool again with the same dump and id continues
+ * the transfer where the card's copy ends. The id defaults to a checksum
+ * of the dump contents and its size.
+ *
+ * Exits with 0 when the card has confirmed the complete dump, 1 when it
+ * refused it, and 3 when the link has been lost.
+ *
+ * See main.c for the frame layout.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../crc16.h"
+
+#define FRAME_SYNC 0xa5
+#define FRAME_OPEN 'O'
+#define FRAME_ACCEPT 'A'
+#define FRAME_DATA 'D'
+#define FRAME_END 'E'
+#define FRAME_ACK 'K'
+#define FRAME_FAIL 'F'
+#define FRAME_DATA_MAX 64
+#define FRAME_WINDOW 3
+
+/* time to wait for an acknowledgement before sending frames again */
+#define RETRY_MS 500
+/* number of retries without progress after which the link is considered lost */
+#define RETRY_COUNT 10
+
+static int port;
+static uint8_t frame[3 + FRAME_DATA_MAX + 2];
+static unsigned frame_pos;
+
+static long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static void put32(uint8_t* p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static uint32_t get32(const uint8_t* p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void frame_send(uint8_t type, uint8_t seq, const uint8_t* data, uint8_t length)
+{
+    uint8_t buffer[1 + 3 + FRAME_DATA_MAX + 2];
+    buffer[0] = FRAME_SYNC;
+    buffer[1] = type;
+    buffer[2] = seq;
+    buffer[3] = length;
+    memcpy(buffer + 4, data, length);
+
+    uint16_t crc = crc16_block(0xffff, buffer + 1, 3 + length);
+    buffer[4 + length] = crc & 0xff;
+    buffer[5 + length] = crc >> 8;
+
+    size_t left = 6 + length;
+    const uint8_t* p = buffer;
+    while(left > 0)
+    {
+        ssize_t written = write(port, p, left);
+        if(written < 0)
+        {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("write");
+            exit(3);
+        }
+        p += written;
+        left -= written;
+    }
+}
+
+/* reads a byte, returns -1 if none arrives until the deadline */
+static int port_getc(long deadline)
+{
+    while(1)
+    {
+        long timeout = deadline - now_ms();
+        if(timeout < 0)
+            timeout = 0;
+
+        struct pollfd pfd = { port, POLLIN, 0 };
+        int ready = poll(&pfd, 1, (int) timeout);
+        if(ready < 0 && errno == EINTR)
+            continue;
+        if(ready <= 0)
+            return -1;
+
+        uint8_t c;
+        ssize_t got = read(port, &c, 1);
+        if(got == 1)
+            return c;
+        if(got < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(got == 0 && timeout > 0)
+        {
+            /* a pty without a peer reports end of file */
+            usleep(10000);
+            continue;
+        }
+        return -1;
+    }
+}
+
+/* waits for a valid frame, returns 0 if none arrives until the deadline */
+static int frame_receive(long deadline)
+{
+    while(1)
+    {
+        int c = port_getc(deadline);
+        if(c < 0)
+            return 0;
+
+        if(!frame_pos)
+        {
+            if(c == FRAME_SYNC)
+                frame_pos = 1;
+            continue;
+        }
+
+        frame[frame_pos++ - 1] = c;
+        if(frame_pos == 4 && frame[2] > FRAME_DATA_MAX)
+        {
+            frame_pos = 0;
+            continue;
+        }
+        if(frame_pos < 4 || frame_pos < 1 + 3 + frame[2] + 2u)
+            continue;
+
+        frame_pos = 0;
+        unsigned length = 3 + frame[2];
+        if(crc16_block(0xffff, frame, length) == (frame[length] | (frame[length + 1] << 8)))
+            return 1;
+    }
+}
+
+static speed_t baud_constant(long baud)
+{
+    switch(baud)
+    {
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        default:
+            fprintf(stderr, "unsupported baud rate %ld\n", baud);
+            exit(2);
+    }
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s <serial device> <dump file> [-b baud] [-i id]\n", name);
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+        usage(argv[0]);
+
+    long baud = 9600;
+    int id_given = 0;
+    uint32_t id = 0;
+    for(int i = 3; i < argc; i += 2)
+    {
+        if(i + 1 >= argc)
+            usage(argv[0]);
+
+        if(!strcmp(argv[i], "-b"))
+            baud = strtol(argv[i + 1], 0, 0);
+        else if(!strcmp(argv[i], "-i"))
+            id = strtoul(argv[i + 1], 0, 0), id_given = 1;
+        else
+            usage(argv[0]);
+    }
+
+    FILE* f = fopen(argv[2], "rb");
+    if(!f)
+    {
+        perror("fopen");
+        return 2;
+    }
+    fseek(f, 0, SEEK_END);
+    long dump_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t* dump = malloc(dump_size + 1);
+    if(!dump || fread(dump, 1, dump_size, f) != (size_t) dump_size)
+    {
+        perror("fread");
+        return 2;
+    }
+    fclose(f);
+
+    if(!id_given)
+        id = ((uint32_t) crc16_block(0xffff, dump, dump_size) << 16) ^ (uint32_t) dump_size;
+
+    port = open(argv[1], O_RDWR | O_NOCTTY);
+    if(port < 0)
+    {
+        perror("open");
+        return 3;
+    }
+    if(isatty(port))
+    {
+        struct termios tio;
+        tcgetattr(port, &tio);
+        cfmakeraw(&tio);
+        cfsetispeed(&tio, baud_constant(baud));
+        cfsetospeed(&tio, baud_constant(baud));
+        tcsetattr(port, TCSANOW, &tio);
+    }
+
+    /* wait for the card's prompt */
+    fprintf(stderr, "waiting for the card\n");
+    while(1)
+    {
+        int c = port_getc(now_ms() + 60000);
+        if(c < 0)
+        {
+            fprintf(stderr, "no prompt from the card\n");
+            return 3;
+        }
+        if(c == 't')
+            break;
+    }
+
+    /* open the session and learn where to continue */
+    uint8_t open_data[4];
+    put32(open_data, id);
+    uint32_t offset = 0;
+    int retries = 0;
+    while(1)
+    {
+        frame_send(FRAME_OPEN, 0, open_data, sizeof(open_data));
+
+        long deadline = now_ms() + RETRY_MS;
+        int accepted = 0;
+        while(frame_receive(deadline))
+        {
+            if(frame[0] == FRAME_FAIL)
+            {
+                fprintf(stderr, "the card refused the dump\n");
+                return 1;
+            }
+            if(frame[0] == FRAME_ACCEPT && frame[2] == 4)
+            {
+                offset = get32(frame + 3);
+                accepted = 1;
+                break;
+            }
+        }
+        if(accepted)
+            break;
+        if(++retries > RETRY_COUNT)
+        {
+            fprintf(stderr, "no answer from the card\n");
+            return 3;
+        }
+    }
+    if(offset > (uint32_t) dump_size)
+    {
+        fprintf(stderr, "the card holds %lu bytes, more than the dump\n", (unsigned long) offset);
+        return 1;
+    }
+    if(offset > 0)
+        fprintf(stderr, "resuming at offset %lu\n", (unsigned long) offset);
+
+    /* frame n carries the dump data from offset + n * FRAME_DATA_MAX, the last one ends the dump */
+    uint32_t frame_count = (dump_size - offset + FRAME_DATA_MAX - 1) / FRAME_DATA_MAX + 1;
+    uint32_t base = 0;
+    uint32_t next = 0;
+    uint32_t went_back = (uint32_t) -1;
+    retries = 0;
+    long deadline = now_ms() + RETRY_MS;
+    while(base < frame_count)
+    {
+        /* fill the window */
+        while(next < frame_count && next - base < FRAME_WINDOW)
+        {
+            if(next + 1 == frame_count)
+            {
+                uint8_t total[4];
+                put32(total, dump_size);
+                frame_send(FRAME_END, next, total, sizeof(total));
+            }
+            else
+            {
+                uint32_t position = offset + next * FRAME_DATA_MAX;
+                uint32_t length = dump_size - position < FRAME_DATA_MAX ? dump_size - position : FRAME_DATA_MAX;
+                frame_send(FRAME_DATA, next, dump + position, length);
+            }
+            ++next;
+        }
+
+        if(!frame_receive(deadline))
+        {
+            /* nothing acknowledged in time, send the window again */
+            if(++retries > RETRY_COUNT)
+            {
+                fprintf(stderr, "link lost at offset %lu, run again to resume\n",
+                        (unsigned long) (offset + base * FRAME_DATA_MAX));
+                return 3;
+            }
+            next = base;
+            deadline = now_ms() + RETRY_MS;
+            continue;
+        }
+
+        if(frame[0] == FRAME_FAIL)
+        {
+            fprintf(stderr, "the card failed to store the dump\n");
+            return 1;
+        }
+        if(frame[0] != FRAME_ACK)
+            continue;
+
+        /* the acknowledgement names the next frame expected, within the frames sent */
+        uint8_t ahead = (uint8_t) (frame[1] - (uint8_t) base);
+        if(ahead > next - base)
+            continue;
+
+        if(ahead > 0)
+        {
+            base += ahead;
+            retries = 0;
+            went_back = (uint32_t) -1;
+            deadline = now_ms() + RETRY_MS;
+        }
+        else if(went_back != base)
+        {
+            /* a frame got lost, go back to it once */
+            went_back = base;
+            next = base;
+        }
+    }
+
+    fprintf(stderr, "%lu bytes sent, dump complete\n", (unsigned long) (dump_size - offset));
+    free(dump);
+    close(port);
+    return 0;
+}
+
@@ -0,0 +1,219 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Decompresses a file written through lz_file.c and copied from the card.
+ *
+ * Build on the host with:
+ *     cc -std=c99 -O2 -o lz_file_unpack lz_file_unpack.c
+ *
+ * Usage:
+ *     lz_file_unpack <compressed file> [-s start] [-n length] > <output file>
+ *
+ * The decompressed data is written to stdout. With -s, output starts at
+ * the given position of the uncompressed data, and only the blocks from
+ * the one holding it onwards are decompressed. -n limits the number of
+ * bytes written.
+ *
+ * See lz_file.c for the file layout.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ_FILE_BLOCK_SIZE 4096
+#define LZ_FILE_HEADER_SIZE 6
+#define LZ_FILE_MATCH_MIN 3
+
+static uint8_t* file;
+static long file_size;
+
+static int block_header(long block, uint32_t* pos)
+{
+    long offset = block * LZ_FILE_BLOCK_SIZE;
+    if(offset + LZ_FILE_HEADER_SIZE > file_size || file[offset] != 'L' || file[offset + 1] != 'Z')
+        return 0;
+
+    const uint8_t* p = file + offset + 2;
+    *pos = (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+    return 1;
+}
+
+/* decompresses a block, returns the number of bytes produced */
+static size_t block_decode(long block, uint8_t** out, size_t* out_size)
+{
+    long offset = block * LZ_FILE_BLOCK_SIZE + LZ_FILE_HEADER_SIZE;
+    long end = (block + 1) * LZ_FILE_BLOCK_SIZE;
+    if(end > file_size)
+        end = file_size;
+
+    size_t produced = 0;
+    while(offset < end)
+    {
+        uint8_t flags = file[offset++];
+        for(int i = 0; i < 8 && offset < end; ++i)
+        {
+            if(produced + 66 > *out_size)
+            {
+                *out_size = *out_size * 2 + 4096;
+                *out = realloc(*out, *out_size);
+                if(!*out)
+                {
+                    perror("realloc");
+                    exit(1);
+                }
+            }
+
+            if(!(flags & (1 << i)))
+            {
+                (*out)[produced++] = file[offset++];
+                continue;
+            }
+
+            if(offset + 2 > end)
+                return produced;
+
+            uint16_t token = file[offset] | (file[offset + 1] << 8);
+            offset += 2;
+
+            uint16_t distance = token & 0x3ff;
+            uint16_t length = (token >> 10) + LZ_FILE_MATCH_MIN;
+            if(!distance)
+                return produced;
+            if(distance > produced)
+            {
+                fprintf(stderr, "block %ld: invalid match\n", block);
+                return produced;
+            }
+
+            for(uint16_t j = 0; j < length; ++j, ++produced)
+                (*out)[produced] = (*out)[produced - distance];
+        }
+    }
+
+    return produced;
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 2)
+    {
+        fprintf(stderr, "usage: %s <compressed file> [-s start] [-n length]\n", argv[0]);
+        return 2;
+    }
+
+    unsigned long start = 0;
+    unsigned long length = (unsigned long) -1;
+    for(int i = 2; i + 1 < argc; i += 2)
+    {
+        if(!strcmp(argv[i], "-s"))
+            start = strtoul(argv[i + 1], 0, 0);
+        else if(!strcmp(argv[i], "-n"))
+            length = strtoul(argv[i + 1], 0, 0);
+    }
+
+    FILE* f = fopen(argv[1], "rb");
+    if(!f)
+    {
+        perror("fopen");
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    file = malloc(file_size + 1);
+    if(!file || fread(file, 1, file_size, f) != (size_t) file_size)
+    {
+        perror("fread");
+        return 1;
+    }
+    fclose(f);
+
+    long block_count = (file_size + LZ_FILE_BLOCK_SIZE - 1) / LZ_FILE_BLOCK_SIZE;
+    uint32_t pos;
+    if(block_count == 0)
+        return 0;
+    if(!block_header(0, &pos))
+    {
+        fprintf(stderr, "%s: not a compressed file\n", argv[1]);
+        return 1;
+    }
+
+    /* find the last block starting at or before the start position */
+    long block_first = 0;
+    long block_end = block_count;
+    while(block_end - block_first > 1)
+    {
+        long block = block_first + (block_end - block_first) / 2;
+        if(!block_header(block, &pos))
+        {
+            fprintf(stderr, "block %ld: header missing\n", block);
+            return 1;
+        }
+
+        if(pos <= start)
+            block_first = block;
+        else
+            block_end = block;
+    }
+
+    uint8_t* out = 0;
+    size_t out_size = 0;
+    for(long block = block_first; block < block_count && length > 0; ++block)
+    {
+        uint32_t block_pos;
+        if(!block_header(block, &block_pos))
+        {
+            fprintf(stderr, "block %ld: header missing\n", block);
+            return 1;
+        }
+
+        size_t produced = block_decode(block, &out, &out_size);
+
+        /* a block cut short ends where the next one begins */
+        uint32_t next_pos;
+        if(block + 1 < block_count && block_header(block + 1, &next_pos))
+        {
+            if(next_pos - block_pos < produced)
+            {
+                produced = next_pos - block_pos;
+            }
+            else if(next_pos - block_pos > produced)
+            {
+                fprintf(stderr, "block %ld: %lu bytes lost\n", block, (unsigned long) (next_pos - block_pos - produced));
+                size_t lost = next_pos - block_pos;
+                if(lost > out_size)
+                {
+                    out = realloc(out, lost);
+                    out_size = lost;
+                }
+                memset(out + produced, 0, lost - produced);
+                produced = lost;
+            }
+        }
+
+        size_t skip = 0;
+        if(start > block_pos)
+            skip = start - block_pos < produced ? start - block_pos : produced;
+        size_t count = produced - skip;
+        if(count > length)
+            count = length;
+
+        fwrite(out + skip, 1, count, stdout);
+        length -= count;
+    }
+
+    free(out);
+    free(file);
+    return 0;
+}
+
@@ -0,0 +1,193 @@
+
+/*
+ * Copyright (c) 2026 by the contributors of this sd-reader port
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either the GNU General Public License version 2
+ * or the GNU Lesser General Public License version 2.1, both as
+ * published by the Free Software Foundation.
+ */
+
+/*
+ * Prints the records of a record log copied from the card.
+ *
+ * Build on the host with:
+ *     cc -std=c99 -O2 -o rec_log_dump rec_log_dump.c
+ *
+ * Usage:
+ *     rec_log_dump <data file> <index file> [-n number | -k key] [-c count]
+ *
+ * Without -n or -k, all records are printed. With -n, printing starts
+ * at the given record number, with -k at the first record with at least
+ * the given key. -c limits the number of records printed. Each record is
+ * printed on a line of its own: its number, its key and its data in hex.
+ *
+ * See rec_log.c for the file layout.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../crc16.h"
+
+#define REC_LOG_MAGIC 0x58444952 /* "RIDX" */
+#define REC_LOG_HEADER_SIZE 8
+#define REC_LOG_ENTRY_SIZE 8
+#define REC_LOG_RECORD_OVERHEAD 7
+
+static uint32_t get32(const uint8_t* p)
+{
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int read_at(FILE* f, long offset, uint8_t* buffer, size_t length)
+{
+    return fseek(f, offset, SEEK_SET) == 0 && fread(buffer, 1, length, f) == length;
+}
+
+static int read_entry(FILE* index, uint32_t entry, uint32_t* offset, uint32_t* key)
+{
+    uint8_t buffer[REC_LOG_ENTRY_SIZE];
+    if(!read_at(index, REC_LOG_HEADER_SIZE + (long) entry * REC_LOG_ENTRY_SIZE, buffer, sizeof(buffer)))
+        return 0;
+
+    *offset = get32(buffer);
+    *key = get32(buffer + 4);
+    return 1;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s <data file> <index file> [-n number | -k key] [-c count]\n", name);
+    exit(2);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc < 3)
+        usage(argv[0]);
+
+    int by_key = 0;
+    int by_number = 0;
+    uint32_t target = 0;
+    unsigned long count = (unsigned long) -1;
+    for(int i = 3; i < argc; ++i)
+    {
+        if(i + 1 >= argc)
+            usage(argv[0]);
+
+        if(!strcmp(argv[i], "-n"))
+            by_number = 1;
+        else if(!strcmp(argv[i], "-k"))
+            by_key = 1;
+        else if(strcmp(argv[i], "-c"))
+            usage(argv[0]);
+
+        unsigned long value = strtoul(argv[++i], 0, 0);
+        if(!strcmp(argv[i - 1], "-c"))
+            count = value;
+        else
+            target = (uint32_t) value;
+    }
+    if(by_key && by_number)
+        usage(argv[0]);
+
+    FILE* data = fopen(argv[1], "rb");
+    FILE* index = fopen(argv[2], "rb");
+    if(!data || !index)
+    {
+        perror("fopen");
+        return 1;
+    }
+
+    uint8_t header[REC_LOG_HEADER_SIZE];
+    if(!read_at(index, 0, header, sizeof(header)) || get32(header) != REC_LOG_MAGIC || !get32(header + 4))
+    {
+        fprintf(stderr, "%s: no record log index\n", argv[2]);
+        return 1;
+    }
+    uint32_t interval = get32(header + 4);
+
+    fseek(index, 0, SEEK_END);
+    uint32_t entry_count = (uint32_t) ((ftell(index) - REC_LOG_HEADER_SIZE) / REC_LOG_ENTRY_SIZE);
+
+    /* find the index entry in front of the first record to print */
+    uint32_t entry = 0;
+    if(by_number)
+    {
+        entry = target / interval;
+    }
+    else if(by_key)
+    {
+        uint32_t entry_end = entry_count;
+        while(entry < entry_end)
+        {
+            uint32_t mid = entry + (entry_end - entry) / 2;
+            uint32_t offset;
+            uint32_t key;
+            if(!read_entry(index, mid, &offset, &key))
+                return 1;
+
+            if(key < target)
+                entry = mid + 1;
+            else
+                entry_end = mid;
+        }
+        if(entry > 0)
+            --entry;
+    }
+
+    uint32_t number = entry * interval;
+    uint32_t offset = 0;
+    uint32_t key;
+    if(entry > 0 && (entry >= entry_count || !read_entry(index, entry, &offset, &key)))
+    {
+        fprintf(stderr, "record %lu not indexed\n", (unsigned long) number);
+        return 1;
+    }
+
+    /* walk the records, skipping the padding left by recovery */
+    uint8_t record[5 + 255 + 2];
+    while(count > 0 && read_at(data, offset, record, 1))
+    {
+        if(!record[0])
+        {
+            ++offset;
+            continue;
+        }
+        if(!read_at(data, offset, record, 5))
+            break;
+
+        uint8_t length = record[0];
+        key = get32(record + 1);
+        if(!read_at(data, offset + 5, record + 5, length + 2))
+        {
+            fprintf(stderr, "record %lu incomplete\n", (unsigned long) number);
+            return 1;
+        }
+        if(crc16_block(0xffff, record, 5 + length) != (record[5 + length] | (record[6 + length] << 8)))
+        {
+            fprintf(stderr, "record %lu checksum mismatch\n", (unsigned long) number);
+            return 1;
+        }
+
+        if((!by_number || number >= target) && (!by_key || key >= target))
+        {
+            printf("%lu %lu ", (unsigned long) number, (unsigned long) key);
+            for(uint8_t i = 0; i < length; ++i)
+                printf("%02x", record[5 + i]);
+            printf("\n");
+            --count;
+        }
+
+        offset += REC_LOG_RECORD_OVERHEAD + length;
+        ++number;
+    }
+
+    fclose(index);
+    fclose(data);
+    return 0;
+}
+